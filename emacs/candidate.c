@@ -52,6 +52,7 @@ static int
 set_page_candidates(uim_context context, candidate_info *cand)
 {
   int i, nr_in_page, start;
+  uim_candidate *u_cands;
 
   start = cand->page_index * cand->disp_limit;
   if (cand->disp_limit && ((cand->num - start) > cand->disp_limit))
@@ -59,19 +60,27 @@ set_page_candidates(uim_context context, candidate_info *cand)
   else
     nr_in_page = cand->num - start;
 
-  for (i = start; i < (start + nr_in_page); i++) {
-    uim_candidate u_cand;
-
-    u_cand = uim_get_candidate(context, i, cand->disp_limit ?
-					   i % cand->disp_limit :
-					   i);
-    free(cand->cand_array[i].str);
-    free(cand->cand_array[i].label);
-    cand->cand_array[i].str = uim_strdup(uim_candidate_get_cand_str(u_cand));
-    cand->cand_array[i].label = uim_strdup(uim_candidate_get_heading_label(u_cand));
-    uim_candidate_free(u_cand);
+  if (nr_in_page <= 0)
+    return 1;
+
+  u_cands = uim_malloc(sizeof(uim_candidate) * nr_in_page);
+  if (uim_get_candidates(context, start, nr_in_page, u_cands) != nr_in_page) {
+    free(u_cands);
+    return 0;
   }
 
+  for (i = 0; i < nr_in_page; i++) {
+    candidate *c = &cand->cand_array[start + i];
+
+    free(c->str);
+    free(c->label);
+    c->str = uim_strdup(uim_candidate_get_cand_str(u_cands[i]));
+    c->label = uim_strdup(uim_candidate_get_heading_label(u_cands[i]));
+  }
+
+  uim_candidates_free(u_cands, nr_in_page);
+  free(u_cands);
+
   return 1;
 }
 #endif
@@ -43,6 +43,7 @@ helper_send_im_list(void)
   int buflen;
   char *buf;
   const char *current_im_name;
+  const struct uim_im_info *ims;
   uim_agent_context *ua;
   int dummy_agent_context = 0;
 
@@ -56,7 +57,7 @@ helper_send_im_list(void)
 	ua = new_uim_agent_context(1, NULL);
   }
 
-  nim = uim_get_nr_im(ua->context);
+  ims = uim_get_im_list(ua->context, &nim);
 
   uim_get_current_im_name(ua->context);
   current_im_name = uim_get_current_im_name(ua->context);
@@ -71,9 +72,9 @@ helper_send_im_list(void)
 	const char *name, *lang, *shortd;
 	char *tmpbuf;
 
-	name = uim_get_im_name(ua->context, i);
-	lang = uim_get_im_language(ua->context, i);
-	shortd = uim_get_im_short_desc(ua->context, i);
+	name = ims[i].name;
+	lang = ims[i].lang;
+	shortd = ims[i].short_desc;
 
 	debug_printf(DEBUG_NOTE, " [%d] = %s %s %s\n", i, name, lang, shortd);
 	if (uim_asprintf(&tmpbuf, "%s\t%s\t%s\t%s\n",
@@ -98,7 +98,8 @@ show_im(const char *im)
 int
 list_im_engine(void)
 {
-  int i;
+  int i, nr;
+  const struct uim_im_info *ims;
 
   uim_context context;
 
@@ -106,29 +107,18 @@ list_im_engine(void)
 
   a_printf(" ( L ");
 
-  for (i = 0 ; i < uim_get_nr_im(context); i++) {
+  ims = uim_get_im_list(context, &nr);
+  for (i = 0 ; i < nr; i++) {
 	char dummy_str[] = "";
-	const char *name, *lang, *language, *shortd, *encoding;
+	const char *language;
 
-	if ((name = uim_get_im_name(context, i)) == NULL)
-	  name = dummy_str;
-
-	if ((lang = uim_get_im_language(context, i)) == NULL)
-	  lang = dummy_str;
-
-	if ((language = uim_get_language_name_from_locale(lang)) == NULL)
+	if ((language = uim_get_language_name_from_locale(ims[i].lang)) == NULL)
 	  language = dummy_str;
 
-	if ((shortd = uim_get_im_short_desc(context, i)) == NULL)
-	  shortd = dummy_str;
-	
 	a_printf(" ( \"%s\" \"%s\" \"%s\" \"%s\" ",
-			 name, lang, language, shortd);
+			 ims[i].name, ims[i].lang, language, ims[i].short_desc);
 
-	if ((encoding = uim_get_im_encoding(context, i)) == NULL)
-	  a_printf(" %s ) ", encoding);
-	else
-	  a_printf(" UTF-8 ) "); /* or nil? */
+	a_printf(" UTF-8 ) "); /* or nil? */
   }
 
   a_printf(" ) ");
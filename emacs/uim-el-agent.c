@@ -543,7 +543,8 @@ analyze_keyvector(char *vector, uim_key *ukey, char *keyname, size_t keyname_len
 static int
 process_keyvector(int serial, int cid, uim_key ukey, const char *keyname)
 {
-  int ret, ret2;
+  int ret, ret2, n;
+  struct uim_key_event events[2];
 
   if (! focused ||
 	  current == NULL || 
@@ -560,11 +561,25 @@ process_keyvector(int serial, int cid, uim_key ukey, const char *keyname)
 
   if (ukey.key >= 0) {
 	/* key input is received by requested context */
-	debug_printf(DEBUG_NOTE, "uim_press_key\n");
-	ret = uim_press_key(current->context, ukey.key, ukey.mod);
-
-	debug_printf(DEBUG_NOTE, "uim_release_key\n");
-	ret2 = uim_release_key(current->context, ukey.key, ukey.mod);
+	debug_printf(DEBUG_NOTE, "uim_press_keys\n");
+	events[0].key = events[1].key = ukey.key;
+	events[0].state = events[1].state = ukey.mod;
+	events[0].release = 0;
+	events[1].release = 1;
+	n = uim_press_keys(current->context, events, 2);
+	if (n < 1) {
+	  /* failed; fall back to sending them one by one */
+	  debug_printf(DEBUG_NOTE, "uim_press_key\n");
+	  events[0].result = uim_press_key(current->context, ukey.key, ukey.mod);
+	  n = 1;
+	}
+	if (n < 2) {
+	  /* not handled; the release still has to be sent */
+	  debug_printf(DEBUG_NOTE, "uim_release_key\n");
+	  events[1].result = uim_release_key(current->context, ukey.key, ukey.mod);
+	}
+	ret = events[0].result;
+	ret2 = events[1].result;
 
 	debug_printf(DEBUG_NOTE, "ret = %d, ret2 = %d\n", ret, ret2);
 
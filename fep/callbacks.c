@@ -87,6 +87,7 @@ static void prop_list_update_cb(void *ptr, const char *str);
 static struct preedit_tag *dup_preedit(struct preedit_tag *p);
 static void init_candidate(int nr, int display_limit);
 static void make_page_strs(void);
+static uim_candidate take_candidate(uim_candidate *cands, int start, int index, int index_in_page);
 static int numwidth(int n);
 static int index2page(int index);
 static void reset_candidate(void);
@@ -185,6 +186,42 @@ int press_key(int key, int key_state)
 }
 
 
+/*
+ * 複数のキーを押して離す。uimが処理しなかったキーがあればそこで止めて
+ * *rawをTRUEにする。送ったキーの数を返す。
+ */
+#define PRESS_KEYS_MAX 64
+int press_keys(const int *keys, const int *key_states, int nr_keys, int *raw)
+{
+  struct uim_key_event events[PRESS_KEYS_MAX * 2];
+  int i, done;
+
+  if (nr_keys > PRESS_KEYS_MAX) {
+    nr_keys = PRESS_KEYS_MAX;
+  }
+  for (i = 0; i < nr_keys; i++) {
+    events[i * 2].key = events[i * 2 + 1].key = keys[i];
+    events[i * 2].state = events[i * 2 + 1].state = key_states[i];
+    events[i * 2].release = FALSE;
+    events[i * 2 + 1].release = TRUE;
+  }
+  done = uim_press_keys(g_context, events, nr_keys * 2);
+  if (done == 0) {
+    /* エラー */
+    *raw = press_key(keys[0], key_states[0]);
+    return 1;
+  }
+
+  /* 処理されなかったキーは押されただけなので離す */
+  if (done % 2) {
+    uim_release_key(g_context, keys[done / 2], key_states[done / 2]);
+    *raw = TRUE;
+    return done / 2 + 1;
+  }
+  *raw = FALSE;
+  return done / 2;
+}
+
 /*
  * 名前が紛らわしいが、uim側から描画を要求されたら呼ぶ。
  */
@@ -786,6 +823,7 @@ static void make_page_strs(void)
   int page_width = 0;
   int index_in_page = 0;
   char *old_str;
+  uim_candidate *cands;
 
   int index, page, start, nr_in_virtual_page;
 
@@ -800,13 +838,19 @@ static void make_page_strs(void)
   else
     nr_in_virtual_page = s_candidate.nr - start;
 
+  /* 仮想ページの候補をまとめて取得する */
+  cands = uim_malloc(sizeof(uim_candidate) * (nr_in_virtual_page + 1));
+  if (uim_get_candidates(g_context, start, nr_in_virtual_page, cands) != nr_in_virtual_page) {
+    memset(cands, 0, sizeof(uim_candidate) * (nr_in_virtual_page + 1));
+  }
+
   for (index = start; index < (start + nr_in_virtual_page); index++) {
     /* A:工  S:広  D:向  F:考  J:構  K:敲  L:後  [残り 227] */
     int next = FALSE; /* flag whether to finish page */
     int add_extra_page = FALSE;
     /* "[10/20]" の幅 */
     int index_width;
-    uim_candidate cand = uim_get_candidate(g_context, index, index_in_page);
+    uim_candidate cand = take_candidate(cands, start, index, index_in_page);
     const char *cand_str_label = uim_candidate_get_heading_label(cand);
     char *cand_str_cand = tab2space(uim_candidate_get_cand_str(cand));
     int cand_label_width = strwidth(cand_str_label);
@@ -942,6 +986,28 @@ static void make_page_strs(void)
     free(cand_str);
   }
   free(page_str);
+
+  for (index = 0; index < nr_in_virtual_page; index++) {
+    if (cands[index] != NULL) {
+      uim_candidate_free(cands[index]);
+    }
+  }
+  free(cands);
+}
+
+/*
+ * make_page_strsでまとめて取得した候補を取り出す
+ * ページを分けたときはラベルが違うので取り直す
+ */
+static uim_candidate take_candidate(uim_candidate *cands, int start, int index, int index_in_page)
+{
+  uim_candidate cand = cands[index - start];
+
+  if (cand != NULL && index - start == index_in_page) {
+    cands[index - start] = NULL;
+    return cand;
+  }
+  return uim_get_candidate(g_context, index, index_in_page);
 }
 
 /*
@@ -50,6 +50,7 @@ struct preedit_tag {
 
 void init_callbacks(void);
 int press_key(int key, int key_state);
+int press_keys(const int *keys, const int *key_states, int nr_keys, int *raw);
 void start_callbacks(void);
 int end_callbacks(void);
 char *get_commit_str(void);
@@ -873,6 +873,10 @@ static void main_loop(void)
         }
       } else {
 
+        /* 押されたキーとその元の文字列 */
+        static int keys[BUFSIZE], key_states[BUFSIZE];
+        static int key_offsets[BUFSIZE], key_lens[BUFSIZE];
+        int nr_keys = 0;
         int i;
         for (i = 0; i < len; i++) {
           int key_len;
@@ -927,24 +931,35 @@ static void main_loop(void)
           if (g_opt.print_key) {
             print_key(key, key_state);
           } else {
-            int raw = press_key(key, key_state);
-            if (!draw()) {
-              if (g_opt.status_type == BACKTICK) {
-                update_backtick();
-              }
-            }
-            if (raw && !g_start_preedit) {
-              if (key_state & UMod_Alt) {
-                write(s_master, buf + i - 1, key_len + 1);
-              } else {
-                write(s_master, buf + i, key_len);
-              }
+            keys[nr_keys] = key;
+            key_states[nr_keys] = key_state;
+            if (key_state & UMod_Alt) {
+              key_offsets[nr_keys] = i - 1;
+              key_lens[nr_keys] = key_len + 1;
+            } else {
+              key_offsets[nr_keys] = i;
+              key_lens[nr_keys] = key_len;
             }
+            nr_keys++;
           }
 
           key_state = 0;
           i += (key_len - 1);
         }
+
+        /* まとめてuimに送り、uimが処理しなかったキーごとに描画する */
+        for (i = 0; i < nr_keys; ) {
+          int raw;
+          i += press_keys(keys + i, key_states + i, nr_keys - i, &raw);
+          if (!draw()) {
+            if (g_opt.status_type == BACKTICK) {
+              update_backtick();
+            }
+          }
+          if (raw && !g_start_preedit) {
+            write(s_master, buf + key_offsets[i - 1], key_lens[i - 1]);
+          }
+        }
       }
     }
 
@@ -89,6 +89,7 @@ struct preedit_segment {
 
 static int im_uim_fd = -1;
 static unsigned int read_tag;
+static unsigned int write_tag;
 #if IM_UIM_USE_SNOOPER
 static guint snooper_id;
 static gboolean snooper_installed = FALSE;
@@ -132,6 +133,7 @@ static GSList *get_page_candidates(IMUIMContext *uic, guint page, guint nr, guin
 static void free_candidates(GSList *candidates);
 #endif
 static void send_im_list(void);
+static void watch_helper_write(void);
 static UIMCandWinGtk *im_uim_create_cand_win_gtk(void);
 
 static const GTypeInfo class_info = {
@@ -652,23 +654,7 @@ clear_cb(void *ptr)
 
   uic->pseg = NULL;
   uic->nr_psegs = 0;
-}
-
-static void
-pushback_cb(void *ptr, int attr, const char *str)
-{
-  IMUIMContext *uic = (IMUIMContext *)ptr;
-  g_return_if_fail(str);
-
-  if (!strcmp(str, "")
-      && !(attr & (UPreeditAttr_Cursor | UPreeditAttr_Separator)))
-    return;
-
-  uic->pseg = realloc(uic->pseg,
-		      sizeof(struct preedit_segment) * (uic->nr_psegs + 1));
-  uic->pseg[uic->nr_psegs].str = g_strdup(str);
-  uic->pseg[uic->nr_psegs].attr = attr;
-  uic->nr_psegs++;
+  uic->preedit_generation = 0;
 }
 
 static void
@@ -693,6 +679,35 @@ update_cb(void *ptr)
   uic->prev_preedit_len = preedit_len;
 }
 
+static void
+preedit_snapshot_cb(void *ptr, const struct uim_preedit_snapshot *snapshot)
+{
+  IMUIMContext *uic = (IMUIMContext *)ptr;
+  const struct uim_preedit_segment *seg;
+  int i;
+
+  /* already shown */
+  if (snapshot->generation == uic->preedit_generation)
+    return;
+
+  clear_cb(uic);
+  if (snapshot->nr_segments)
+    uic->pseg = malloc(sizeof(struct preedit_segment) * snapshot->nr_segments);
+  for (i = 0; i < snapshot->nr_segments; i++) {
+    seg = &snapshot->segments[i];
+    if (seg->len == 0
+	&& !(seg->attr & (UPreeditAttr_Cursor | UPreeditAttr_Separator)))
+      continue;
+
+    uic->pseg[uic->nr_psegs].str = g_strndup(snapshot->str + seg->offset,
+					     seg->len);
+    uic->pseg[uic->nr_psegs].attr = seg->attr;
+    uic->nr_psegs++;
+  }
+  update_cb(uic);
+  uic->preedit_generation = snapshot->generation;
+}
+
 static void
 update_prop_list_cb(void *ptr, const char *str)
 {
@@ -711,6 +726,7 @@ update_prop_list_cb(void *ptr, const char *str)
 
   uim_helper_send_message(im_uim_fd, prop_list->str);
   g_string_free(prop_list, TRUE);
+  watch_helper_write();
 
   show_state = uim_scm_symbol_value_bool("bridge-show-input-state?");
   show_state_with = uim_scm_c_symbol(uim_scm_symbol_value("bridge-show-with?"));
@@ -752,6 +768,7 @@ get_page_candidates(IMUIMContext *uic,
 {
   gint i, page_nr, start;
   GSList *list = NULL;
+  uim_candidate *cands;
 
   start = page * display_limit;
   if (display_limit && (nr - start) > display_limit)
@@ -759,12 +776,15 @@ get_page_candidates(IMUIMContext *uic,
   else
     page_nr = nr - start;
 
-  for (i = start; i < (start + page_nr); i++) {
-    uim_candidate cand = uim_get_candidate(uic->uc, i,
-		    display_limit ? (int)(i % display_limit) : i);
-    list = g_slist_prepend(list, cand);
+  if (page_nr <= 0)
+    return NULL;
+
+  cands = g_new(uim_candidate, page_nr);
+  if (uim_get_candidates(uic->uc, start, page_nr, cands) == page_nr) {
+    for (i = page_nr - 1; i >= 0; i--)
+      list = g_slist_prepend(list, cands[i]);
   }
-  list = g_slist_reverse(list);
+  g_free(cands);
 
   return list;
 }
@@ -990,6 +1010,7 @@ switch_system_global_im_cb(void *ptr, const char *name)
   g_string_printf(msg, "im_change_whole_desktop\n%s\n", name);
   uim_helper_send_message(im_uim_fd, msg->str);
   g_string_free(msg, TRUE);
+  watch_helper_write();
 }
 
 static int
@@ -1053,24 +1074,34 @@ helper_disconnect_cb(void)
 {
   im_uim_fd = -1;
   g_source_remove(read_tag);
+  if (write_tag) {
+    g_source_remove(write_tag);
+    write_tag = 0;
+  }
 }
 
 static void
-parse_helper_str_im_change(const char *str)
+parse_helper_im_change(const struct uim_helper_frame *frame)
 {
   IMUIMContext *cc;
-  gchar **lines = g_strsplit(str, "\n", -1);
-  gchar *im_name = lines[1];
-  GString *im_name_sym = g_string_new(im_name);
+  const gchar *im_name;
+  GString *im_name_sym;
+
+  if (frame->nr_fields < 1)
+    return;
 
+  im_name = frame->fields[0];
+  im_name_sym = g_string_new(im_name);
   g_string_prepend_c(im_name_sym, '\'');
 
-  if (g_str_has_prefix(str, "im_change_this_text_area_only") == TRUE) {
+  switch (frame->type) {
+  case UHelperMsg_ImChangeThisTextAreaOnly:
     if (focused_context && disable_focused_context == FALSE) {
       uim_switch_im(focused_context->uc, im_name);
       uim_prop_list_update(focused_context->uc);
     }
-  } else if (g_str_has_prefix(str, "im_change_whole_desktop") == TRUE) {
+    break;
+  case UHelperMsg_ImChangeWholeDesktop:
     for (cc = context_list.next; cc != &context_list; cc = cc->next) {
       uim_switch_im(cc->uc, im_name);
       uim_prop_update_custom(cc->uc, "custom-preserved-default-im-name",
@@ -1078,7 +1109,8 @@ parse_helper_str_im_change(const char *str)
       if (focused_context && cc == focused_context)
 	uim_prop_list_update(cc->uc);
     }
-  } else if (g_str_has_prefix(str, "im_change_this_application_only") == TRUE) {
+    break;
+  case UHelperMsg_ImChangeThisApplicationOnly:
     if (focused_context && disable_focused_context == FALSE) {
       for (cc = context_list.next; cc != &context_list; cc = cc->next) {
 	uim_switch_im(cc->uc, im_name);
@@ -1088,8 +1120,8 @@ parse_helper_str_im_change(const char *str)
 	  uim_prop_list_update(cc->uc);
       }
     }
+    break;
   }
-  g_strfreev(lines);
   g_string_free(im_name_sym, TRUE);
 }
 
@@ -1099,40 +1131,38 @@ send_im_list(void)
   int nr, i;
   GString *msg;
   const char *current_im_name;
+  const struct uim_im_info *ims;
 
   if (!focused_context)
     return;
 
-  nr = uim_get_nr_im(focused_context->uc);
+  ims = uim_get_im_list(focused_context->uc, &nr);
   current_im_name = uim_get_current_im_name(focused_context->uc);
 
   msg = g_string_new("im_list\ncharset=UTF-8\n");
   for (i = 0; i < nr; i++) {
     /*
-     * Return value of uim_get_im_language() is an ISO 639-1
-     * compatible language code such as "ja". Since it is unfriendly
-     * for human reading, we convert it into friendly one by
+     * lang of uim_im_info is an ISO 639-1 compatible language code
+     * such as "ja". Since it is unfriendly for human reading, we
+     * convert it into friendly one by
      * uim_get_language_name_from_locale() here.
      */
-    const char *name = uim_get_im_name(focused_context->uc, i);
-    const char *langcode = uim_get_im_language(focused_context->uc, i);
-    const char *lang = uim_get_language_name_from_locale(langcode);
-    const char *short_desc = uim_get_im_short_desc(focused_context->uc, i);
+    const char *lang = uim_get_language_name_from_locale(ims[i].lang);
 
-    g_string_append(msg, name);
+    g_string_append(msg, ims[i].name);
     g_string_append(msg, "\t");
     if (lang)
       g_string_append(msg, lang);
     g_string_append(msg, "\t");
-    if (short_desc)
-      g_string_append(msg, short_desc);
+    g_string_append(msg, ims[i].short_desc);
     g_string_append(msg, "\t");
-    if (strcmp(name, current_im_name) == 0)
+    if (strcmp(ims[i].name, current_im_name) == 0)
       g_string_append(msg, "selected");
     g_string_append(msg, "\n");
   }
   uim_helper_send_message(im_uim_fd, msg->str);
   g_string_free(msg, TRUE);
+  watch_helper_write();
 }
 
 /* Copied from helper-common-gtk.c. Maybe we need common GTK+ utility file. */
@@ -1155,12 +1185,11 @@ get_charset(gchar *line)
 }
 
 static void
-commit_string_from_other_process(const gchar *str)
+commit_string_from_other_process(const struct uim_helper_frame *frame)
 {
-  gchar **lines = g_strsplit(str, "\n", 0);
-  gchar *commit_string;
+  const gchar *commit_string;
 
-  if (!lines || !lines[0] || !lines[1] || !lines[2])
+  if (frame->nr_fields < 1)
     return; /* Message is broken, do nothing. */
 
   /*
@@ -1168,11 +1197,11 @@ commit_string_from_other_process(const gchar *str)
    * specifier.  This (rotten) convention is influenced by old design
    * mistake (character encoding was forgotten!).
    */
-  if (strcmp(lines[2], "") != 0) {
+  if (frame->nr_fields >= 2) {
     gchar *encoding, *commit_string_utf8;
 
-    encoding = get_charset(lines[1]);
-    commit_string = lines[2];
+    encoding = get_charset((gchar *)frame->fields[0]);
+    commit_string = frame->fields[1];
     commit_string_utf8 = g_convert(commit_string, strlen(commit_string),
 				   "UTF-8", encoding,
 				   NULL, /* gsize *bytes_read */
@@ -1183,11 +1212,9 @@ commit_string_from_other_process(const gchar *str)
     g_free(commit_string_utf8);
   } else {
     /* Assuming character encoding as UTF-8. */
-    commit_string = lines[1];
+    commit_string = frame->fields[0];
     g_signal_emit_by_name(focused_context, "commit", commit_string);
   }
-
-  g_strfreev(lines);
 }
 
 static void
@@ -1236,68 +1263,117 @@ update_candwin_style()
 }
 
 static void
-parse_helper_str(const char *str)
+parse_helper_frame(const struct uim_helper_frame *frame)
 {
-  gchar **lines;
-
-  if (g_str_has_prefix(str, "im_change") == TRUE) {
-    parse_helper_str_im_change(str);
-  } else if (g_str_has_prefix(str, "prop_update_custom") == TRUE) {
-    IMUIMContext *cc;
+  IMUIMContext *cc;
 
-    lines = g_strsplit(str, "\n", 0);
-    if (lines && lines[0] && lines[1] && lines[2]) {
+  switch (frame->type) {
+  case UHelperMsg_ImChangeThisTextAreaOnly:
+  case UHelperMsg_ImChangeWholeDesktop:
+  case UHelperMsg_ImChangeThisApplicationOnly:
+    parse_helper_im_change(frame);
+    return;
+  case UHelperMsg_PropUpdateCustom:
+    if (frame->nr_fields >= 2) {
       for (cc = context_list.next; cc != &context_list; cc = cc->next) {
-	uim_prop_update_custom(cc->uc, lines[1], lines[2]);
-	if (!strcmp(lines[1], "candidate-window-position"))
+	uim_prop_update_custom(cc->uc, frame->fields[0], frame->fields[1]);
+	if (!strcmp(frame->fields[0], "candidate-window-position"))
 	  update_candwin_pos_type();
-	if (!strcmp(lines[1], "candidate-window-style"))
+	if (!strcmp(frame->fields[0], "candidate-window-style"))
 	  update_candwin_style();
 	break;  /* all custom variables are global */
       }
-      g_strfreev(lines);
     }
-  } else if (g_str_has_prefix(str, "custom_reload_notify") == TRUE) {
+    return;
+  case UHelperMsg_CustomReloadNotify:
     uim_prop_reload_configs();
     update_candwin_pos_type();
     update_candwin_style();
-  } else if (focused_context && !disable_focused_context) {
-    if (g_str_has_prefix(str, "prop_list_get") == TRUE) {
-      uim_prop_list_update(focused_context->uc);
-    } else if (g_str_has_prefix(str, "prop_activate") == TRUE) {
-      lines = g_strsplit(str, "\n", 0);
-      if (lines && lines[0]) {
-	uim_prop_activate(focused_context->uc, lines[1]);
-	g_strfreev(lines);
-      }
-    } else if (g_str_has_prefix(str, "im_list_get") == TRUE) {
-      send_im_list();
-    } else if (g_str_has_prefix(str, "commit_string")) {
-      commit_string_from_other_process(str);
-    } else if (g_str_has_prefix(str, "focus_in") == TRUE) {
-      disable_focused_context = TRUE;
-      /*
-       * We don't set "focused_context = NULL" here, because some
-       * window managers have some focus related bugs??
-       */
-    }
+    return;
+  }
+
+  if (!focused_context || disable_focused_context)
+    return;
+
+  switch (frame->type) {
+  case UHelperMsg_PropListGet:
+    uim_prop_list_update(focused_context->uc);
+    break;
+  case UHelperMsg_PropActivate:
+    if (frame->nr_fields >= 1)
+      uim_prop_activate(focused_context->uc, frame->fields[0]);
+    break;
+  case UHelperMsg_ImListGet:
+    send_im_list();
+    break;
+  case UHelperMsg_CommitString:
+    commit_string_from_other_process(frame);
+    break;
+  case UHelperMsg_FocusIn:
+    disable_focused_context = TRUE;
+    /*
+     * We don't set "focused_context = NULL" here, because some
+     * window managers have some focus related bugs??
+     */
+    break;
   }
 }
 
 static gboolean
 helper_read_cb(GIOChannel *channel, GIOCondition c, gpointer p)
 {
-  char *msg;
+  static struct uim_helper_frame frame;
   int fd = g_io_channel_unix_get_fd(channel);
 
   uim_helper_read_proc(fd);
-  while ((msg = uim_helper_get_message())) {
-    parse_helper_str(msg);
-    free(msg);
-  }
+  while (uim_helper_get_frame(&frame))
+    parse_helper_frame(&frame);
+  watch_helper_write();
+
   return TRUE;
 }
 
+static gboolean
+helper_write_cb(GIOChannel *channel, GIOCondition c, gpointer p)
+{
+  int fd = g_io_channel_unix_get_fd(channel);
+
+  if (uim_helper_flush_messages(fd) > 0)
+    return TRUE;
+
+  write_tag = 0;
+  return FALSE;
+}
+
+/* flush the messages which the socket hasn't accepted yet when it
+ * becomes writable */
+static void
+watch_helper_write(void)
+{
+  GIOChannel *channel;
+
+  if (im_uim_fd < 0 || write_tag || !uim_helper_pending_messages(im_uim_fd))
+    return;
+
+  channel = g_io_channel_unix_new(im_uim_fd);
+  write_tag = g_io_add_watch(channel, G_IO_OUT, helper_write_cb, NULL);
+  g_io_channel_unref(channel);
+}
+
+/* messages handled by parse_helper_frame() */
+static const int helper_topics[] = {
+  UHelperMsg_ImChangeThisTextAreaOnly,
+  UHelperMsg_ImChangeWholeDesktop,
+  UHelperMsg_ImChangeThisApplicationOnly,
+  UHelperMsg_PropUpdateCustom,
+  UHelperMsg_CustomReloadNotify,
+  UHelperMsg_PropListGet,
+  UHelperMsg_PropActivate,
+  UHelperMsg_ImListGet,
+  UHelperMsg_CommitString,
+  UHelperMsg_FocusIn
+};
+
 static void
 check_helper_connection(uim_context uc)
 {
@@ -1306,10 +1382,14 @@ check_helper_connection(uim_context uc)
     if (im_uim_fd >= 0) {
       GIOChannel *channel;
       uim_set_uim_fd(uc, im_uim_fd);
+      uim_helper_client_request_frames();
+      uim_helper_client_subscribe(helper_topics,
+				  sizeof(helper_topics) / sizeof(helper_topics[0]));
       channel = g_io_channel_unix_new(im_uim_fd);
       read_tag = g_io_add_watch(channel, G_IO_IN | G_IO_HUP | G_IO_ERR,
 				helper_read_cb, NULL);
       g_io_channel_unref(channel);
+      watch_helper_write();
     }
   }
 }
@@ -1436,6 +1516,7 @@ im_uim_focus_in(GtkIMContext *ic)
   check_helper_connection(uic->uc);
   uim_helper_client_focus_in(uic->uc);
   uim_prop_list_update(uic->uc);
+  watch_helper_write();
 
   for (cc = context_list.next; cc != &context_list; cc = cc->next) {
     if (cc != uic && cc->cwin)
@@ -1466,6 +1547,7 @@ im_uim_focus_out(GtkIMContext *ic)
 
   check_helper_connection(uic->uc);
   uim_helper_client_focus_out(uic->uc);
+  watch_helper_write();
 
   if (uic->cwin)
     gtk_widget_hide(GTK_WIDGET(uic->cwin));
@@ -1582,6 +1664,7 @@ im_uim_init(IMUIMContext *uic)
   uic->pseg = NULL;
   uic->nr_psegs = 0;
   uic->prev_preedit_len = 0;
+  uic->preedit_generation = 0;
 
   uic->cwin = im_uim_create_cand_win_gtk();
 #if IM_UIM_USE_TOPLEVEL
@@ -1700,7 +1783,7 @@ im_module_create(const gchar *context_id)
 
   check_helper_connection(uic->uc);
 
-  uim_set_preedit_cb(uic->uc, clear_cb, pushback_cb, update_cb);
+  uim_set_preedit_snapshot_cb(uic->uc, preedit_snapshot_cb);
   uim_set_prop_list_update_cb(uic->uc, update_prop_list_cb);
   uim_set_candidate_selector_cb(uic->uc, cand_activate_cb, cand_select_cb,
 				cand_shift_page_cb, cand_deactivate_cb);
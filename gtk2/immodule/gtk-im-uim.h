@@ -67,6 +67,7 @@ typedef struct _IMUIMContext {
   int nr_psegs;
   int prev_preedit_len;
   struct preedit_segment *pseg;
+  unsigned int preedit_generation;
 
   GdkWindow *win;
 
@@ -690,7 +690,6 @@ void QUimInputContext::prepare_page_candidates( int page )
 	return;
 
     /* set page candidates */
-    uim_candidate cand;
     int pageNr, start, nrCandidates, displayLimit;
 
     nrCandidates = cwin->nrCandidates;
@@ -702,10 +701,15 @@ void QUimInputContext::prepare_page_candidates( int page )
     else
 	pageNr = nrCandidates - start;
 
-    for ( int i = start; i < ( pageNr + start ); i++ )
+    if ( pageNr > 0 )
     {
-        cand = uim_get_candidate( m_uc, i, displayLimit ? i % displayLimit : i );
-        list.append( cand );
+        uim_candidate *cands = new uim_candidate[ pageNr ];
+        if ( uim_get_candidates( m_uc, start, pageNr, cands ) == pageNr )
+        {
+            for ( int i = 0; i < pageNr; i++ )
+                list.append( cands[ i ] );
+        }
+        delete [] cands;
     }
     pageFilled[ page ] = true;
     cwin->setPageCandidates( page, list );
@@ -37,6 +37,7 @@
 #include <QtCore/QPoint>
 #include <QtCore/QProcess>
 #include <QtCore/QTimer>
+#include <QtCore/QVector>
 #include <QtGui/QMoveEvent>
 #if QT_VERSION < 0x050000
 # include <QtGui/QApplication>
@@ -544,11 +545,12 @@ void CandidateWindowProxy::preparePageCandidates(int page)
     else
         pageNr = nrCandidates - start;
 
-    for (int i = start; i < pageNr + start; i++) {
+    if (pageNr > 0) {
         // set page candidates
-        uim_candidate cand = uim_get_candidate(ic->uimContext(), i,
-                displayLimit ? i % displayLimit : i);
-        list.append(cand);
+        QVector<uim_candidate> cands(pageNr);
+        if (uim_get_candidates(ic->uimContext(), start, pageNr,
+                cands.data()) == pageNr)
+            list = cands.toList();
     }
     pageFilled[page] = true;
     setPageCandidates(page, list);
@@ -56,12 +56,13 @@ QUimInfoManager::initUimInfo()
 
     uim_context tmp_uc = uim_create_context( 0, "UTF-8", 0, 0, 0, 0 );
     struct uimInfo ui;
-    int nr = uim_get_nr_im( tmp_uc );
+    int nr;
+    const struct uim_im_info *ims = uim_get_im_list( tmp_uc, &nr );
     for ( int i = 0; i < nr; i++ )
     {
-        ui.name = uim_get_im_name( tmp_uc, i );
-        ui.lang = uim_get_im_language (tmp_uc, i );
-        ui.short_desc = uim_get_im_short_desc( tmp_uc, i );
+        ui.name = ims[i].name;
+        ui.lang = ims[i].lang;
+        ui.short_desc = ims[i].short_desc;
 
         info.append( ui );
     }
@@ -281,6 +281,7 @@
 		  (not (memq (im-name im) enabled-im-list))
 		  (not (eq? (im-name im) 'direct))))
 	      im-list))
+    (im-list-changed!)
 
     ;; update imsw widget
     (if toolbar-show-action-based-switcher-button?
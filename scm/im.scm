@@ -80,6 +80,14 @@
 ;;
 (define im-list ())
 
+;; incremented whenever im-list is modified to invalidate the IM list
+;; snapshot of uim_get_im_list()
+(define im-list-generation 0)
+
+(define im-list-changed!
+  (lambda ()
+    (set! im-list-generation (+ im-list-generation 1))))
+
 (define installed-im-list ())
 (define enabled-im-list ())
 
@@ -151,6 +159,7 @@
 	       (initial-registration? (not (assq name im-list))))
 	   (set! im-list (alist-replace im im-list))
 	   (normalize-im-list)
+	   (im-list-changed!)
            initial-registration?))))
 
 ;; strictly find out im by name
@@ -208,6 +217,16 @@
             (else #f))
       (list-ref (uim-filter-convertible-ims uc) n))))
 
+;; called from uim_get_im_list()
+(define uim-convertible-im-descs
+  (lambda (uc)
+    (map (lambda (im)
+           (list (im-name im)
+                 (im-lang im)
+                 (im-encoding im)
+                 (im-short-desc im)))
+         (uim-filter-convertible-ims uc))))
+
 ;; called from uim_get_default_im_name()
 (define uim-get-default-im-name
   (lambda (localestr)
@@ -524,6 +543,12 @@
                (set-cdr! (cdr c) (list (annotation-get-text (car c) (uim-context-encoding uc))))))
       c)))
 
+(define get-candidates
+  (lambda (uc start count)
+    (map (lambda (idx)
+	   (get-candidate uc idx (- idx start)))
+	 (iota count start))))
+
 (define set-candidate-index
   (lambda (uc idx)
     (invoke-handler im-set-candidate-index-handler uc idx)))
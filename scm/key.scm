@@ -197,26 +197,7 @@
 					  (cdr (assq prefix key-state-alist)))))
 	      (parse-key-str rest translators key key-state)))
 	   ((translator-prefix? prefix)
-	    (let* ((translator
-		    (cond
-		     ((eq? prefix 'IgnoreCase)
-		      (lambda (key key-state)
-			(let ((translated-key (ichar-downcase key)))
-			  (list translated-key key-state))))
-		     ((eq? prefix 'IgnoreShift)
-		      (lambda (key key-state)
-			(let ((translated-key-state
-			       (bitwise-and key-state
-					    (bitwise-not 1))))
-			  (list key translated-key-state))))
-		     ((eq? prefix 'IgnoreRegularShift)
-		      (lambda (key key-state)
-			(let ((translated-key-state
-			       (if (ichar-graphic? key)
-				   (bitwise-and key-state
-						(bitwise-not 1))
-				   key-state)))
-			  (list key translated-key-state))))))
+	    (let* ((translator (cdr (assq prefix key-translator-alist)))
 		   (translators (cons translator
 				      translators)))
 	      (parse-key-str rest translators key key-state)))
@@ -229,6 +210,40 @@
 			     rest)))
 	      (list rest translators key key-state))))))))))
 
+(define key-translator-ignore-case
+  (lambda (key key-state)
+    (let ((translated-key (ichar-downcase key)))
+      (list translated-key key-state))))
+
+(define key-translator-ignore-shift
+  (lambda (key key-state)
+    (let ((translated-key-state
+	   (bitwise-and key-state
+			(bitwise-not 1))))
+      (list key translated-key-state))))
+
+(define key-translator-ignore-regular-shift
+  (lambda (key key-state)
+    (let ((translated-key-state
+	   (if (ichar-graphic? key)
+	       (bitwise-and key-state
+			    (bitwise-not 1))
+	       key-state)))
+      (list key translated-key-state))))
+
+(define key-translator-alist
+  (list
+   (cons 'IgnoreCase         key-translator-ignore-case)
+   (cons 'IgnoreShift        key-translator-ignore-shift)
+   (cons 'IgnoreRegularShift key-translator-ignore-regular-shift)))
+
+;; flags of the translators understood by key-matcher-match?
+(define key-translator-flag-alist
+  (list
+   (cons key-translator-ignore-case          1)
+   (cons key-translator-ignore-shift         2)
+   (cons key-translator-ignore-regular-shift 4)))
+
 (define apply-translators
   (lambda (translators key key-state)
     (if (null? translators)
@@ -243,11 +258,42 @@
 	   translated-key
 	   translated-state)))))
 
+;; Compiles a key string into the form of (target-key target-state
+;; translator-flags) for key-matcher-match?. Returns #f if the string
+;; cannot be expressed in the form.
+;; (compile-key-str "<IgnoreCase><Control>J") => (106 2 1)
+(define compile-key-str
+  (lambda (key-str)
+    (let* ((parsed (parse-key-str key-str () -1 0))
+	   (translators (nth 1 parsed))
+	   (flags (map (lambda (translator)
+			 (let ((pair (assq translator
+					   key-translator-flag-alist)))
+			   (and pair
+				(cdr pair))))
+		       translators)))
+      (and (every integer? flags)
+	   (let* ((translated (apply apply-translators (cdr parsed)))
+		  (target-key   (nth 1 translated))
+		  (target-state (nth 2 translated)))
+	     (and (or (integer? target-key)
+		      (symbol? target-key))
+		  (integer? target-state)
+		  (list target-key
+			target-state
+			(apply bitwise-ior 0 flags))))))))
+
 ;; Generates key predicate
 ;; (make-single-key-predicate "<Control>j")
 (define make-single-key-predicate
   (lambda (source)
     (cond
+     ((and (string? source)
+	   (compile-key-str source))
+      => (lambda (compiled)
+	   (let ((matcher (list->vector compiled)))
+	     (lambda (key key-state)
+	       (key-matcher-match? matcher key key-state)))))
      ((string? source)
       (let* ((key-str source)
 	     (parsed (parse-key-str key-str () -1 0))
@@ -275,12 +321,27 @@
   (lambda (sources)
     (cond
      ((list? sources)
-      (let ((predicates (map make-single-key-predicate sources)))
-	(lambda (key key-state)
-	  (apply proc-or
-		 (map (lambda (predicate)
-			(apply predicate (list key key-state)))
-		      predicates)))))
+      ;; Key strings are merged into a single matcher examined by
+      ;; key-matcher-match? at once. The rest are tested afterwards.
+      (let* ((compiled (map (lambda (source)
+			      (and (string? source)
+				   (compile-key-str source)))
+			    sources))
+	     (matcher (list->vector (append-map (lambda (c)
+						  (or c ()))
+						compiled)))
+	     (predicates (filter-map (lambda (source c)
+				       (and (not c)
+					    (make-single-key-predicate source)))
+				     sources compiled)))
+	(if (null? predicates)
+	    (lambda (key key-state)
+	      (key-matcher-match? matcher key key-state))
+	    (lambda (key key-state)
+	      (or (key-matcher-match? matcher key key-state)
+		  (any (lambda (predicate)
+			 (predicate key key-state))
+		       predicates))))))
      (else
       (let ((source sources))
 	(make-single-key-predicate source))))))
@@ -61,11 +61,13 @@
 (define require-module
   (lambda (module-name)
     (set! currently-loading-module-name module-name)
-    (let ((succeeded (or (module-load module-name)
-                         (try-require
-                           (find-module-scm-path
-                             uim-plugin-scm-load-path
-                             module-name)))))
+    (let* ((depth (load-profile-enter 'require-module module-name))
+           (succeeded (or (module-load module-name)
+                          (try-require
+                            (find-module-scm-path
+                              uim-plugin-scm-load-path
+                              module-name)))))
+      (load-profile-leave depth)
       (set! currently-loading-module-name #f)
       succeeded)))
 
@@ -130,10 +132,14 @@
 
 (define module-load
   (lambda (module-name)
-    (if (require-dynlib module-name)
-      (let ((scm-path (find-module-scm-path
-				    uim-plugin-scm-load-path module-name)))
-        (if (string? scm-path)
-          (try-require scm-path)
-          #t))
-      #f)))
+    (let* ((depth (load-profile-enter 'module-load module-name))
+           (succeeded
+            (if (require-dynlib module-name)
+                (let ((scm-path (find-module-scm-path
+                                 uim-plugin-scm-load-path module-name)))
+                  (if (string? scm-path)
+                      (try-require scm-path)
+                      #t))
+                #f)))
+      (load-profile-leave depth)
+      succeeded)))
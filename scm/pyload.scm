@@ -58,8 +58,13 @@
 
 (define pinyin-big5-init-handler
   (lambda (id im arg)
-    (require "pinyin-big5.scm")
-    (generic-context-new id im pinyin-big5-rule #f)))
+    (require "rule-table.scm")
+    (generic-context-new id im
+                         (or (rule-table-load "pinyin-big5.rtbl")
+                             (begin
+                               (require "pinyin-big5.scm")
+                               pinyin-big5-rule))
+                         #f)))
 
 (generic-register-im
  'pinyin-big5
@@ -40,6 +40,10 @@
 ;
 ; if "table" is provided as a rule for rk-context-new, functions in ;
 ; ct.scm are used to search from sorted text file.
+;
+; if a rule table handle opened by rule-table-load (rule-table.scm) is
+; provided, functions of the rule-table plugin are used to search from
+; the precompiled table.
 
 (define-record 'rk-context
   '((rule             ())
@@ -53,35 +57,37 @@
     (expect-key-for-seq? #f)))
 (define rk-context-new-internal rk-context-new)
 
+(define rk-rule-table?
+  (lambda (rule)
+    (and (symbol-bound? 'rule-table?)
+         (rule-table? rule))))
+
 (define rk-context-new
   (lambda (rule immediate-commit back)
     (if (string? rule)
       (require "ct.scm"))
-    (let* ((use-table? (string? rule))
-           (find-seq (if use-table?
-                       ct-lib-find-seq
-                       rk-lib-find-seq))
-           (find-partial-seq (if use-table?
-                               ct-lib-find-partial-seq
-                               rk-lib-find-partial-seq))
-           (find-cands-incl-minimal-partial (if use-table?
-                                              ct-find-cands-incl-minimal-partial
-                                              rk-find-cands-incl-minimal-partial))
-           (expect-seq (if use-table?
+    ;; find-seq find-partial-seq find-cands-incl-minimal-partial
+    ;; expect-seq expect-key-for-seq?
+    (let ((procs (cond
+                  ((string? rule)
+                   (list ct-lib-find-seq
+                         ct-lib-find-partial-seq
+                         ct-find-cands-incl-minimal-partial
                          ct-lib-expect-seq
-                         rk-lib-expect-seq))
-           (expect-key-for-seq? (if use-table?
-                                  ct-lib-expect-key-for-seq?
-                                  rk-lib-expect-key-for-seq?)))
-    (rk-context-new-internal rule
-                             ()
-                             immediate-commit
-                             back
-                             find-seq
-                             find-partial-seq
-                             find-cands-incl-minimal-partial
-                             expect-seq
-                             expect-key-for-seq?))))
+                         ct-lib-expect-key-for-seq?))
+                  ((rk-rule-table? rule)
+                   (list rule-table-find-seq
+                         rule-table-find-partial-seq
+                         rule-table-find-cands-incl-minimal-partial
+                         rule-table-expect-seq
+                         rule-table-expect-key-for-seq?))
+                  (else
+                   (list rk-lib-find-seq
+                         rk-lib-find-partial-seq
+                         rk-find-cands-incl-minimal-partial
+                         rk-lib-expect-seq
+                         rk-lib-expect-key-for-seq?)))))
+      (apply rk-context-new-internal rule () immediate-commit back procs))))
 
 ;; back match
 (define rk-find-longest-back-match
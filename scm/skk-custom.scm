@@ -447,6 +447,25 @@
 		 (lambda ()
 		   (not skk-use-skkserv?)))
 
+(define-custom 'skk-extra-dic-file-names '()
+  '(skk-dict dict-files)
+  (list 'table
+	(list 'file (N_ "File") (N_ "File")))
+  (N_ "Additional system dictionary files")
+  (N_ "long description will be here."))
+
+(define-custom 'skk-personal-dic-journal? #f
+  '(skk-dict dict-files)
+  '(boolean)
+  (N_ "Append learned words to a journal of personal dictionary")
+  (N_ "long description will be here."))
+
+(define-custom 'skk-dic-cache-capacity 10000
+  '(skk-dict)
+  '(integer 0 1000000)
+  (N_ "Number of cached system dictionary entries (0: unlimited)")
+  (N_ "long description will be here."))
+
 ;;
 ;; advanced
 ;;
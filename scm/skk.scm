@@ -460,6 +460,13 @@
                                           hostname
                                           skk-skkserv-portnum
                                           skk-skkserv-address-family))
+          ;; candidates are merged in the order of the files
+          (for-each (lambda (row)
+                      (skk-lib-dic-add-source skk-dic (car row)))
+                    skk-extra-dic-file-names)
+          (skk-lib-set-cache-capacity skk-dic skk-dic-cache-capacity)
+          (skk-lib-set-personal-dic-journal skk-dic
+                                            skk-personal-dic-journal?)
           (if skk-use-look?
               (skk-lib-look-open skk-look-dict))
 	  (skk-read-personal-dictionary)))
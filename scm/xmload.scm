@@ -32,7 +32,10 @@
 ;;
 (define zm-init-handler
   (lambda (id im arg)
-    (generic-context-new id im "zm.table" #f)))
+    (require "rule-table.scm")
+    (generic-context-new id im
+                         (or (rule-table-load "zm.rtbl") "zm.table")
+                         #f)))
 
 (generic-register-im
  'zm
@@ -44,7 +47,10 @@
 
 (define wb86-init-handler
   (lambda (id im arg)
-    (generic-context-new id im "wb86.table" #f)))
+    (require "rule-table.scm")
+    (generic-context-new id im
+                         (or (rule-table-load "wb86.rtbl") "wb86.table")
+                         #f)))
 
 (generic-register-im
  'wb86
@@ -0,0 +1,112 @@
+/*
+  Copyright (c) 2003-2013 uim Project https://github.com/uim/uim
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+  3. Neither the name of authors nor the names of its contributors
+     may be used to endorse or promote products derived from this software
+     without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+/*
+ * Microbenchmark of key event processing in libuim. It feeds a mix of
+ * ASCII, cursor, function and modifier keys to an input context and
+ * prints the number of press/release pairs processed per second.
+ *
+ *   $ make -C test bench-key
+ *   $ LIBUIM_SCM_FILES=scm test/bench-key [im-name] [iterations]
+ *
+ * It is not run by "make check" since the result depends on the host.
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <sys/time.h>
+
+#include "uim/uim.h"
+
+static const int keys[] = {
+  'a', 'k', UKey_Left, UKey_Right, UKey_Up, UKey_Down, UKey_F1, UKey_F12,
+  UKey_Shift_key, UKey_Control_key, UKey_Alt_key, UKey_Return, UKey_Escape,
+  UKey_Backspace, UKey_Home, UKey_End, UKey_Prior, UKey_Next, ' ', '1'
+};
+#define NR_KEYS ((int)(sizeof(keys) / sizeof(keys[0])))
+
+static void
+commit_cb(void *ptr, const char *str)
+{
+}
+
+static double
+now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int
+main(int argc, char *argv[])
+{
+  const char *im = (argc > 1) ? argv[1] : "direct";
+  long i, n = (argc > 2) ? atol(argv[2]) : 1000000;
+  uim_context uc;
+  double start, elapsed;
+
+  if (uim_init() != 0) {
+    fprintf(stderr, "uim_init() failed\n");
+    return EXIT_FAILURE;
+  }
+
+  uc = uim_create_context(NULL, "UTF-8", NULL, im, NULL, commit_cb);
+  if (!uc) {
+    fprintf(stderr, "cannot create a context for %s\n", im);
+    uim_quit();
+    return EXIT_FAILURE;
+  }
+
+  /* warm up */
+  for (i = 0; i < NR_KEYS; i++) {
+    uim_press_key(uc, keys[i], 0);
+    uim_release_key(uc, keys[i], 0);
+  }
+
+  start = now();
+  for (i = 0; i < n; i++) {
+    uim_press_key(uc, keys[i % NR_KEYS], 0);
+    uim_release_key(uc, keys[i % NR_KEYS], 0);
+  }
+  elapsed = now() - start;
+
+  printf("%s: %ld keys in %.3f sec, %.0f keys/sec\n",
+	 im, n, elapsed, n / elapsed);
+
+  uim_release_context(uc);
+  uim_quit();
+
+  return EXIT_SUCCESS;
+}
@@ -356,6 +356,34 @@
                                            'test-return-key?
                                            "<Control>b"))
                       98 0))    ; b
+
+  ;; multiple key-strs are merged into a matcher
+  (assert-uim-true  '((make-key-predicate '("<IgnoreCase>j"
+                                            "<IgnoreShift>return"
+                                            "<Control>b"))
+                      74 0))    ; J
+  (assert-uim-true  '((make-key-predicate '("<IgnoreCase>j"
+                                            "<IgnoreShift>return"
+                                            "<Control>b"))
+                      'return test-shift-state)) ; return
+  (assert-uim-false '((make-key-predicate '("<IgnoreCase>j"
+                                            "<IgnoreShift>return"
+                                            "<Control>b"))
+                      98 test-shift-state)) ; b
+  (assert-uim-false '((make-key-predicate ())
+                      97 0))    ; a
+  #f)
+
+(define (test-compile-key-str)
+  (assert-uim-equal '(97 0 0)
+                    '(compile-key-str "a"))
+  (assert-uim-equal (uim '(list 106 test-control-state 1))
+                    '(compile-key-str "<IgnoreCase><Control>J"))
+  (assert-uim-equal '(return 0 6)
+                    '(compile-key-str
+                      "<IgnoreRegularShift><IgnoreShift><Shift>return"))
+  (assert-uim-equal '(-1 0 0)
+                    '(compile-key-str ""))
   #f)
 
 (define (test-modify-key-strs-implicitly)
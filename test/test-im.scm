@@ -904,3 +904,88 @@
 			(map retrieve-im '(latin)))))
    (assert-equal ()
 		 (uim '(custom-im-list-as-choice-rec ())))))
+
+(define-uim-test-case "testcase im im-list"
+  (setup
+   (lambda ()
+     (uim '(begin
+	     (require-module "skk")
+	     (require-module "latin")
+	     ;; im-convertible? requires a context in C world. Only UTF-8
+	     ;; IMs are convertible for a non-#f uc.
+	     (define im-convertible?
+	       (lambda (uc im-encoding)
+		 (or (not uc)
+		     (string=? im-encoding "UTF-8"))))
+	     (define test-im-init-args
+	       (list 'test-im
+		     "ja"
+		     "EUC-JP"
+		     "a label"
+		     "a short description"
+		     #f
+		     direct-init-handler
+		     direct-release-handler
+		     context-mode-handler
+		     direct-key-press-handler
+		     direct-key-release-handler
+		     direct-reset-handler
+		     direct-get-candidate-handler
+		     direct-set-candidate-index-handler
+		     context-prop-activate-handler
+		     #f
+		     #f
+		     #f
+		     #f
+		     #f))
+	     (set! enabled-im-list (append enabled-im-list '(test-im)))
+	     (apply register-im test-im-init-args)
+	     #t))))
+
+  ("test uim-convertible-im-descs"
+   (for-each
+    (lambda (uc)
+      (let ((n (uim `(uim-n-convertible-ims ,uc))))
+	(assert-true (< 0 n))
+	(assert-equal n
+		      (uim `(length (uim-convertible-im-descs ,uc))))
+	(for-each
+	 (lambda (i)
+	   (assert-equal (uim `(let ((im (uim-nth-convertible-im ,uc ,i)))
+				 (list (im-name im)
+				       (im-lang im)
+				       (im-encoding im)
+				       (im-short-desc im))))
+			 (uim `(list-ref (uim-convertible-im-descs ,uc) ,i))))
+	 (iota n))
+	(assert-false (uim-bool `(uim-nth-convertible-im ,uc ,n)))))
+    '(#f #t))
+   ;; the EUC-JP IM is filtered out
+   (assert-true (uim-bool '(assq 'test-im (uim-convertible-im-descs #f))))
+   (assert-false (uim-bool '(assq 'test-im (uim-convertible-im-descs #t)))))
+
+  ("test im-list-generation"
+   (uim '(define test-generation im-list-generation))
+   ;; re-registration replaces the IM
+   (assert-false (uim-bool '(apply register-im test-im-init-args)))
+   (assert-true (uim-bool '(< test-generation im-list-generation)))
+
+   ;; a disabled IM is not registered
+   (uim '(set! test-generation im-list-generation))
+   (assert-false (uim-bool '(apply register-im (cons 'test-im2
+						     (cdr test-im-init-args)))))
+   (assert-false (uim-bool '(< test-generation im-list-generation)))
+   (uim '(set! enabled-im-list (append enabled-im-list '(test-im2))))
+   (assert-true (uim-bool '(apply register-im (cons 'test-im2
+						    (cdr test-im-init-args)))))
+   (assert-true (uim-bool '(< test-generation im-list-generation)))
+
+   ;; the enabled IM list update removes disabled IMs from im-list
+   (uim '(set! test-generation im-list-generation))
+   (uim '(begin
+	   (set! toolbar-show-action-based-switcher-button? #f)
+	   (set! enabled-im-list (delete 'test-im2 enabled-im-list))
+	   (update-imsw-widget-of-context-widgets)
+	   #t))
+   (assert-false (uim-bool '(assq 'test-im2 im-list)))
+   (assert-true (uim-bool '(< test-generation im-list-generation)))))
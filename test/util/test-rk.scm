@@ -61,7 +61,10 @@
                            ((("s" "e"). ()) ("せ" "セ" "ｾ"))
                            ((("s" "o"). ()) ("そ" "ソ" "ｿ"))
 
-                           ((("p" "p"). ("p")) ("っ" "ッ" "ｯ"))))))
+                           ((("p" "p"). ("p")) ("っ" "ッ" "ｯ")))))
+  ;; long enough to be compiled into a rule index
+  (uim-eval
+   '(define test-rk-rule-twice (append test-rk-rule test-rk-rule))))
 
 (define (teardown)
   (uim-test-teardown))
@@ -181,4 +184,40 @@
                     '(rk-lib-expect-seq '("p" "p") test-rk-rule))
   #f)
 
+(define (test-rk-lib-indexed-rule)
+  ;; the rule index is built on the second lookup of a rule list, so
+  ;; every query is repeated to cover both linear and indexed paths
+  (for-each
+   (lambda (i)
+     (assert-uim-equal '((("k" "y" "a"). ())("きゃ" "キャ" "ｷｬ"))
+                       '(rk-lib-find-seq '("k" "y" "a") test-rk-rule-twice))
+     (assert-uim-false '(rk-lib-find-seq '("k" "y") test-rk-rule-twice))
+     (assert-uim-false '(rk-lib-find-seq () test-rk-rule-twice))
+
+     (assert-uim-equal '((("k" "y" "a"). ())("きゃ" "キャ" "ｷｬ"))
+                       '(rk-lib-find-partial-seq '("k" "y")
+                                                 test-rk-rule-twice))
+     (assert-uim-false '(rk-lib-find-partial-seq '("s" "s")
+                                                 test-rk-rule-twice))
+
+     (assert-uim-equal '(((("p" "p"). ("p"))("っ" "ッ" "ｯ"))
+                         ((("p" "p"). ("p"))("っ" "ッ" "ｯ")))
+                       '(rk-lib-find-partial-seqs '("p")
+                                                  test-rk-rule-twice))
+     (assert-uim-equal ()
+                       '(rk-lib-find-partial-seqs '("z")
+                                                  test-rk-rule-twice))
+
+     (assert-uim-equal '("o" "e" "u" "i" "a" "o" "e" "u" "i" "a")
+                       '(rk-lib-expect-seq '("k" "y") test-rk-rule-twice))
+     (assert-uim-equal ()
+                       '(rk-lib-expect-seq '("p" "p") test-rk-rule-twice))
+
+     (assert-uim-true '(rk-lib-expect-key-for-seq? '("k") test-rk-rule-twice
+                                                   "y"))
+     (assert-uim-false '(rk-lib-expect-key-for-seq? '("k") test-rk-rule-twice
+                                                    "k")))
+   '(0 1 2))
+  #f)
+
 (provide "test/util/test-rk")
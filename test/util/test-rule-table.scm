@@ -0,0 +1,245 @@
+;;; Copyright (c) 2003-2013 uim Project https://github.com/uim/uim
+;;;
+;;; All rights reserved.
+;;;
+;;; Redistribution and use in source and binary forms, with or without
+;;; modification, are permitted provided that the following conditions
+;;; are met:
+;;; 1. Redistributions of source code must retain the above copyright
+;;;    notice, this list of conditions and the following disclaimer.
+;;; 2. Redistributions in binary form must reproduce the above copyright
+;;;    notice, this list of conditions and the following disclaimer in the
+;;;    documentation and/or other materials provided with the distribution.
+;;; 3. Neither the name of authors nor the names of its contributors
+;;;    may be used to endorse or promote products derived from this software
+;;;    without specific prior written permission.
+;;;
+;;; THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+;;; ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+;;; IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+;;; ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+;;; FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+;;; DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+;;; OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+;;; HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+;;; LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+;;; OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+;;; SUCH DAMAGE.
+;;;
+
+(define-module test.util.test-rule-table
+  (use gauche.uvector)
+  (use file.util)
+  (use test.unit.test-case)
+  (use test.uim-test))
+(select-module test.util.test-rule-table)
+
+(define test-rule-table-file
+  (uim-test-build-path "test" "test-rule-table.rtbl"))
+(define test-rule-table-twice-file
+  (uim-test-build-path "test" "test-rule-table-twice.rtbl"))
+(define test-rule-table-broken-file
+  (uim-test-build-path "test" "test-rule-table-broken.rtbl"))
+
+;; the plugin caches opened tables by path, so every broken table is
+;; written to a fresh path
+(define test-rule-table-broken-count 0)
+
+(define test-rule-table-seqs
+  '(() ("") ("a") ("o") ("z")
+    ("k") ("k" "a") ("k" "y") ("k" "y" "a") ("k" "y" "y") ("k" "y" "a" "a")
+    ("s") ("s" "s") ("s" "s" "s")
+    ("p") ("p" "p") ("p" "p" "p")))
+
+(define (remove-test-files)
+  (for-each (lambda (file)
+              (if (file-exists? file)
+                (sys-unlink file)))
+            (append (list test-rule-table-file test-rule-table-twice-file)
+                    (map (lambda (i)
+                           (string-append test-rule-table-broken-file
+                                          "." (number->string i)))
+                         (iota test-rule-table-broken-count)))))
+
+(define (setup)
+  (uim-test-setup)
+  (uim-eval '(require "rk.scm"))
+  (uim-eval '(require-dynlib "rule-table"))
+  (uim-eval
+   '(define test-rk-rule '(((("a"). ()) ("あ" "ア" "ｱ"))
+                           ((("i"). ()) ("い" "イ" "ｲ"))
+                           ((("u"). ()) ("う" "ウ" "ｳ"))
+                           ((("e"). ()) ("え" "エ" "ｴ"))
+                           ((("o"). ()) ("お" "オ" "ｵ"))
+
+                           ((("k" "a"). ()) ("か" "カ" "ｶ"))
+                           ((("k" "i"). ()) ("き" "キ" "ｷ"))
+                           ((("k" "u"). ()) ("く" "ク" "ｸ"))
+                           ((("k" "e"). ()) ("け" "ケ" "ｹ"))
+                           ((("k" "o"). ()) ("こ" "コ" "ｺ"))
+                           ((("k" "y" "a"). ()) ("きゃ" "キャ" "ｷｬ"))
+                           ((("k" "y" "i"). ()) ("きぃ" "キィ" "ｷｨ"))
+                           ((("k" "y" "u"). ()) ("きゅ" "キュ" "ｷｭ"))
+                           ((("k" "y" "e"). ()) ("きぇ" "キェ" "ｷｪ"))
+                           ((("k" "y" "o"). ()) ("きょ" "キョ" "ｷｮ"))
+
+                           ((("s" "s"). ("s")) ("っ" "ッ" "ｯ"))
+                           ((("s" "a"). ()) ("さ" "サ" "ｻ"))
+                           ((("s" "i"). ()) ("し" "シ" "ｼ"))
+                           ((("s" "u"). ()) ("す" "ス" "ｽ"))
+                           ((("s" "e"). ()) ("せ" "セ" "ｾ"))
+                           ((("s" "o"). ()) ("そ" "ソ" "ｿ"))
+
+                           ((("p" "p"). ("p")) ("っ" "ッ" "ｯ")))))
+  ;; duplicated rules must be returned in list order
+  (uim-eval
+   '(define test-rk-rule-twice (append test-rk-rule test-rk-rule)))
+  (remove-test-files)
+  (assert-uim-true `(rule-table-compile test-rk-rule
+                                        ,test-rule-table-file))
+  (assert-uim-true `(rule-table-compile test-rk-rule-twice
+                                        ,test-rule-table-twice-file))
+  (uim-eval `(define test-rule-table
+               (rule-table-open ,test-rule-table-file)))
+  (uim-eval `(define test-rule-table-twice
+               (rule-table-open ,test-rule-table-twice-file))))
+
+(define (teardown)
+  (uim-test-teardown)
+  (remove-test-files))
+
+;; compares the rk-lib procedure with the rule-table procedure for
+;; every test sequence
+(define (assert-rule-table-same rk-proc table-proc rule table . args)
+  (for-each (lambda (seq)
+              (assert-equal (uim `(,rk-proc ',seq ,rule ,@args))
+                            (uim `(,table-proc ',seq ,table ,@args))))
+            test-rule-table-seqs))
+
+;; writes a copy of the compiled table modified by MODIFY and returns
+;; whether rule-table-open accepts it
+(define (open-broken-rule-table modify)
+  (let* ((size (file-size test-rule-table-file))
+         (bytes (call-with-input-file test-rule-table-file
+                  (lambda (in)
+                    (let ((v (make-u8vector size)))
+                      (read-block! v in)
+                      v))))
+         (file (string-append test-rule-table-broken-file "."
+                              (number->string
+                               test-rule-table-broken-count))))
+    (inc! test-rule-table-broken-count)
+    (call-with-output-file file
+      (lambda (out)
+        (write-block (modify bytes) out)))
+    (uim `(rule-table? (rule-table-open ,file)))))
+
+(define (u8vector-set-u32! v offset n)
+  ;; byte order does not matter for the values written by the tests
+  (for-each (lambda (i)
+              (u8vector-set! v (+ offset i) n))
+            '(0 1 2 3))
+  v)
+
+(define (test-rule-table-open)
+  (assert-uim-true '(rule-table? test-rule-table))
+  (assert-uim-true '(rule-table? test-rule-table-twice))
+  (assert-uim-false '(rule-table? test-rk-rule))
+  (assert-uim-false '(rule-table? #f))
+  ;; the same path returns the same table
+  (assert-uim-true `(eq? test-rule-table
+                         (rule-table-open ,test-rule-table-file)))
+  (assert-uim-false `(rule-table-open ,test-rule-table-broken-file))
+  ;; malformed rule lists are rejected
+  (assert-uim-error `(rule-table-compile '(("a" "b"))
+                                         ,test-rule-table-broken-file))
+  (assert-false (file-exists? test-rule-table-broken-file))
+  #f)
+
+(define (test-rule-table-find-seq)
+  (assert-rule-table-same 'rk-lib-find-seq 'rule-table-find-seq
+                          'test-rk-rule 'test-rule-table)
+  (assert-rule-table-same 'rk-lib-find-seq 'rule-table-find-seq
+                          'test-rk-rule-twice 'test-rule-table-twice)
+  #f)
+
+(define (test-rule-table-find-partial-seq)
+  (assert-rule-table-same 'rk-lib-find-partial-seq
+                          'rule-table-find-partial-seq
+                          'test-rk-rule 'test-rule-table)
+  (assert-rule-table-same 'rk-lib-find-partial-seq
+                          'rule-table-find-partial-seq
+                          'test-rk-rule-twice 'test-rule-table-twice)
+  (assert-rule-table-same 'rk-lib-find-partial-seqs
+                          'rule-table-find-partial-seqs
+                          'test-rk-rule 'test-rule-table)
+  (assert-rule-table-same 'rk-lib-find-partial-seqs
+                          'rule-table-find-partial-seqs
+                          'test-rk-rule-twice 'test-rule-table-twice)
+  #f)
+
+(define (test-rule-table-find-cands-incl-minimal-partial)
+  (assert-rule-table-same 'rk-find-cands-incl-minimal-partial
+                          'rule-table-find-cands-incl-minimal-partial
+                          'test-rk-rule 'test-rule-table)
+  (assert-rule-table-same 'rk-find-cands-incl-minimal-partial
+                          'rule-table-find-cands-incl-minimal-partial
+                          'test-rk-rule-twice 'test-rule-table-twice)
+  #f)
+
+(define (test-rule-table-expect-seq)
+  (assert-rule-table-same 'rk-lib-expect-seq 'rule-table-expect-seq
+                          'test-rk-rule 'test-rule-table)
+  (assert-rule-table-same 'rk-lib-expect-seq 'rule-table-expect-seq
+                          'test-rk-rule-twice 'test-rule-table-twice)
+  (for-each (lambda (key)
+              (assert-rule-table-same 'rk-lib-expect-key-for-seq?
+                                      'rule-table-expect-key-for-seq?
+                                      'test-rk-rule 'test-rule-table
+                                      key))
+            '("a" "k" "y" "s" "p" "z"))
+  #f)
+
+(define (test-rule-table-rk-context)
+  (uim-eval '(define test-rc (rk-context-new test-rule-table #f #f)))
+  (assert-uim-true '(eq? rule-table-find-seq
+                         (rk-context-find-seq test-rc)))
+  (assert-uim-true '(eq? rule-table-expect-seq
+                         (rk-context-expect-seq test-rc)))
+  (uim-eval '(define test-rc (rk-context-new test-rk-rule #f #f)))
+  (assert-uim-true '(eq? rk-lib-find-seq
+                         (rk-context-find-seq test-rc)))
+  #f)
+
+(define (test-rule-table-broken)
+  ;; truncated files
+  (assert-false (open-broken-rule-table
+                 (lambda (v) (u8vector-copy v 0 0))))
+  (assert-false (open-broken-rule-table
+                 (lambda (v) (u8vector-copy v 0 16))))
+  (assert-false (open-broken-rule-table
+                 (lambda (v) (u8vector-copy v 0 (quotient (u8vector-length v) 2)))))
+  (assert-false (open-broken-rule-table
+                 (lambda (v) (u8vector-copy v 0 (- (u8vector-length v) 1)))))
+  ;; corrupt files
+  (assert-false (open-broken-rule-table
+                 (lambda (v) (u8vector-set! v 0 0) v)))
+  ;; byte order
+  (assert-false (open-broken-rule-table
+                 (lambda (v) (u8vector-set-u32! v 12 #xff))))
+  ;; nodes_off
+  (assert-false (open-broken-rule-table
+                 (lambda (v) (u8vector-set-u32! v 36 #xff))))
+  ;; first_child of the root node, which follows the 60 byte header
+  (assert-false (open-broken-rule-table
+                 (lambda (v) (u8vector-set-u32! v 72 #xff))))
+  ;; the last string is not terminated
+  (assert-false (open-broken-rule-table
+                 (lambda (v)
+                   (u8vector-set! v (- (u8vector-length v) 1) (char->integer #\a))
+                   v)))
+  ;; an intact copy still opens
+  (assert-true (open-broken-rule-table (lambda (v) v)))
+  #f)
+
+(provide "test/util/test-rule-table")
@@ -42,6 +42,7 @@
 #include "uim-scm.h"
 #include "uim-scm-abbrev.h"
 #include "uim-util.h"
+#include "uim-trace.h"
 #include "dynlib.h"
 
 
@@ -147,10 +148,13 @@ set_string(uim_lisp ac_, uim_lisp str_)
 {
   anthy_context_t ac;
   const char *str;
+  long trace_start;
 
   ac = get_anthy_context(ac_);
   str = REFER_C_STR(str_);
+  UIM_TRACE_BEGIN(anthy_convert, 0, trace_start);
   anthy_set_string(ac, str);
+  UIM_TRACE_END(anthy_convert, 0, trace_start);
 
   return uim_scm_f();
 }
@@ -79,52 +79,135 @@ check_encoding_equivalence(const char *tocode, const char *fromcode)
 {
   const char **alias_tocode;
   const char **alias_fromcode;
+  const char *single_tocode[2], *single_fromcode[2];
   int i, j;
-  int alias_tocode_alloced = 0;
-  int alias_fromcode_alloced = 0;
-  int found = 0;
 
   assert(tocode);
   assert(fromcode);
 
+  if (!strcmp(tocode, fromcode))
+    return 1;
+
   alias_tocode = uim_get_encoding_alias(tocode);
   alias_fromcode = uim_get_encoding_alias(fromcode);
 
+  if (alias_tocode && alias_tocode == alias_fromcode)
+    return 1;
   if (!alias_tocode) {
-    alias_tocode = uim_malloc(sizeof(char *) * 2);
-    alias_tocode[0] = tocode;
-    alias_tocode[1] = NULL;
-    alias_tocode_alloced = 1;
+    single_tocode[0] = tocode;
+    single_tocode[1] = NULL;
+    alias_tocode = single_tocode;
   }
   if (!alias_fromcode) {
-    alias_fromcode = uim_malloc(sizeof(char *) * 2);
-    alias_fromcode[0] = fromcode;
-    alias_fromcode[1] = NULL;
-    alias_fromcode_alloced = 1;
+    single_fromcode[0] = fromcode;
+    single_fromcode[1] = NULL;
+    alias_fromcode = single_fromcode;
   }
 
   for (i = 0; alias_tocode[i]; i++) {
     for (j = 0; alias_fromcode[j]; j++) {
-      if (!strcmp(alias_tocode[i], alias_fromcode[j])) {
-        found = 1;
-	break;
-      }
+      if (!strcmp(alias_tocode[i], alias_fromcode[j]))
+        return 1;
     }
-    if (found)
-      break;
   }
+  return 0;
+}
+
+/*
+ * Convertibility of encoding pairs and iconv descriptors are cached
+ * per pair of normalized encoding names. The descriptor opened to check
+ * the convertibility is kept and handed out by uim_iconv_create() while
+ * it is not used, and uim_iconv_release() returns it to the cache
+ * instead of closing. Other descriptors of the same pair are opened
+ * and closed as before.
+ */
+#define ICONV_CACHE_SIZE 16
+
+struct iconv_cache_entry {
+  char *tocode;    /* normalized */
+  char *fromcode;  /* normalized */
+  uim_bool convertible;
+  iconv_t cd;      /* (iconv_t)-1 if none */
+  uim_bool in_use;
+};
+
+static struct iconv_cache_entry iconv_cache[ICONV_CACHE_SIZE];
+static int iconv_cache_next;
+
+static const char *
+normalize_encoding(const char *encoding)
+{
+  const char **alias;
+
+  alias = uim_get_encoding_alias(encoding);
+  return (alias) ? alias[0] : encoding;
+}
+
+static struct iconv_cache_entry *
+iconv_cache_lookup(const char *tocode, const char *fromcode)
+{
+  struct iconv_cache_entry *ent;
+  int i;
+
+  tocode = normalize_encoding(tocode);
+  fromcode = normalize_encoding(fromcode);
+  for (i = 0; i < ICONV_CACHE_SIZE; i++) {
+    ent = &iconv_cache[i];
+    if (ent->tocode
+	&& !strcmp(ent->tocode, tocode) && !strcmp(ent->fromcode, fromcode))
+      return ent;
+  }
+  return NULL;
+}
+
+static void
+iconv_cache_clear_entry(struct iconv_cache_entry *ent)
+{
+  /* a descriptor in use is closed by uim_iconv_release() */
+  if (ent->cd != (iconv_t)-1 && !ent->in_use)
+    iconv_close(ent->cd);
+  free(ent->tocode);
+  free(ent->fromcode);
+  ent->tocode = ent->fromcode = NULL;
+  ent->cd = (iconv_t)-1;
+  ent->in_use = UIM_FALSE;
+}
+
+static struct iconv_cache_entry *
+iconv_cache_add(const char *tocode, const char *fromcode, iconv_t cd)
+{
+  struct iconv_cache_entry *ent;
+
+  ent = &iconv_cache[iconv_cache_next];
+  iconv_cache_next = (iconv_cache_next + 1) % ICONV_CACHE_SIZE;
+  if (ent->tocode)
+    iconv_cache_clear_entry(ent);
+
+  ent->tocode = uim_strdup(normalize_encoding(tocode));
+  ent->fromcode = uim_strdup(normalize_encoding(fromcode));
+  ent->convertible = (cd != (iconv_t)-1);
+  ent->cd = cd;
+  ent->in_use = UIM_FALSE;
 
-  if (alias_tocode_alloced)
-    free(alias_tocode);
-  if (alias_fromcode_alloced)
-    free(alias_fromcode);
-  return found;
+  return ent;
+}
+
+void
+uim_quit_iconv(void)
+{
+  int i;
+
+  for (i = 0; i < ICONV_CACHE_SIZE; i++) {
+    if (iconv_cache[i].tocode)
+      iconv_cache_clear_entry(&iconv_cache[i]);
+  }
+  iconv_cache_next = 0;
 }
 
 static int
 uim_iconv_is_convertible(const char *tocode, const char *fromcode)
 {
-  iconv_t ic;
+  struct iconv_cache_entry *ent;
   uim_bool result;
 
   if (UIM_CATCH_ERROR_BEGIN())
@@ -139,14 +222,11 @@ uim_iconv_is_convertible(const char *tocode, const char *fromcode)
       break;
     }
 
-    /* TODO cache the result */
-    ic = (iconv_t)uim_iconv_open(tocode, fromcode);
-    if (ic == (iconv_t)-1) {
-      result = UIM_FALSE;
-      break;
-    }
-    iconv_close(ic);
-    result = UIM_TRUE;
+    ent = iconv_cache_lookup(tocode, fromcode);
+    if (!ent)
+      ent = iconv_cache_add(tocode, fromcode,
+			    (iconv_t)uim_iconv_open(tocode, fromcode));
+    result = ent->convertible;
   } while (/* CONSTCOND */ 0);
 
   UIM_CATCH_ERROR_END();
@@ -177,9 +257,7 @@ uim_iconv_open(const char *tocode, const char *fromcode)
   iconv_t cd = (iconv_t)-1;
   int i, j;
   const char **alias_tocode, **alias_fromcode;
-  int alias_tocode_alloced = 0;
-  int alias_fromcode_alloced = 0;
-  int opened = 0;
+  const char *single_tocode[2], *single_fromcode[2];
 
   assert(tocode);
   assert(fromcode);
@@ -188,40 +266,31 @@ uim_iconv_open(const char *tocode, const char *fromcode)
   alias_fromcode = uim_get_encoding_alias(fromcode);
 
   if (!alias_tocode) {
-    alias_tocode = uim_malloc(sizeof(char *) * 2);
-    alias_tocode[0] = tocode;
-    alias_tocode[1] = NULL;
-    alias_tocode_alloced = 1;
+    single_tocode[0] = tocode;
+    single_tocode[1] = NULL;
+    alias_tocode = single_tocode;
   }
   if (!alias_fromcode) {
-    alias_fromcode = uim_malloc(sizeof(char *) * 2);
-    alias_fromcode[0] = fromcode;
-    alias_fromcode[1] = NULL;
-    alias_fromcode_alloced = 1;
+    single_fromcode[0] = fromcode;
+    single_fromcode[1] = NULL;
+    alias_fromcode = single_fromcode;
   }
 
   for (i = 0; alias_tocode[i]; i++) {
     for (j = 0; alias_fromcode[j]; j++) {
       cd = iconv_open(alias_tocode[i], alias_fromcode[j]);
-      if (cd != (iconv_t)-1) {
-	opened = 1;
-	break;
-      }
+      if (cd != (iconv_t)-1)
+	return (void *)cd;
     }
-    if (opened)
-      break;
   }
 
-  if (alias_tocode_alloced)
-    free(alias_tocode);
-  if (alias_fromcode_alloced)
-    free(alias_fromcode);
   return (void *)cd;
 }
 
 static void *
 uim_iconv_create(const char *tocode, const char *fromcode)
 {
+  struct iconv_cache_entry *ent;
   iconv_t ic;
 
   if (UIM_CATCH_ERROR_BEGIN())
@@ -236,7 +305,22 @@ uim_iconv_create(const char *tocode, const char *fromcode)
       break;
     }
 
+    ent = iconv_cache_lookup(tocode, fromcode);
+    if (ent && !ent->convertible) {
+      ic = (iconv_t)0;
+      break;
+    }
+    if (ent && ent->cd != (iconv_t)-1 && !ent->in_use) {
+      ent->in_use = UIM_TRUE;
+      ic = ent->cd;
+      break;
+    }
+
     ic = (iconv_t)uim_iconv_open(tocode, fromcode);
+    if (!ent) {
+      ent = iconv_cache_add(tocode, fromcode, ic);
+      ent->in_use = (ic != (iconv_t)-1);
+    }
     if (ic == (iconv_t)-1) {
       /* since iconv_t is not explicit pointer, use 0 instead of NULL */
       ic = (iconv_t)0;
@@ -355,11 +439,25 @@ uim_iconv_code_conv(void *obj, const char *instr)
 static void
 uim_iconv_release(void *obj)
 {
+  struct iconv_cache_entry *ent;
+  int i;
+
   if (UIM_CATCH_ERROR_BEGIN())
     return;
 
-  if (obj)
-    iconv_close((iconv_t)obj);
+  if (obj) {
+    for (i = 0; i < ICONV_CACHE_SIZE; i++) {
+      ent = &iconv_cache[i];
+      if (ent->tocode && ent->in_use && ent->cd == (iconv_t)obj) {
+	/* back to the initial shift state for the next user */
+	iconv(ent->cd, NULL, NULL, NULL, NULL);
+	ent->in_use = UIM_FALSE;
+	break;
+      }
+    }
+    if (i == ICONV_CACHE_SIZE)
+      iconv_close((iconv_t)obj);
+  }
 
   UIM_CATCH_ERROR_END();
 }
@@ -33,6 +33,7 @@
 
 #include <config.h>
 
+#include <stdlib.h>
 #include <string.h>
 
 #include "uim-internal.h"
@@ -96,9 +97,330 @@ str_seq_partial(uim_lisp seq, uim_lisp rule)
   return uim_scm_f();
 }
 
+/*
+ * Rule index
+ *
+ * Rule lists such as ja-rk-rule or the rule tables of generic IMs are
+ * compiled into a trie keyed by the sequence elements. Each node keeps
+ * the first rule whose sequence ends there and the list-ordered indices
+ * of all rules passing through it, so that the rk-lib-* queries below
+ * cost O(sequence length) instead of O(rules).
+ *
+ * Compiled indices are cached by identity of the rule list. A list is
+ * compiled on its second lookup so that short-lived lists never pay
+ * the compilation cost. Rule lists are assumed not to be destructively
+ * modified on their sequences once they are used for lookups.
+ */
+
+#define RK_INDEX_CACHE_SIZE 16
+/* shorter rule lists are scanned linearly */
+#define RK_INDEX_MIN_RULES  32
+
+struct rk_node {
+  int parent;
+  int label;        /* offset into rk_index.labels */
+  unsigned int hash;
+  int exact;        /* first rule ending at this node, or -1 */
+  int partial_head; /* offset into rk_index.partials */
+  int nr_partials;  /* number of rules extending beyond this node */
+};
+
+struct rk_index {
+  uim_lisp *rules;  /* borrowed from the cached rule list */
+  long nr_rules;
+
+  struct rk_node *nodes;
+  int nr_nodes, nodes_cap;
+
+  char *labels;
+  size_t labels_len, labels_cap;
+
+  int *slots;       /* open addressing table of (parent, label) -> node */
+  size_t slots_mask;
+
+  int *partials;
+};
+
+struct rk_index_entry {
+  uim_lisp rules;
+  struct rk_index *index;
+  uim_bool unindexable;
+  unsigned long last_used;
+};
+
+static struct rk_index_entry rk_index_cache[RK_INDEX_CACHE_SIZE];
+static unsigned long rk_index_clock;
+
+static unsigned int
+rk_hash(int parent, const char *str)
+{
+  unsigned int h = 2166136261U ^ (unsigned int)parent;
+
+  for (; *str; str++)
+    h = (h ^ (unsigned char)*str) * 16777619U;
+  return h;
+}
+
+static int
+rk_index_child(struct rk_index *idx, int parent, const char *str,
+               unsigned int hash)
+{
+  size_t i;
+  int n;
+
+  for (i = hash & idx->slots_mask;
+       (n = idx->slots[i]) >= 0;
+       i = (i + 1) & idx->slots_mask)
+  {
+    struct rk_node *node = &idx->nodes[n];
+    if (node->hash == hash && node->parent == parent
+        && strcmp(&idx->labels[node->label], str) == 0)
+      return n;
+  }
+  return -1;
+}
+
+static void
+rk_index_rehash(struct rk_index *idx, size_t nr_slots)
+{
+  int n;
+
+  free(idx->slots);
+  idx->slots = uim_malloc(sizeof(int) * nr_slots);
+  memset(idx->slots, 0xff, sizeof(int) * nr_slots);
+  idx->slots_mask = nr_slots - 1;
+
+  /* node 0 is the root and has no entry */
+  for (n = 1; n < idx->nr_nodes; n++) {
+    size_t i = idx->nodes[n].hash & idx->slots_mask;
+    while (idx->slots[i] >= 0)
+      i = (i + 1) & idx->slots_mask;
+    idx->slots[i] = n;
+  }
+}
+
+static int
+rk_index_new_node(struct rk_index *idx, int parent, const char *str,
+                  unsigned int hash)
+{
+  struct rk_node *node;
+  size_t len;
+
+  if (idx->nr_nodes == idx->nodes_cap) {
+    idx->nodes_cap *= 2;
+    idx->nodes = uim_realloc(idx->nodes,
+                             sizeof(struct rk_node) * idx->nodes_cap);
+  }
+  node = &idx->nodes[idx->nr_nodes];
+  node->parent = parent;
+  node->hash = hash;
+  node->exact = -1;
+  node->partial_head = 0;
+  node->nr_partials = 0;
+
+  if (str) {
+    len = strlen(str) + 1;
+    while (idx->labels_len + len > idx->labels_cap) {
+      idx->labels_cap *= 2;
+      idx->labels = uim_realloc(idx->labels, idx->labels_cap);
+    }
+    memcpy(&idx->labels[idx->labels_len], str, len);
+    node->label = idx->labels_len;
+    idx->labels_len += len;
+  } else {
+    node->label = -1;
+  }
+
+  return idx->nr_nodes++;
+}
+
+static int
+rk_index_intern(struct rk_index *idx, int parent, const char *str)
+{
+  unsigned int hash = rk_hash(parent, str);
+  int n;
+
+  if ((n = rk_index_child(idx, parent, str, hash)) >= 0)
+    return n;
+
+  n = rk_index_new_node(idx, parent, str, hash);
+  if ((size_t)idx->nr_nodes * 2 > idx->slots_mask + 1) {
+    rk_index_rehash(idx, (idx->slots_mask + 1) * 2);
+  } else {
+    size_t i = hash & idx->slots_mask;
+    while (idx->slots[i] >= 0)
+      i = (i + 1) & idx->slots_mask;
+    idx->slots[i] = n;
+  }
+  return n;
+}
+
+static void
+rk_index_free(struct rk_index *idx)
+{
+  if (!idx)
+    return;
+  free(idx->rules);
+  free(idx->nodes);
+  free(idx->labels);
+  free(idx->slots);
+  free(idx->partials);
+  free(idx);
+}
+
+/* returns NULL if a rule is not of the form (((str ...) . back) ...) */
+static struct rk_index *
+rk_index_new(uim_lisp rules)
+{
+  struct rk_index *idx;
+  uim_lisp rule, key, elm;
+  long i;
+  int n, total;
+
+  idx = uim_calloc(1, sizeof(struct rk_index));
+  idx->nr_rules = uim_scm_length(rules);
+  idx->rules = uim_malloc(sizeof(uim_lisp) * (idx->nr_rules + 1));
+  idx->nodes_cap = 256;
+  idx->nodes = uim_malloc(sizeof(struct rk_node) * idx->nodes_cap);
+  idx->labels_cap = 1024;
+  idx->labels = uim_malloc(idx->labels_cap);
+  rk_index_new_node(idx, -1, NULL, 0);
+  rk_index_rehash(idx, 512);
+
+  /* 1st pass: build the trie and count partial matches per node */
+  for (i = 0; CONSP(rules); rules = CDR(rules), i++) {
+    rule = CAR(rules);
+    if (!CONSP(rule) || !CONSP(CAR(rule))) {
+      rk_index_free(idx);
+      return NULL;
+    }
+    idx->rules[i] = rule;
+    n = 0;
+    for (key = CAR(CAR(rule)); CONSP(key); key = CDR(key)) {
+      elm = CAR(key);
+      if (!STRP(elm)) {
+        rk_index_free(idx);
+        return NULL;
+      }
+      idx->nodes[n].nr_partials++;
+      n = rk_index_intern(idx, n, REFER_C_STR(elm));
+    }
+    if (!NULLP(key)) {
+      rk_index_free(idx);
+      return NULL;
+    }
+    if (idx->nodes[n].exact < 0)
+      idx->nodes[n].exact = i;
+  }
+
+  total = 0;
+  for (n = 0; n < idx->nr_nodes; n++) {
+    idx->nodes[n].partial_head = total;
+    total += idx->nodes[n].nr_partials;
+    idx->nodes[n].nr_partials = 0;
+  }
+  idx->partials = uim_malloc(sizeof(int) * (total + 1));
+
+  /* 2nd pass: fill partial matches in list order */
+  for (i = 0; i < idx->nr_rules; i++) {
+    n = 0;
+    for (key = CAR(CAR(idx->rules[i])); CONSP(key); key = CDR(key)) {
+      struct rk_node *node = &idx->nodes[n];
+      const char *str = REFER_C_STR(CAR(key));
+
+      idx->partials[node->partial_head + node->nr_partials++] = i;
+      n = rk_index_child(idx, n, str, rk_hash(n, str));
+    }
+  }
+
+  return idx;
+}
+
+/* returns the node for seq, or -1 if no rule begins with seq */
+static int
+rk_index_find_node(struct rk_index *idx, uim_lisp seq, int *depth)
+{
+  uim_lisp elm;
+  const char *str;
+  int n = 0;
+
+  *depth = 0;
+  for (; CONSP(seq); seq = CDR(seq)) {
+    elm = CAR(seq);
+    if (!STRP(elm))
+      return -1;
+    str = REFER_C_STR(elm);
+    if ((n = rk_index_child(idx, n, str, rk_hash(n, str))) < 0)
+      return -1;
+    (*depth)++;
+  }
+  return n;
+}
+
+static uim_bool
+rk_rules_shortp(uim_lisp rules)
+{
+  int i;
+
+  for (i = 0; i < RK_INDEX_MIN_RULES; i++) {
+    if (!CONSP(rules))
+      return UIM_TRUE;
+    rules = CDR(rules);
+  }
+  return UIM_FALSE;
+}
+
+/* returns NULL if rules should be scanned linearly */
+static struct rk_index *
+rk_index_lookup(uim_lisp rules)
+{
+  struct rk_index_entry *ent, *victim;
+  int i;
+
+  if (!CONSP(rules))
+    return NULL;
+
+  victim = &rk_index_cache[0];
+  for (i = 0; i < RK_INDEX_CACHE_SIZE; i++) {
+    ent = &rk_index_cache[i];
+    if (EQ(ent->rules, rules)) {
+      ent->last_used = ++rk_index_clock;
+      if (!ent->index && !ent->unindexable) {
+        ent->index = rk_index_new(rules);
+        ent->unindexable = !ent->index;
+      }
+      return ent->index;
+    }
+    if (ent->last_used < victim->last_used)
+      victim = ent;
+  }
+
+  if (rk_rules_shortp(rules))
+    return NULL;
+
+  /* remember the list and compile it if it is looked up again */
+  rk_index_free(victim->index);
+  victim->rules = rules;
+  victim->index = NULL;
+  victim->unindexable = UIM_FALSE;
+  victim->last_used = ++rk_index_clock;
+
+  return NULL;
+}
+
 static uim_lisp
 rk_find_seq(uim_lisp seq, uim_lisp rules)
 {
+  struct rk_index *idx;
+  int n, depth;
+
+  if ((idx = rk_index_lookup(rules))) {
+    n = rk_index_find_node(idx, seq, &depth);
+    if (n < 0 || idx->nodes[n].exact < 0)
+      return uim_scm_f();
+    return idx->rules[idx->nodes[n].exact];
+  }
+
   for (; !uim_scm_nullp(rules); rules = uim_scm_cdr(rules)) {
     uim_lisp rule = uim_scm_car(rules);
     uim_lisp key = uim_scm_car(uim_scm_car(rule));
@@ -112,6 +434,18 @@ rk_find_seq(uim_lisp seq, uim_lisp rules)
 static uim_lisp
 rk_find_partial_seq(uim_lisp seq, uim_lisp rules)
 {
+  struct rk_index *idx;
+  struct rk_node *node;
+  int n, depth;
+
+  if ((idx = rk_index_lookup(rules))) {
+    n = rk_index_find_node(idx, seq, &depth);
+    if (n < 0 || !idx->nodes[n].nr_partials)
+      return uim_scm_f();
+    node = &idx->nodes[n];
+    return idx->rules[idx->partials[node->partial_head]];
+  }
+
   for (; !uim_scm_nullp(rules); rules = uim_scm_cdr(rules)) {
     uim_lisp rule = uim_scm_car(rules);
     uim_lisp key = uim_scm_car(uim_scm_car(rule));
@@ -126,6 +460,19 @@ static uim_lisp
 rk_find_partial_seqs(uim_lisp seq, uim_lisp rules)
 {
   uim_lisp ret = uim_scm_null();
+  struct rk_index *idx;
+  struct rk_node *node;
+  int n, i, depth;
+
+  if ((idx = rk_index_lookup(rules))) {
+    n = rk_index_find_node(idx, seq, &depth);
+    if (n < 0)
+      return ret;
+    node = &idx->nodes[n];
+    for (i = node->nr_partials - 1; i >= 0; i--)
+      ret = CONS(idx->rules[idx->partials[node->partial_head + i]], ret);
+    return ret;
+  }
 
   for (; !uim_scm_nullp(rules); rules = uim_scm_cdr(rules)) {
     uim_lisp rule = uim_scm_car(rules);
@@ -145,6 +492,24 @@ static uim_lisp
 rk_expect_seq(uim_lisp seq, uim_lisp rules)
 {
   uim_lisp cur, res = uim_scm_null();
+  struct rk_index *idx;
+  struct rk_node *node;
+  int n, i, j, depth;
+
+  if ((idx = rk_index_lookup(rules))) {
+    n = rk_index_find_node(idx, seq, &depth);
+    if (n < 0)
+      return res;
+    node = &idx->nodes[n];
+    for (i = 0; i < node->nr_partials; i++) {
+      cur = CAR(CAR(idx->rules[idx->partials[node->partial_head + i]]));
+      for (j = 0; j < depth; j++)
+        cur = CDR(cur);
+      res = CONS(CAR(cur), res);
+    }
+    return res;
+  }
+
   for (cur = rules; !uim_scm_nullp(cur); cur = uim_scm_cdr(cur)) {
     uim_lisp rule = uim_scm_car(cur);
     uim_lisp key = CAR(CAR(rule));
@@ -165,6 +530,18 @@ static uim_lisp
 rk_expect_key_for_seq(uim_lisp seq, uim_lisp rules, uim_lisp key)
 {
   uim_lisp cur;
+  struct rk_index *idx;
+  const char *str;
+  int n, depth;
+
+  if ((idx = rk_index_lookup(rules))) {
+    n = rk_index_find_node(idx, seq, &depth);
+    if (n < 0 || !STRP(key))
+      return uim_scm_f();
+    str = REFER_C_STR(key);
+    return MAKE_BOOL(rk_index_child(idx, n, str, rk_hash(n, str)) >= 0);
+  }
+
   for (cur = rules; !uim_scm_nullp(cur); cur = uim_scm_cdr(cur)) {
     uim_lisp rule = uim_scm_car(cur);
     uim_lisp seq_in_rule = CAR(CAR(rule));
@@ -180,6 +557,8 @@ rk_expect_key_for_seq(uim_lisp seq, uim_lisp rules, uim_lisp key)
 void
 uim_init_rk_subrs(void)
 {
+  int i;
+
   uim_scm_init_proc2("str-seq-equal?", str_seq_equal);
   uim_scm_init_proc2("str-seq-partial?", str_seq_partial);
   uim_scm_init_proc2("rk-lib-find-seq", rk_find_seq);
@@ -187,4 +566,26 @@ uim_init_rk_subrs(void)
   uim_scm_init_proc2("rk-lib-find-partial-seqs", rk_find_partial_seqs);
   uim_scm_init_proc2("rk-lib-expect-seq", rk_expect_seq);
   uim_scm_init_proc3("rk-lib-expect-key-for-seq?", rk_expect_key_for_seq);
+
+  for (i = 0; i < RK_INDEX_CACHE_SIZE; i++) {
+    rk_index_cache[i].rules = uim_scm_f();
+    rk_index_cache[i].index = NULL;
+    rk_index_cache[i].unindexable = UIM_FALSE;
+    rk_index_cache[i].last_used = 0;
+    uim_scm_gc_protect(&rk_index_cache[i].rules);
+  }
+  rk_index_clock = 0;
+}
+
+void
+uim_quit_rk(void)
+{
+  int i;
+
+  for (i = 0; i < RK_INDEX_CACHE_SIZE; i++) {
+    rk_index_free(rk_index_cache[i].index);
+    rk_index_cache[i].index = NULL;
+    rk_index_cache[i].rules = uim_scm_f();
+    uim_scm_gc_unprotect(&rk_index_cache[i].rules);
+  }
 }
@@ -0,0 +1,929 @@
+/*
+
+  Copyright (c) 2003-2013 uim Project https://github.com/uim/uim
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+  3. Neither the name of authors nor the names of its contributors
+     may be used to endorse or promote products derived from this software
+     without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * Precompiled rule tables
+ *
+ * A rule table is a rk rule list compiled into a trie and written to a
+ * file by rule-table-compile. rule-table-open maps the file read-only,
+ * so a large table such as wb86 is neither parsed by the Scheme reader
+ * nor copied into the Scheme heap, and its pages are shared among all
+ * processes using it. The lookup procedures take the same arguments
+ * and return the same rules as their rk-lib-* counterparts in rk.c.
+ *
+ * The file is written in the native byte order of the compiling host.
+ * A table of another byte order or format version is refused so that
+ * the caller can fall back to the Scheme rule list.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "uim.h"
+#include "uim-scm.h"
+#include "uim-scm-abbrev.h"
+#include "uim-notify.h"
+#include "dynlib.h"
+
+#define RTBL_MAGIC      "UIMRTBL"
+#define RTBL_VERSION    1
+#define RTBL_BYTE_ORDER 0x01020304
+#define RTBL_ROOT       0
+
+struct rtbl_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint32_t nr_nodes;
+  uint32_t nr_rules;
+  uint32_t nr_partials;
+  uint32_t nr_refs;
+  uint32_t strs_len;
+  uint32_t nodes_off;
+  uint32_t terminals_off;
+  uint32_t partials_off;
+  uint32_t rules_off;
+  uint32_t refs_off;
+  uint32_t strs_off;
+};
+
+/* children of a node are contiguous and sorted by label */
+struct rtbl_node {
+  uint32_t parent;
+  uint32_t label;          /* offset into strs */
+  uint32_t depth;
+  uint32_t first_child;
+  uint32_t nr_children;
+  uint32_t terminal_head;  /* rules ending at this node, in list order */
+  uint32_t nr_terminals;
+  uint32_t partial_head;   /* rules extending beyond this node */
+  uint32_t nr_partials;
+};
+
+struct rtbl_rule {
+  uint32_t node;           /* node at the end of the sequence */
+  uint32_t back_head;      /* offset into refs */
+  uint32_t nr_back;
+  uint32_t out_head;
+  uint32_t nr_out;
+};
+
+struct rule_table {
+  char *path;
+  void *map;
+  size_t len;
+  const struct rtbl_header *hdr;
+  const struct rtbl_node *nodes;
+  const uint32_t *terminals;
+  const uint32_t *partials;
+  const struct rtbl_rule *rules;
+  const uint32_t *refs;  /* offsets into strs */
+  const char *strs;
+  struct rule_table *next;
+};
+
+static struct rule_table *opened_tables;
+
+
+/*
+ * Loader
+ */
+
+static int
+rtbl_section_valid(const struct rule_table *t, uint32_t off, uint32_t nr,
+		   size_t size)
+{
+  return (off % sizeof(uint32_t) == 0
+	  && (uint64_t)off + (uint64_t)nr * size <= (uint64_t)t->len);
+}
+
+static int
+rtbl_range_valid(uint32_t head, uint32_t nr, uint32_t limit)
+{
+  return ((uint64_t)head + nr <= limit);
+}
+
+static int
+rtbl_validate(struct rule_table *t)
+{
+  const struct rtbl_header *hdr = t->hdr;
+  uint32_t i;
+
+  if (t->len < sizeof(struct rtbl_header)
+      || memcmp(hdr->magic, RTBL_MAGIC, sizeof(RTBL_MAGIC)) != 0
+      || hdr->version != RTBL_VERSION
+      || hdr->byte_order != RTBL_BYTE_ORDER
+      || hdr->nr_nodes == 0 || hdr->strs_len == 0)
+    return 0;
+
+  if (!rtbl_section_valid(t, hdr->nodes_off, hdr->nr_nodes,
+			  sizeof(struct rtbl_node))
+      || !rtbl_section_valid(t, hdr->terminals_off, hdr->nr_rules,
+			     sizeof(uint32_t))
+      || !rtbl_section_valid(t, hdr->partials_off, hdr->nr_partials,
+			     sizeof(uint32_t))
+      || !rtbl_section_valid(t, hdr->rules_off, hdr->nr_rules,
+			     sizeof(struct rtbl_rule))
+      || !rtbl_section_valid(t, hdr->refs_off, hdr->nr_refs,
+			     sizeof(uint32_t))
+      || (uint64_t)hdr->strs_off + hdr->strs_len > (uint64_t)t->len)
+    return 0;
+
+  t->nodes = (const struct rtbl_node *)((const char *)t->map + hdr->nodes_off);
+  t->terminals = (const uint32_t *)((const char *)t->map + hdr->terminals_off);
+  t->partials = (const uint32_t *)((const char *)t->map + hdr->partials_off);
+  t->rules = (const struct rtbl_rule *)((const char *)t->map + hdr->rules_off);
+  t->refs = (const uint32_t *)((const char *)t->map + hdr->refs_off);
+  t->strs = (const char *)t->map + hdr->strs_off;
+
+  /* every string must be terminated inside the mapping */
+  if (t->strs[hdr->strs_len - 1] != '\0')
+    return 0;
+
+  for (i = 0; i < hdr->nr_nodes; i++) {
+    const struct rtbl_node *node = &t->nodes[i];
+    if ((i != RTBL_ROOT && node->parent >= i)
+	|| node->label >= hdr->strs_len
+	|| (node->nr_children && node->first_child <= i)
+	|| !rtbl_range_valid(node->first_child, node->nr_children,
+			     hdr->nr_nodes)
+	|| !rtbl_range_valid(node->terminal_head, node->nr_terminals,
+			     hdr->nr_rules)
+	|| !rtbl_range_valid(node->partial_head, node->nr_partials,
+			     hdr->nr_partials))
+      return 0;
+  }
+  for (i = 0; i < hdr->nr_rules; i++) {
+    const struct rtbl_rule *rule = &t->rules[i];
+    if (rule->node >= hdr->nr_nodes
+	|| !rtbl_range_valid(rule->back_head, rule->nr_back, hdr->nr_refs)
+	|| !rtbl_range_valid(rule->out_head, rule->nr_out, hdr->nr_refs)
+	|| t->terminals[i] >= hdr->nr_rules)
+      return 0;
+  }
+  for (i = 0; i < hdr->nr_partials; i++) {
+    if (t->partials[i] >= hdr->nr_rules)
+      return 0;
+  }
+  for (i = 0; i < hdr->nr_refs; i++) {
+    if (t->refs[i] >= hdr->strs_len)
+      return 0;
+  }
+
+  return 1;
+}
+
+static struct rule_table *
+rtbl_open(const char *path)
+{
+  struct rule_table *t;
+  struct stat st;
+  void *map;
+  int fd;
+
+  for (t = opened_tables; t; t = t->next) {
+    if (strcmp(t->path, path) == 0)
+      return t;
+  }
+
+  if ((fd = open(path, O_RDONLY)) < 0)
+    return NULL;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0
+      || (uint64_t)st.st_size > SIZE_MAX) {
+    close(fd);
+    return NULL;
+  }
+  map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED)
+    return NULL;
+
+  t = uim_calloc(1, sizeof(struct rule_table));
+  t->map = map;
+  t->len = (size_t)st.st_size;
+  t->hdr = map;
+  if (!rtbl_validate(t)) {
+    uim_notify_info("rule table %s is broken or incompatible", path);
+    munmap(map, t->len);
+    free(t);
+    return NULL;
+  }
+  t->path = uim_strdup(path);
+  t->next = opened_tables;
+  opened_tables = t;
+
+  return t;
+}
+
+static struct rule_table *
+rtbl_refer(uim_lisp table_)
+{
+  struct rule_table *t;
+
+  if (PTRP(table_)) {
+    for (t = opened_tables; t; t = t->next) {
+      if (t == C_PTR(table_))
+	return t;
+    }
+  }
+  ERROR_OBJ("rule table required but got", table_);
+  return NULL;  /* not reached */
+}
+
+
+/*
+ * Lookups
+ */
+
+static const char *
+rtbl_label(const struct rule_table *t, uint32_t n)
+{
+  return &t->strs[t->nodes[n].label];
+}
+
+/* returns 0 (the root, which is never a child) if no child matches */
+static uint32_t
+rtbl_child(const struct rule_table *t, uint32_t n, const char *str)
+{
+  uint32_t lo, hi, mid;
+  int cmp;
+
+  lo = t->nodes[n].first_child;
+  hi = lo + t->nodes[n].nr_children;
+  while (lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    cmp = strcmp(str, rtbl_label(t, mid));
+    if (cmp == 0)
+      return mid;
+    if (cmp < 0)
+      hi = mid;
+    else
+      lo = mid + 1;
+  }
+  return RTBL_ROOT;
+}
+
+/* returns 0 if no rule begins with seq and seq is not empty */
+static uint32_t
+rtbl_find_node(const struct rule_table *t, uim_lisp seq, int *found)
+{
+  uim_lisp elm;
+  uint32_t n = RTBL_ROOT;
+
+  *found = 0;
+  for (; CONSP(seq); seq = CDR(seq)) {
+    elm = CAR(seq);
+    if (!STRP(elm))
+      return RTBL_ROOT;
+    if ((n = rtbl_child(t, n, REFER_C_STR(elm))) == RTBL_ROOT)
+      return RTBL_ROOT;
+  }
+  *found = 1;
+  return n;
+}
+
+static uim_lisp
+rtbl_make_str_list(const struct rule_table *t, uint32_t head, uint32_t nr)
+{
+  uim_lisp lst = uim_scm_null();
+
+  while (nr--)
+    lst = CONS(MAKE_STR(&t->strs[t->refs[head + nr]]), lst);
+  return lst;
+}
+
+/* ((seq . back) out) */
+static uim_lisp
+rtbl_make_rule(const struct rule_table *t, uint32_t r)
+{
+  const struct rtbl_rule *rule = &t->rules[r];
+  uim_lisp seq, back, out;
+  uint32_t n;
+
+  seq = uim_scm_null();
+  for (n = rule->node; n != RTBL_ROOT; n = t->nodes[n].parent)
+    seq = CONS(MAKE_STR(rtbl_label(t, n)), seq);
+  back = rtbl_make_str_list(t, rule->back_head, rule->nr_back);
+  out = rtbl_make_str_list(t, rule->out_head, rule->nr_out);
+
+  return LIST2(CONS(seq, back), out);
+}
+
+/* the ancestor of n at the given depth */
+static uint32_t
+rtbl_ancestor(const struct rule_table *t, uint32_t n, uint32_t depth)
+{
+  while (t->nodes[n].depth > depth)
+    n = t->nodes[n].parent;
+  return n;
+}
+
+static uim_lisp
+rule_table_find_seq(uim_lisp seq_, uim_lisp table_)
+{
+  struct rule_table *t = rtbl_refer(table_);
+  uint32_t n;
+  int found;
+
+  n = rtbl_find_node(t, seq_, &found);
+  if (!found || !t->nodes[n].nr_terminals)
+    return uim_scm_f();
+  return rtbl_make_rule(t, t->terminals[t->nodes[n].terminal_head]);
+}
+
+static uim_lisp
+rule_table_find_partial_seq(uim_lisp seq_, uim_lisp table_)
+{
+  struct rule_table *t = rtbl_refer(table_);
+  uint32_t n;
+  int found;
+
+  n = rtbl_find_node(t, seq_, &found);
+  if (!found || !t->nodes[n].nr_partials)
+    return uim_scm_f();
+  return rtbl_make_rule(t, t->partials[t->nodes[n].partial_head]);
+}
+
+static uim_lisp
+rule_table_find_partial_seqs(uim_lisp seq_, uim_lisp table_)
+{
+  struct rule_table *t = rtbl_refer(table_);
+  const struct rtbl_node *node;
+  uim_lisp ret_ = uim_scm_null();
+  uint32_t n, i;
+  int found;
+
+  n = rtbl_find_node(t, seq_, &found);
+  if (!found)
+    return ret_;
+  node = &t->nodes[n];
+  for (i = node->nr_partials; i > 0; i--)
+    ret_ = CONS(rtbl_make_rule(t, t->partials[node->partial_head + i - 1]),
+		ret_);
+  return ret_;
+}
+
+/* same order as rk-lib-expect-seq, including duplicates */
+static uim_lisp
+rule_table_expect_seq(uim_lisp seq_, uim_lisp table_)
+{
+  struct rule_table *t = rtbl_refer(table_);
+  const struct rtbl_node *node;
+  uim_lisp ret_ = uim_scm_null();
+  uint32_t n, i, next;
+  int found;
+
+  n = rtbl_find_node(t, seq_, &found);
+  if (!found)
+    return ret_;
+  node = &t->nodes[n];
+  for (i = 0; i < node->nr_partials; i++) {
+    next = rtbl_ancestor(t, t->rules[t->partials[node->partial_head + i]].node,
+			 node->depth + 1);
+    ret_ = CONS(MAKE_STR(rtbl_label(t, next)), ret_);
+  }
+  return ret_;
+}
+
+static uim_lisp
+rule_table_expect_key_for_seq(uim_lisp seq_, uim_lisp table_, uim_lisp key_)
+{
+  struct rule_table *t = rtbl_refer(table_);
+  uint32_t n;
+  int found;
+
+  n = rtbl_find_node(t, seq_, &found);
+  if (!found || !STRP(key_))
+    return uim_scm_f();
+  return MAKE_BOOL(rtbl_child(t, n, REFER_C_STR(key_)) != RTBL_ROOT);
+}
+
+static int
+rtbl_cmp_rule_index(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+/* concatenated sequence of rule r after the given depth */
+static uim_lisp
+rtbl_make_residual(const struct rule_table *t, uint32_t r, uint32_t depth)
+{
+  uint32_t n, len = 0;
+  char *buf, *p;
+
+  for (n = t->rules[r].node; t->nodes[n].depth > depth; n = t->nodes[n].parent)
+    len += strlen(rtbl_label(t, n));
+  buf = uim_malloc(len + 1);
+  p = buf + len;
+  *p = '\0';
+  for (n = t->rules[r].node; t->nodes[n].depth > depth; n = t->nodes[n].parent) {
+    size_t l = strlen(rtbl_label(t, n));
+    p -= l;
+    memcpy(p, rtbl_label(t, n), l);
+  }
+  return MAKE_STR_DIRECTLY(buf);
+}
+
+/*
+ * Native version of rk-find-cands-incl-minimal-partial: the exact
+ * candidates followed by the candidates of the shortest partial matches,
+ * found by a breadth-first walk from the node of seq.
+ *
+ * ((("cand0" "cand1") . "") (("a-cand0" "a-cand1") . "a") ...)
+ */
+static uim_lisp
+rule_table_find_cands_incl_minimal_partial(uim_lisp seq_, uim_lisp table_)
+{
+  struct rule_table *t = rtbl_refer(table_);
+  const struct rtbl_node *node;
+  uim_lisp ret_ = uim_scm_null();
+  uint32_t n, i, j, depth;
+  uint32_t *level, *next, nr_level, nr_next, cap;
+  uint32_t *found_rules, nr_found;
+  int found;
+
+  n = rtbl_find_node(t, seq_, &found);
+  if (!found)
+    return ret_;
+  node = &t->nodes[n];
+  depth = node->depth;
+
+  cap = node->nr_partials + 1;
+  level = uim_malloc(sizeof(uint32_t) * cap);
+  next = uim_malloc(sizeof(uint32_t) * cap);
+  found_rules = uim_malloc(sizeof(uint32_t) * cap);
+  nr_found = 0;
+
+  level[0] = n;
+  nr_level = 1;
+  while (nr_level && !nr_found) {
+    nr_next = 0;
+    for (i = 0; i < nr_level; i++) {
+      const struct rtbl_node *p = &t->nodes[level[i]];
+      for (j = 0; j < p->nr_children; j++) {
+	const struct rtbl_node *c = &t->nodes[p->first_child + j];
+	uint32_t k;
+	for (k = 0; k < c->nr_terminals; k++)
+	  found_rules[nr_found++] = t->terminals[c->terminal_head + k];
+	if (c->nr_partials)
+	  next[nr_next++] = p->first_child + j;
+      }
+    }
+    memcpy(level, next, sizeof(uint32_t) * nr_next);
+    nr_level = nr_next;
+  }
+  qsort(found_rules, nr_found, sizeof(uint32_t), rtbl_cmp_rule_index);
+
+  for (i = nr_found; i > 0; i--) {
+    uint32_t r = found_rules[i - 1];
+    ret_ = CONS(CONS(rtbl_make_str_list(t, t->rules[r].out_head,
+					t->rules[r].nr_out),
+		     rtbl_make_residual(t, r, depth)),
+		ret_);
+  }
+  free(level);
+  free(next);
+  free(found_rules);
+
+  if (node->nr_terminals) {
+    uint32_t r = t->terminals[node->terminal_head];
+    ret_ = CONS(CONS(rtbl_make_str_list(t, t->rules[r].out_head,
+					t->rules[r].nr_out),
+		     MAKE_STR("")),
+		ret_);
+  }
+  return ret_;
+}
+
+static uim_lisp
+rule_table_open(uim_lisp path_)
+{
+  struct rule_table *t;
+
+  if ((t = rtbl_open(REFER_C_STR(path_))))
+    return MAKE_PTR(t);
+  return uim_scm_f();
+}
+
+static uim_lisp
+rule_table_p(uim_lisp obj_)
+{
+  struct rule_table *t;
+
+  if (!PTRP(obj_))
+    return uim_scm_f();
+  for (t = opened_tables; t; t = t->next) {
+    if (t == C_PTR(obj_))
+      return uim_scm_t();
+  }
+  return uim_scm_f();
+}
+
+
+/*
+ * Compiler
+ */
+
+struct rtbl_builder {
+  struct bnode {
+    uint32_t parent, label, depth;
+    uint32_t child, sibling;  /* first child and next sibling, 0 if none */
+    uint32_t nr_terminals, nr_partials;
+  } *nodes;
+  uint32_t nr_nodes, nodes_cap;
+
+  char *strs;
+  uint32_t strs_len, strs_cap;
+  uint32_t *str_slots;        /* hash of offsets into strs for dedup */
+  uint32_t nr_str_slots, nr_str_used;
+
+  uint32_t *refs;
+  uint32_t nr_refs, refs_cap;
+};
+
+static uint32_t
+rtbl_str_hash(const char *str)
+{
+  uint32_t h = 2166136261U;
+
+  for (; *str; str++)
+    h = (h ^ (unsigned char)*str) * 16777619U;
+  return h;
+}
+
+static void
+rtbl_builder_rehash_strs(struct rtbl_builder *b, uint32_t nr_slots)
+{
+  uint32_t *old = b->str_slots, nr_old = b->nr_str_slots, i, h;
+
+  b->str_slots = uim_malloc(sizeof(uint32_t) * nr_slots);
+  memset(b->str_slots, 0xff, sizeof(uint32_t) * nr_slots);
+  b->nr_str_slots = nr_slots;
+  for (i = 0; i < nr_old; i++) {
+    if (old[i] == UINT32_MAX)
+      continue;
+    h = rtbl_str_hash(&b->strs[old[i]]) & (nr_slots - 1);
+    while (b->str_slots[h] != UINT32_MAX)
+      h = (h + 1) & (nr_slots - 1);
+    b->str_slots[h] = old[i];
+  }
+  free(old);
+}
+
+static uint32_t
+rtbl_builder_intern_str(struct rtbl_builder *b, const char *str)
+{
+  uint32_t h, off, len;
+
+  h = rtbl_str_hash(str) & (b->nr_str_slots - 1);
+  for (; (off = b->str_slots[h]) != UINT32_MAX;
+       h = (h + 1) & (b->nr_str_slots - 1))
+  {
+    if (strcmp(&b->strs[off], str) == 0)
+      return off;
+  }
+
+  len = strlen(str) + 1;
+  while (b->strs_len + len > b->strs_cap) {
+    b->strs_cap *= 2;
+    b->strs = uim_realloc(b->strs, b->strs_cap);
+  }
+  off = b->strs_len;
+  memcpy(&b->strs[off], str, len);
+  b->strs_len += len;
+
+  b->str_slots[h] = off;
+  if (++b->nr_str_used * 2 > b->nr_str_slots)
+    rtbl_builder_rehash_strs(b, b->nr_str_slots * 2);
+  return off;
+}
+
+static uint32_t
+rtbl_builder_intern_node(struct rtbl_builder *b, uint32_t parent,
+			 const char *str)
+{
+  uint32_t n, label;
+
+  label = rtbl_builder_intern_str(b, str);
+  for (n = b->nodes[parent].child; n; n = b->nodes[n].sibling) {
+    if (b->nodes[n].label == label)
+      return n;
+  }
+
+  if (b->nr_nodes == b->nodes_cap) {
+    b->nodes_cap *= 2;
+    b->nodes = uim_realloc(b->nodes, sizeof(struct bnode) * b->nodes_cap);
+  }
+  n = b->nr_nodes++;
+  memset(&b->nodes[n], 0, sizeof(struct bnode));
+  b->nodes[n].parent = parent;
+  b->nodes[n].label = label;
+  b->nodes[n].depth = b->nodes[parent].depth + 1;
+  b->nodes[n].sibling = b->nodes[parent].child;
+  b->nodes[parent].child = n;
+  return n;
+}
+
+/* returns the offset of the first ref */
+static uint32_t
+rtbl_builder_add_refs(struct rtbl_builder *b, uim_lisp lst, uint32_t *nr)
+{
+  uint32_t head = b->nr_refs;
+
+  for (*nr = 0; CONSP(lst); lst = CDR(lst), (*nr)++) {
+    if (b->nr_refs == b->refs_cap) {
+      b->refs_cap *= 2;
+      b->refs = uim_realloc(b->refs, sizeof(uint32_t) * b->refs_cap);
+    }
+    b->refs[b->nr_refs++] = rtbl_builder_intern_str(b, REFER_C_STR(CAR(lst)));
+  }
+  return head;
+}
+
+static uim_bool
+rtbl_str_listp(uim_lisp lst)
+{
+  for (; CONSP(lst); lst = CDR(lst)) {
+    if (!STRP(CAR(lst)))
+      return UIM_FALSE;
+  }
+  return NULLP(lst);
+}
+
+/* ((seq . back) out) where seq, back and out are lists of strings */
+static uim_bool
+rtbl_rulep(uim_lisp rule)
+{
+  return (CONSP(rule) && CONSP(CAR(rule)) && CONSP(CDR(rule))
+	  && rtbl_str_listp(CAR(CAR(rule))) && rtbl_str_listp(CDR(CAR(rule)))
+	  && rtbl_str_listp(CAR(CDR(rule))));
+}
+
+static const struct rtbl_builder *cmp_builder;
+
+static int
+rtbl_cmp_node_label(const void *a, const void *b)
+{
+  const struct bnode *x = &cmp_builder->nodes[*(const uint32_t *)a];
+  const struct bnode *y = &cmp_builder->nodes[*(const uint32_t *)b];
+
+  return strcmp(&cmp_builder->strs[x->label], &cmp_builder->strs[y->label]);
+}
+
+static int
+rtbl_write(const char *path, const struct rtbl_header *hdr,
+	   const void *sections[], const size_t sizes[], int nr_sections)
+{
+  char *tmp;
+  FILE *fp;
+  int i, ok;
+
+  if (uim_asprintf(&tmp, "%s.tmp", path) < 0 || !tmp)
+    return 0;
+  if (!(fp = fopen(tmp, "wb"))) {
+    free(tmp);
+    return 0;
+  }
+  ok = (fwrite(hdr, sizeof(*hdr), 1, fp) == 1);
+  for (i = 0; ok && i < nr_sections; i++) {
+    if (sizes[i])
+      ok = (fwrite(sections[i], sizes[i], 1, fp) == 1);
+  }
+  ok = (fclose(fp) == 0) && ok;
+  if (ok)
+    ok = (rename(tmp, path) == 0);
+  if (!ok)
+    unlink(tmp);
+  free(tmp);
+  return ok;
+}
+
+static uim_lisp
+rule_table_compile(uim_lisp rules_, uim_lisp path_)
+{
+  struct rtbl_builder b;
+  struct rtbl_header hdr;
+  struct rtbl_node *nodes;
+  struct rtbl_rule *rules;
+  uint32_t *terminals, *partials, *order, *new_id, *children;
+  uint32_t nr_rules, nr_partials, i, j, n, head, tail, nr;
+  uint32_t *terminal_fill, *partial_fill;
+  const void *sections[6];
+  size_t sizes[6];
+  uim_lisp lst, rule;
+  int ok;
+
+  nr_rules = 0;
+  for (lst = rules_; CONSP(lst); lst = CDR(lst), nr_rules++) {
+    if (!rtbl_rulep(CAR(lst)))
+      ERROR_OBJ("malformed rule", CAR(lst));
+  }
+  ENSURE_OBJ(NULLP(lst), "rule list required but got", rules_);
+
+  memset(&b, 0, sizeof(b));
+  b.nodes_cap = 256;
+  b.nodes = uim_malloc(sizeof(struct bnode) * b.nodes_cap);
+  memset(&b.nodes[0], 0, sizeof(struct bnode));
+  b.nr_nodes = 1;
+  b.strs_cap = 4096;
+  b.strs = uim_malloc(b.strs_cap);
+  b.strs[0] = '\0';  /* label of the root */
+  b.strs_len = 1;
+  rtbl_builder_rehash_strs(&b, 1024);
+  b.refs_cap = 1024;
+  b.refs = uim_malloc(sizeof(uint32_t) * b.refs_cap);
+
+  rules = uim_malloc(sizeof(struct rtbl_rule) * (nr_rules + 1));
+  nr_partials = 0;
+  for (i = 0, lst = rules_; i < nr_rules; i++, lst = CDR(lst)) {
+    uim_lisp seq;
+
+    rule = CAR(lst);
+    n = RTBL_ROOT;
+    for (seq = CAR(CAR(rule)); CONSP(seq); seq = CDR(seq)) {
+      b.nodes[n].nr_partials++;
+      nr_partials++;
+      n = rtbl_builder_intern_node(&b, n, REFER_C_STR(CAR(seq)));
+    }
+    b.nodes[n].nr_terminals++;
+    rules[i].node = n;
+    rules[i].back_head = rtbl_builder_add_refs(&b, CDR(CAR(rule)),
+					       &rules[i].nr_back);
+    rules[i].out_head = rtbl_builder_add_refs(&b, CAR(CDR(rule)),
+					      &rules[i].nr_out);
+  }
+
+  /* lay out nodes breadth-first so that children are contiguous */
+  order = uim_malloc(sizeof(uint32_t) * b.nr_nodes);
+  new_id = uim_malloc(sizeof(uint32_t) * b.nr_nodes);
+  children = uim_malloc(sizeof(uint32_t) * b.nr_nodes);
+  nodes = uim_calloc(b.nr_nodes, sizeof(struct rtbl_node));
+  order[0] = RTBL_ROOT;
+  new_id[RTBL_ROOT] = RTBL_ROOT;
+  cmp_builder = &b;
+  for (head = 0, tail = 1; head < tail; head++) {
+    const struct bnode *bn = &b.nodes[order[head]];
+
+    nr = 0;
+    for (n = bn->child; n; n = b.nodes[n].sibling)
+      children[nr++] = n;
+    qsort(children, nr, sizeof(uint32_t), rtbl_cmp_node_label);
+
+    nodes[head].parent = (head == RTBL_ROOT) ? RTBL_ROOT : new_id[bn->parent];
+    nodes[head].label = bn->label;
+    nodes[head].depth = bn->depth;
+    nodes[head].first_child = tail;
+    nodes[head].nr_children = nr;
+    for (j = 0; j < nr; j++) {
+      new_id[children[j]] = tail;
+      order[tail++] = children[j];
+    }
+  }
+
+  /* rule indices per node in list order */
+  terminals = uim_malloc(sizeof(uint32_t) * (nr_rules + 1));
+  partials = uim_malloc(sizeof(uint32_t) * (nr_partials + 1));
+  terminal_fill = uim_calloc(b.nr_nodes, sizeof(uint32_t));
+  partial_fill = uim_calloc(b.nr_nodes, sizeof(uint32_t));
+  for (i = 0, head = 0, tail = 0; i < b.nr_nodes; i++) {
+    nodes[i].terminal_head = head;
+    nodes[i].partial_head = tail;
+    head += b.nodes[order[i]].nr_terminals;
+    tail += b.nodes[order[i]].nr_partials;
+  }
+  for (i = 0; i < nr_rules; i++) {
+    n = new_id[rules[i].node];
+    rules[i].node = n;
+    terminals[nodes[n].terminal_head + terminal_fill[n]++] = i;
+    while (n != RTBL_ROOT) {
+      n = nodes[n].parent;
+      partials[nodes[n].partial_head + partial_fill[n]++] = i;
+    }
+  }
+  for (i = 0; i < b.nr_nodes; i++) {
+    nodes[i].nr_terminals = terminal_fill[i];
+    nodes[i].nr_partials = partial_fill[i];
+  }
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, RTBL_MAGIC, sizeof(RTBL_MAGIC));
+  hdr.version = RTBL_VERSION;
+  hdr.byte_order = RTBL_BYTE_ORDER;
+  hdr.nr_nodes = b.nr_nodes;
+  hdr.nr_rules = nr_rules;
+  hdr.nr_partials = nr_partials;
+  hdr.nr_refs = b.nr_refs;
+  hdr.strs_len = b.strs_len;
+
+  sections[0] = nodes;
+  sizes[0] = sizeof(struct rtbl_node) * b.nr_nodes;
+  sections[1] = terminals;
+  sizes[1] = sizeof(uint32_t) * nr_rules;
+  sections[2] = partials;
+  sizes[2] = sizeof(uint32_t) * nr_partials;
+  sections[3] = rules;
+  sizes[3] = sizeof(struct rtbl_rule) * nr_rules;
+  sections[4] = b.refs;
+  sizes[4] = sizeof(uint32_t) * b.nr_refs;
+  sections[5] = b.strs;
+  sizes[5] = b.strs_len;
+
+  hdr.nodes_off = sizeof(hdr);
+  hdr.terminals_off = hdr.nodes_off + sizes[0];
+  hdr.partials_off = hdr.terminals_off + sizes[1];
+  hdr.rules_off = hdr.partials_off + sizes[2];
+  hdr.refs_off = hdr.rules_off + sizes[3];
+  hdr.strs_off = hdr.refs_off + sizes[4];
+
+  ok = rtbl_write(REFER_C_STR(path_), &hdr, sections, sizes, 6);
+
+  free(b.nodes);
+  free(b.strs);
+  free(b.str_slots);
+  free(b.refs);
+  free(rules);
+  free(order);
+  free(new_id);
+  free(children);
+  free(nodes);
+  free(terminals);
+  free(partials);
+  free(terminal_fill);
+  free(partial_fill);
+
+  return MAKE_BOOL(ok);
+}
+
+void
+uim_plugin_instance_init(void)
+{
+  uim_scm_init_proc1("rule-table-open", rule_table_open);
+  uim_scm_init_proc1("rule-table?", rule_table_p);
+  uim_scm_init_proc2("rule-table-compile", rule_table_compile);
+
+  uim_scm_init_proc2("rule-table-find-seq", rule_table_find_seq);
+  uim_scm_init_proc2("rule-table-find-partial-seq",
+		     rule_table_find_partial_seq);
+  uim_scm_init_proc2("rule-table-find-partial-seqs",
+		     rule_table_find_partial_seqs);
+  uim_scm_init_proc2("rule-table-expect-seq", rule_table_expect_seq);
+  uim_scm_init_proc3("rule-table-expect-key-for-seq?",
+		     rule_table_expect_key_for_seq);
+  uim_scm_init_proc2("rule-table-find-cands-incl-minimal-partial",
+		     rule_table_find_cands_incl_minimal_partial);
+}
+
+void
+uim_plugin_instance_quit(void)
+{
+  struct rule_table *t, *next;
+
+  for (t = opened_tables; t; t = next) {
+    next = t->next;
+    munmap(t->map, t->len);
+    free(t->path);
+    free(t);
+  }
+  opened_tables = NULL;
+}
@@ -51,6 +51,8 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <sys/param.h>
+#include <stdint.h>
+#include <time.h>
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
@@ -66,8 +68,10 @@
 #include "uim-scm.h"
 #include "uim-scm-abbrev.h"
 #include "uim-helper.h"
+#include "uim-posix.h"
 #include "dynlib.h"
 #include "uim-notify.h"
+#include "uim-trace.h"
 #include "gettext.h"
 
 #include "bsdlook.h"
@@ -78,10 +82,44 @@
 #define skk_isascii(ch)	((((unsigned char)ch) & ~0x7f) == 0)
 
 #define IGNORING_WORD_MAX	63
+#define SKK_CACHE_HASH_MIN	256
+#define SKK_CACHE_CAPACITY_MIN	16	/* keeps lines in use while a nested
+					   lookup evicts */
+#define SKK_COMP_MAX	256	/* max completions taken from the cache */
+#define SKK_JOURNAL_HEADER	";; skk-uim-journal"
+#define SKK_JOURNAL_SYNC_RECORDS	16
+#define SKK_JOURNAL_SYNC_INTERVAL	30	/* sec */
+#define SKK_JOURNAL_COMPACT_SIZE	(64 * 1024)
 #define USE_SKK_JISYO_S_BUF	1	/* use SKK-JISYO.S as a cache for
 					   word completion */
 #define SKK_JISYO_S	DATADIR "/skk/SKK-JISYO.S"
 
+/*
+ * Line index of a dictionary file. Offsets of the entry lines are
+ * cached in ~/.uim.d/skk/<basename>-<hash of the path>.idx as follows.
+ *
+ *   struct skk_idx_header
+ *   path of the dictionary file, NUL terminated and padded to 4 bytes
+ *   uint32_t offsets[nr_lines]
+ */
+#define SKK_IDX_MAGIC	"SKKIDX\0\0"
+#define SKK_IDX_VERSION	2
+#define SKK_IDX_BYTE_ORDER	0x01020304
+
+struct skk_idx_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  uint64_t dic_mtime;
+  uint64_t dic_size;
+  uint64_t dic_dev;
+  uint64_t dic_ino;
+  uint32_t nr_lines;
+  uint32_t nr_okuri_ari;  /* okuri-ari lines come first */
+  uint32_t offsets_offset;
+  uint32_t reserved;
+};
+
 /*
  * cand : candidate
  */
@@ -110,6 +148,7 @@ struct skk_cand_array {
 /* skk_line state */
 #define SKK_LINE_NEED_SAVE	(1<<0)
 #define SKK_LINE_USE_FOR_COMPLETION	(1<<1)
+#define SKK_LINE_NEED_JOURNAL	(1<<2)
 
 /* skk dictionary line */
 struct skk_line {
@@ -125,22 +164,72 @@ struct skk_line {
   int state;
   /* link to next entry in the list */
   struct skk_line *next;
+  /* link to previous entry in the list, or the list head */
+  struct skk_line *prev;
+  /* link to next entry in the same bucket of the hash index */
+  struct skk_line *hash_next;
+  /* links in the LRU list of evictable lines */
+  struct skk_line *lru_next, *lru_prev;
+  /* larger for lines nearer to the list head */
+  unsigned int stamp;
 };
 
-/* skk dictionary file */
-typedef struct dic_info_ {
+/* mmap'ed dictionary file */
+struct dic_source {
+  /* path of dictionary file */
+  char *fn;
   /* address of mmap'ed dictionary file */
   void *addr;
-  /* byte offset of first valid entry in mmap'ed region */
-  int first;
-  /* byte offset of first okuri-nasi entry */
-  int border;
   /* size of dictionary file */
   int size;
+  /* byte offsets of entry lines. okuri-ari entries sorted in descending
+     order come first, and okuri-nasi entries in ascending order follow */
+  const uint32_t *line_offsets;
+  int nr_lines;
+  int nr_okuri_ari;
+  /* mmap'ed index file, or NULL if line_offsets is built in memory */
+  void *idx_addr;
+  size_t idx_len;
+};
+
+/* skk dictionary */
+typedef struct dic_info_ {
+  /* dictionary files in order of priority */
+  struct dic_source *sources;
+  int nr_sources;
   /* head of cached skk dictionary line list. LRU ordered */
   struct skk_line head;
+  /* hash index of cached lines keyed on (head, okuri_head) */
+  struct skk_line **hash;
+  int hash_size;
+  /* circular LRU list of clean lines read from the system dictionary.
+     lines stay in the list after they are modified, and such lines are
+     dropped from the list instead of being evicted */
+  struct skk_line lru;
+  int nr_lru_lines;
+  /* max number of lines in the LRU list. 0 for unlimited */
+  int cache_capacity;
+  /* stamp of the list head */
+  unsigned int stamp;
+  /* okuri-nasi lines used for completion, sorted by head */
+  struct skk_line **comp_index;
+  int nr_comp_index;
+  int comp_index_size;
+  /* last prefix searched in comp_index and its range */
+  char *comp_prefix;
+  int comp_lo, comp_hi;
   /* timestamp of personal dictionary */
   time_t personal_dic_timestamp;
+  /* whether modified lines are appended to the journal of personal
+     dictionary instead of rewriting the whole dictionary */
+  int use_journal;
+  /* path of the journal, its generation and the offset replayed to */
+  char *journal_fn;
+  unsigned long journal_generation;
+  long journal_offset;
+  /* number of records appended after the last fsync, and its time */
+  int journal_unsynced;
+  time_t journal_synced_at;
   /* whether cached lines are modified or not */
   int cache_modified;
   /* length of cached lines */
@@ -184,8 +273,14 @@ static void merge_purged_cand_to_dst_array(dic_info *skk_dic,
 		struct skk_cand_array *src_ca,
 		struct skk_cand_array *dst_ca, char *purged_cand);
 static void update_personal_dictionary_cache_with_file(dic_info *skk_dic,
-		const char *fn, int is_personal);
+		const char *fn, int is_personal, int need_lock);
+static void replay_journal(dic_info *di, const char *fn);
 static void look_get_comp(struct skk_comp_array *ca, const char *str);
+static void init_cache(dic_info *di);
+static void free_cache_index(dic_info *di);
+static void rebuild_cache_index(dic_info *di);
+static void evict_lines(dic_info *di);
+static void remove_line_from_lru(dic_info *di, struct skk_line *sl);
 static uim_lisp look_get_top_word(const char *str);
 static char *quote_word(const char *word, const char *prefix);
 
@@ -230,36 +325,293 @@ is_okuri(const char *line_str)
   return 0;
 }
 
+/*
+ * Collect the offsets of entry lines. Comment lines and a last line
+ * without newline are skipped. The border is the first okuri-nasi
+ * line as every entry is okuri-ari before it.
+ */
+static void
+build_line_index(struct dic_source *src)
+{
+  const char *s = src->addr;
+  const char *nl;
+  uint32_t *offsets = NULL;
+  int off, nr = 0, size = 0;
+
+  src->nr_okuri_ari = -1;
+  for (off = 0; off < src->size; off = nl - s + 1) {
+    nl = memchr(&s[off], '\n', src->size - off);
+    if (!nl)
+      break;
+    if (s[off] == ';' || s[off] == '\n')
+      continue;
+
+    if (src->nr_okuri_ari < 0 && !is_okuri(&s[off]))
+      src->nr_okuri_ari = nr;
+    if (nr == size) {
+      size = size ? size * 2 : 1024;
+      offsets = uim_realloc(offsets, sizeof(uint32_t) * size);
+    }
+    offsets[nr++] = off;
+  }
+
+  /* every entry is okuri-ari, it may not happen. */
+  if (src->nr_okuri_ari < 0)
+    src->nr_okuri_ari = nr;
+  src->line_offsets = offsets;
+  src->nr_lines = nr;
+}
+
+/* FNV-1a */
+static uint32_t
+hash_path(const char *fn)
+{
+  const unsigned char *p;
+  uint32_t h = 2166136261U;
+
+  for (p = (const unsigned char *)fn; *p; p++) {
+    h ^= *p;
+    h *= 16777619U;
+  }
+
+  return h;
+}
+
+/* dictionaries of the same name in different directories get their own
+ * index files */
 static int
-find_first_line(dic_info *di)
+get_line_index_path(const char *fn, char *path, int len)
 {
-  char *s = di->addr;
-  int off = 0;
+  const char *base;
+  char suffix[sizeof("-12345678.idx")];
+
+  if (is_setugid || !uim_get_config_path(path, len, UIM_TRUE))
+    return 0;
+  if (strlcat(path, "/skk", len) >= (size_t)len || !uim_check_dir(path))
+    return 0;
 
-  while (off < di->size && s[off] == ';') {
-    int l = calc_line_len(&s[off]);
-    off += l + 1;
+  base = strrchr(fn, '/');
+  base = (base) ? base + 1 : fn;
+  snprintf(suffix, sizeof(suffix), "-%08x.idx", (unsigned int)hash_path(fn));
+  return (strlcat(path, "/", len) < (size_t)len
+	  && strlcat(path, base, len) < (size_t)len
+	  && strlcat(path, suffix, len) < (size_t)len);
+}
+
+/*
+ * A corrupt or stale index must not make the search read outside of
+ * the dictionary. Each offset has to point to the head of an entry
+ * line within the file, in ascending order, and the last line has to
+ * be terminated by a newline.
+ */
+static int
+check_line_index(const struct dic_source *src, const uint32_t *offsets,
+		 uint32_t nr_lines)
+{
+  const char *s = src->addr;
+  uint32_t i, off, last = 0;
+
+  for (i = 0; i < nr_lines; i++) {
+    off = offsets[i];
+    if (off >= (uint32_t)src->size
+	|| (i > 0 && off <= last)
+	|| (off > 0 && s[off - 1] != '\n')
+	|| s[off] == ';' || s[off] == '\n')
+      return 0;
+    last = off;
   }
-  return off;
+
+  return (nr_lines == 0 || memchr(&s[last], '\n', src->size - last));
 }
 
 static int
-find_border(dic_info *di)
-{
-  char *s = di->addr;
-  int off = 0;
-  while (off < di->size) {
-    int l = calc_line_len(&s[off]);
-    if (s[off] == ';') {
-      off += l + 1;
-      continue;
-    }
-    if (!is_okuri(&s[off]))
-      return off;
-    off += l + 1;
+load_line_index(struct dic_source *src, const char *fn, const struct stat *dic_st,
+		const char *path)
+{
+  const struct skk_idx_header *hdr;
+  struct stat st;
+  void *addr;
+  size_t path_len;
+  int fd;
+
+  fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)
+      || (size_t)st.st_size < sizeof(*hdr)) {
+    close(fd);
+    return 0;
   }
-  /* every entry is okuri-ari, it may not happen. */
-  return di->size - 1;
+  addr = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return 0;
+
+  hdr = addr;
+  path_len = strlen(fn) + 1;
+  if (memcmp(hdr->magic, SKK_IDX_MAGIC, sizeof(hdr->magic)) != 0
+      || hdr->version != SKK_IDX_VERSION
+      || hdr->byte_order != SKK_IDX_BYTE_ORDER
+      /* modified dictionary invalidates the index */
+      || hdr->dic_mtime != (uint64_t)dic_st->st_mtime
+      || hdr->dic_size != (uint64_t)dic_st->st_size
+      || hdr->dic_dev != (uint64_t)dic_st->st_dev
+      || hdr->dic_ino != (uint64_t)dic_st->st_ino
+      || hdr->offsets_offset < sizeof(*hdr) + path_len
+      || hdr->offsets_offset % sizeof(uint32_t)
+      || hdr->offsets_offset > (size_t)st.st_size
+      || hdr->nr_lines > (st.st_size - hdr->offsets_offset) / sizeof(uint32_t)
+      || hdr->nr_okuri_ari > hdr->nr_lines
+      || memcmp((const char *)addr + sizeof(*hdr), fn, path_len) != 0
+      || !check_line_index(src, (const uint32_t *)((const char *)addr
+						   + hdr->offsets_offset),
+			   hdr->nr_lines)) {
+    munmap(addr, st.st_size);
+    return 0;
+  }
+
+  src->idx_addr = addr;
+  src->idx_len = st.st_size;
+  src->line_offsets = (const uint32_t *)((const char *)addr
+					+ hdr->offsets_offset);
+  src->nr_lines = hdr->nr_lines;
+  src->nr_okuri_ari = hdr->nr_okuri_ari;
+
+  return 1;
+}
+
+static void
+save_line_index(struct dic_source *src, const char *fn, const struct stat *dic_st,
+		const char *path)
+{
+  struct skk_idx_header hdr;
+  char tmp_path[MAXPATHLEN];
+  static const char pad[sizeof(uint32_t)];
+  size_t path_len, pad_len;
+  mode_t umask_val;
+  FILE *fp;
+  int ok;
+
+  if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path)
+      >= (int)sizeof(tmp_path))
+    return;
+
+  path_len = strlen(fn) + 1;
+  pad_len = (sizeof(uint32_t) - (sizeof(hdr) + path_len) % sizeof(uint32_t))
+	    % sizeof(uint32_t);
+
+  memset(&hdr, 0, sizeof(hdr));
+  memcpy(hdr.magic, SKK_IDX_MAGIC, sizeof(hdr.magic));
+  hdr.version = SKK_IDX_VERSION;
+  hdr.byte_order = SKK_IDX_BYTE_ORDER;
+  hdr.dic_mtime = dic_st->st_mtime;
+  hdr.dic_size = dic_st->st_size;
+  hdr.dic_dev = dic_st->st_dev;
+  hdr.dic_ino = dic_st->st_ino;
+  hdr.nr_lines = src->nr_lines;
+  hdr.nr_okuri_ari = src->nr_okuri_ari;
+  hdr.offsets_offset = sizeof(hdr) + path_len + pad_len;
+
+  umask_val = umask(S_IRGRP | S_IROTH | S_IWGRP | S_IWOTH);
+  fp = fopen(tmp_path, "wb");
+  umask(umask_val);
+  if (!fp)
+    return;
+  ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+	&& fwrite(fn, 1, path_len, fp) == path_len
+	&& fwrite(pad, 1, pad_len, fp) == pad_len
+	&& fwrite(src->line_offsets, sizeof(uint32_t), src->nr_lines, fp)
+	   == (size_t)src->nr_lines);
+  ok = (fclose(fp) == 0) && ok;
+  /* replaced atomically since other processes may map the index */
+  ok = ok && (rename(tmp_path, path) == 0);
+  if (!ok)
+    unlink(tmp_path);
+}
+
+static void
+open_line_index(struct dic_source *src, const char *fn, const struct stat *dic_st)
+{
+  char path[MAXPATHLEN];
+  int has_path;
+
+  has_path = get_line_index_path(fn, path, sizeof(path));
+  if (has_path && load_line_index(src, fn, dic_st, path))
+    return;
+
+  build_line_index(src);
+  if (has_path)
+    save_line_index(src, fn, dic_st, path);
+}
+
+static void
+free_line_index(struct dic_source *src)
+{
+  if (src->idx_addr)
+    munmap(src->idx_addr, src->idx_len);
+  else
+    free((void *)src->line_offsets);
+  src->idx_addr = NULL;
+  src->line_offsets = NULL;
+  src->nr_lines = src->nr_okuri_ari = 0;
+}
+
+/* mmap the dictionary file and append it as the lowest priority source */
+static int
+add_dic_source(dic_info *di, const char *fn)
+{
+  struct dic_source *src;
+  struct stat st;
+  void *addr;
+  int i, fd;
+
+  for (i = 0; i < di->nr_sources; i++) {
+    if (!strcmp(di->sources[i].fn, fn))
+      return 0;
+  }
+
+  fd = open(fn, O_RDONLY);
+  if (fd == -1)
+    return 0;
+  if (fstat(fd, &st) == -1) {
+    close(fd);
+    return 0;
+  }
+  addr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    return 0;
+
+  di->sources = uim_realloc(di->sources,
+			    sizeof(struct dic_source) * (di->nr_sources + 1));
+  src = &di->sources[di->nr_sources++];
+  src->fn = uim_strdup(fn);
+  src->addr = addr;
+  src->size = st.st_size;
+  src->line_offsets = NULL;
+  src->nr_lines = src->nr_okuri_ari = 0;
+  src->idx_addr = NULL;
+  src->idx_len = 0;
+  open_line_index(src, fn, &st);
+
+  return 1;
+}
+
+static void
+free_dic_sources(dic_info *di)
+{
+  int i;
+
+  for (i = 0; i < di->nr_sources; i++) {
+    struct dic_source *src = &di->sources[i];
+
+    munmap(src->addr, src->size);
+    free_line_index(src);
+    free(src->fn);
+  }
+  free(di->sources);
+  di->sources = NULL;
+  di->nr_sources = 0;
 }
 
 static dic_info *
@@ -267,12 +619,10 @@ open_dic(const char *fn, uim_bool use_skkserv, const char *skkserv_hostname,
 	 int skkserv_portnum, int skkserv_family)
 {
   dic_info *di;
-  struct stat st;
-  int fd;
-  void *addr = NULL;
-  int mmap_done = 0;
 
   di = (dic_info *)uim_malloc(sizeof(dic_info));
+  di->sources = NULL;
+  di->nr_sources = 0;
 
   di->skkserv_hostname = NULL;
   if (use_skkserv) {
@@ -285,84 +635,57 @@ open_dic(const char *fn, uim_bool use_skkserv, const char *skkserv_hostname,
     di->skkserv_completion_timeout = uim_scm_symbol_value_int("skk-skkserv-completion-timeout");
   } else {
     di->skkserv_state = 0;
-    fd = open(fn, O_RDONLY);
-    if (fd != -1) {
-      if (fstat(fd, &st) != -1) {
-	addr = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
-	if (addr != MAP_FAILED) {
-	  mmap_done = 1;
-	}
-      }
-      close(fd);
-    }
+    add_dic_source(di, fn);
   }
 
-  di->addr = mmap_done ? addr : NULL;
-  di->size = mmap_done ? st.st_size : 0;
-  di->first = mmap_done ? find_first_line(di) : 0;
-  di->border = mmap_done ? find_border(di) : 0;
-
-  di->head.next = NULL;
+  init_cache(di);
   di->personal_dic_timestamp = 0;
-  di->cache_modified = 0;
-  di->cache_len = 0;
+  di->use_journal = 0;
+  di->journal_fn = NULL;
+  di->journal_generation = 0;
+  di->journal_offset = 0;
+  di->journal_unsynced = 0;
+  di->journal_synced_at = 0;
 
   return di;
 }
 
-static const char *
-find_line(dic_info *di, int off)
-{
-  char *ptr = di->addr;
-  while (off > 0 && (ptr[off] != '\n' || ptr[off + 1] == ';'))
-    off--;
-
-  if (off)
-    off++;
-
-  return &ptr[off];
-}
-
-static char *
-extract_line_index(dic_info *di, int off, char *buf, int len)
+/* compare s with the head of the line like strcmp() */
+static int
+compare_line_head(const char *s, const char *line)
 {
-  const char *p = find_line(di, off);
-  int i;
-  if (p[0] == ';')
-    return NULL;
-
-  for (i = 0; i < len && p[i] != ' '; i++)
-    buf[i] = p[i];
-  buf[i] = '\0';
+  const unsigned char *p = (const unsigned char *)s;
+  const unsigned char *q = (const unsigned char *)line;
 
-  return buf;
+  for (; *p && *q != ' ' && *q != '\n'; p++, q++) {
+    if (*p != *q)
+      return *p - *q;
+  }
+  if (*p)
+    return 1;
+  return (*q == ' ' || *q == '\n') ? 0 : -1;
 }
 
+/*
+ * Binary search over the line index within [min, max). d is 1 for
+ * lines sorted in ascending order and -1 for descending.
+ */
 static int
-do_search_line(dic_info *di, const char *s, int min,
-	       int max, int d)
+do_search_line(struct dic_source *src, const char *s, int min, int max, int d)
 {
-  char buf[256];
-  char *r;
-  int idx = ((unsigned int)min + (unsigned int)max) >> 1;
-  int c = 0;
-
-  if (abs(max - min) < 4)
-    return -1;
-
-  r = extract_line_index(di, idx, buf, 256);
-  if (r)
-    c = strcmp(s, r);
-  else
-    return -1;
-
-  if (!c)
-    return idx;
-
-  if (c * d > 0)
-    return do_search_line(di, s, idx, max, d);
-  else
-    return do_search_line(di, s, min, idx, d);
+  const char *addr = src->addr;
+  int mid, c;
+
+  while (min < max) {
+    mid = (unsigned int)(min + max) >> 1;
+    c = compare_line_head(s, &addr[src->line_offsets[mid]]) * d;
+    if (!c)
+      return src->line_offsets[mid];
+    if (c > 0)
+      min = mid + 1;
+    else
+      max = mid;
+  }
 
   return -1;
 }
@@ -474,8 +797,7 @@ free_skk_dic(dic_info *skk_dic)
   if (skk_dic) {
     struct skk_line *sl, *tmp;
 
-    if (skk_dic->addr)
-      munmap(skk_dic->addr, skk_dic->size);
+    free_dic_sources(skk_dic);
 
     sl = skk_dic->head.next;
     while (sl) {
@@ -483,11 +805,21 @@ free_skk_dic(dic_info *skk_dic)
       sl = sl->next;
       free_skk_line(tmp);
     }
+    free_cache_index(skk_dic);
 
     if (skk_dic->skkserv_state & SKK_SERV_CONNECTED)
       close_skkserv();
     free(skk_dic->skkserv_hostname);
 
+    if (skk_dic->journal_unsynced) {
+      int fd = open(skk_dic->journal_fn, O_WRONLY);
+      if (fd != -1) {
+	fsync(fd);
+	close(fd);
+      }
+    }
+    free(skk_dic->journal_fn);
+
     free(skk_dic);
   }
 }
@@ -538,6 +870,39 @@ skk_free_dic(uim_lisp skk_dic_)
   return uim_scm_f();
 }
 
+static uim_lisp
+skk_dic_add_source(uim_lisp skk_dic_, uim_lisp fn_)
+{
+  dic_info *skk_dic = NULL;
+
+  if (PTRP(skk_dic_))
+    skk_dic = C_PTR(skk_dic_);
+  if (!skk_dic)
+    return uim_scm_f();
+
+  return MAKE_BOOL(add_dic_source(skk_dic, REFER_C_STR(fn_)));
+}
+
+static uim_lisp
+skk_set_cache_capacity(uim_lisp skk_dic_, uim_lisp capacity_)
+{
+  dic_info *skk_dic = NULL;
+  int capacity;
+
+  if (PTRP(skk_dic_))
+    skk_dic = C_PTR(skk_dic_);
+  if (!skk_dic)
+    return uim_scm_f();
+
+  capacity = C_INT(capacity_);
+  if (capacity > 0 && capacity < SKK_CACHE_CAPACITY_MIN)
+    capacity = SKK_CACHE_CAPACITY_MIN;
+  skk_dic->cache_capacity = capacity;
+  evict_lines(skk_dic);
+
+  return uim_scm_t();
+}
+
 static struct skk_cand_array *
 find_candidate_array_from_line(struct skk_line *sl, const char *okuri,
 			       int create_if_notfound)
@@ -687,6 +1052,8 @@ alloc_skk_line(const char *word, char okuri_head)
   sl->cands[0].nr_real_cands = 0;
   sl->cands[0].is_used = 0;
   sl->cands[0].line = sl;
+  sl->next = sl->prev = sl->hash_next = NULL;
+  sl->lru_next = sl->lru_prev = NULL;
   return sl;
 }
 
@@ -718,7 +1085,8 @@ copy_skk_line(struct skk_line *p)
     ca->is_used = q->is_used;
     ca->line = sl;
   }
-  sl->next = NULL;
+  sl->next = sl->prev = sl->hash_next = NULL;
+  sl->lru_next = sl->lru_prev = NULL;
   return sl;
 }
 
@@ -737,32 +1105,367 @@ compose_line(dic_info *di, const char *word, char okuri_head, char *entry)
   return sl;
 }
 
+static void
+init_cache(dic_info *di)
+{
+  di->head.next = NULL;
+  di->cache_len = 0;
+  di->cache_modified = 0;
+  di->hash = NULL;
+  di->hash_size = 0;
+  di->lru.lru_next = di->lru.lru_prev = &di->lru;
+  di->nr_lru_lines = 0;
+  di->cache_capacity = 0;
+  di->stamp = 0;
+  di->comp_index = NULL;
+  di->nr_comp_index = 0;
+  di->comp_index_size = 0;
+  di->comp_prefix = NULL;
+}
+
+static unsigned int
+hash_line_index(const char *s, char okuri_head)
+{
+  unsigned int h = 2166136261U;  /* FNV-1a */
+
+  for (; *s; s++)
+    h = (h ^ (unsigned char)*s) * 16777619U;
+  h = (h ^ (unsigned char)okuri_head) * 16777619U;
+
+  return h;
+}
+
+static void
+insert_line_to_index(dic_info *di, struct skk_line *sl)
+{
+  unsigned int h;
+
+  h = hash_line_index(sl->head, sl->okuri_head) & (di->hash_size - 1);
+  sl->hash_next = di->hash[h];
+  di->hash[h] = sl;
+}
+
+static void
+remove_line_from_index(dic_info *di, struct skk_line *sl)
+{
+  struct skk_line **p;
+  unsigned int h;
+
+  h = hash_line_index(sl->head, sl->okuri_head) & (di->hash_size - 1);
+  for (p = &di->hash[h]; *p; p = &(*p)->hash_next) {
+    if (*p == sl) {
+      *p = sl->hash_next;
+      break;
+    }
+  }
+  sl->hash_next = NULL;
+}
+
+static void
+free_cache_index(dic_info *di)
+{
+  free(di->hash);
+  di->hash = NULL;
+  di->hash_size = 0;
+  free(di->comp_index);
+  di->comp_index = NULL;
+  di->nr_comp_index = di->comp_index_size = 0;
+  free(di->comp_prefix);
+  di->comp_prefix = NULL;
+}
+
+/*
+ * Lines are indexed from the last one so that the first line in the
+ * list is found first when the same index appears twice.
+ */
+static void
+rebuild_hash_index(dic_info *di)
+{
+  struct skk_line *sl, *last;
+  int size;
+
+  for (last = &di->head; last->next; last = last->next)
+    ;
+
+  for (size = SKK_CACHE_HASH_MIN; size < di->cache_len; size *= 2)
+    ;
+  free(di->hash);
+  di->hash = uim_malloc(sizeof(struct skk_line *) * size);
+  memset(di->hash, 0, sizeof(struct skk_line *) * size);
+  di->hash_size = size;
+
+  for (sl = last; sl != &di->head; sl = sl->prev)
+    insert_line_to_index(di, sl);
+}
+
+static int
+is_comp_line(struct skk_line *sl)
+{
+  return sl->okuri_head == '\0' && (sl->state & SKK_LINE_USE_FOR_COMPLETION);
+}
+
+static int
+compare_comp_line(const void *a, const void *b)
+{
+  return strcmp((*(struct skk_line * const *)a)->head,
+		(*(struct skk_line * const *)b)->head);
+}
+
+static void
+rebuild_comp_index(dic_info *di)
+{
+  struct skk_line *sl;
+
+  di->nr_comp_index = 0;
+  for (sl = di->head.next; sl; sl = sl->next) {
+    if (!is_comp_line(sl))
+      continue;
+    if (di->nr_comp_index == di->comp_index_size) {
+      di->comp_index_size = di->comp_index_size ? di->comp_index_size * 2
+						: SKK_CACHE_HASH_MIN;
+      di->comp_index = uim_realloc(di->comp_index, sizeof(struct skk_line *)
+				   * di->comp_index_size);
+    }
+    di->comp_index[di->nr_comp_index++] = sl;
+  }
+  qsort(di->comp_index, di->nr_comp_index, sizeof(struct skk_line *),
+	compare_comp_line);
+
+  free(di->comp_prefix);
+  di->comp_prefix = NULL;
+}
+
+static void
+insert_line_to_comp_index(dic_info *di, struct skk_line *sl)
+{
+  int lo, hi, mid;
+
+  lo = 0;
+  hi = di->nr_comp_index;
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (strcmp(di->comp_index[mid]->head, sl->head) < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  if (di->nr_comp_index == di->comp_index_size) {
+    di->comp_index_size = di->comp_index_size ? di->comp_index_size * 2
+					      : SKK_CACHE_HASH_MIN;
+    di->comp_index = uim_realloc(di->comp_index, sizeof(struct skk_line *)
+				 * di->comp_index_size);
+  }
+  memmove(&di->comp_index[lo + 1], &di->comp_index[lo],
+	  sizeof(struct skk_line *) * (di->nr_comp_index - lo));
+  di->comp_index[lo] = sl;
+  di->nr_comp_index++;
+
+  free(di->comp_prefix);
+  di->comp_prefix = NULL;
+}
+
+/*
+ * Find the range [*lo, *hi) of comp_index whose heads start with s.
+ * When s extends the last searched prefix, only the last range is
+ * searched.
+ */
+static void
+find_comp_range(dic_info *di, const char *s, int *lo, int *hi)
+{
+  int len, l, h, mid;
+
+  len = strlen(s);
+  if (di->comp_prefix
+      && !strncmp(s, di->comp_prefix, strlen(di->comp_prefix))) {
+    l = di->comp_lo;
+    h = di->comp_hi;
+  } else {
+    l = 0;
+    h = di->nr_comp_index;
+  }
+
+  /* first head not less than s */
+  *lo = l;
+  *hi = h;
+  while (*lo < *hi) {
+    mid = (*lo + *hi) / 2;
+    if (strcmp(di->comp_index[mid]->head, s) < 0)
+      *lo = mid + 1;
+    else
+      *hi = mid;
+  }
+  /* first head greater than s and not starting with s */
+  *hi = h;
+  l = *lo;
+  while (l < *hi) {
+    mid = (l + *hi) / 2;
+    if (strncmp(di->comp_index[mid]->head, s, len) <= 0)
+      l = mid + 1;
+    else
+      *hi = mid;
+  }
+
+  free(di->comp_prefix);
+  di->comp_prefix = uim_strdup(s);
+  di->comp_lo = *lo;
+  di->comp_hi = *hi;
+}
+
+/* set the state of a learned line */
+static void
+mark_line_learned(dic_info *di, struct skk_line *sl)
+{
+  int was_comp_line = is_comp_line(sl);
+
+  sl->state |= SKK_LINE_NEED_SAVE | SKK_LINE_USE_FOR_COMPLETION;
+  if (!was_comp_line && is_comp_line(sl))
+    insert_line_to_comp_index(di, sl);
+}
+
+/*
+ * The line is to be appended to the journal on the next save. It is
+ * also dropped from the LRU for good since NEED_JOURNAL is cleared by
+ * the save, and a purged line, which is not NEED_SAVE, would then be
+ * evicted and read again from the dictionary file without the purge.
+ */
+static void
+mark_line_modified(dic_info *di, struct skk_line *sl)
+{
+  sl->state |= SKK_LINE_NEED_JOURNAL;
+  di->cache_modified = 1;
+  if (sl->lru_next)
+    remove_line_from_lru(di, sl);
+}
+
+/*
+ * Recompute prev links, stamps and the indexes from the line list.
+ * This is needed after the list is relinked as a whole.
+ */
+static void
+rebuild_cache_index(dic_info *di)
+{
+  struct skk_line *sl, *last;
+
+  di->cache_len = 0;
+  last = &di->head;
+  for (sl = di->head.next; sl; sl = sl->next) {
+    sl->prev = last;
+    last = sl;
+    di->cache_len++;
+  }
+
+  di->stamp = 0;
+  for (sl = last; sl != &di->head; sl = sl->prev)
+    sl->stamp = ++di->stamp;
+
+  rebuild_hash_index(di);
+  rebuild_comp_index(di);
+}
+
+static void
+remove_line_from_lru(dic_info *di, struct skk_line *sl)
+{
+  sl->lru_prev->lru_next = sl->lru_next;
+  sl->lru_next->lru_prev = sl->lru_prev;
+  sl->lru_next = sl->lru_prev = NULL;
+  di->nr_lru_lines--;
+}
+
+static void
+add_line_to_lru(dic_info *di, struct skk_line *sl)
+{
+  sl->lru_next = di->lru.lru_next;
+  sl->lru_prev = &di->lru;
+  di->lru.lru_next->lru_prev = sl;
+  di->lru.lru_next = sl;
+  di->nr_lru_lines++;
+}
+
+/* mark the line as most recently used if it is evictable */
+static void
+touch_line(dic_info *di, struct skk_line *sl)
+{
+  if (!sl->lru_next)
+    return;
+
+  remove_line_from_lru(di, sl);
+  if (sl->state == 0)
+    add_line_to_lru(di, sl);
+}
+
+/* evict least recently used lines exceeding the capacity */
+static void
+evict_lines(dic_info *di)
+{
+  struct skk_line *sl;
+
+  if (di->cache_capacity <= 0)
+    return;
+
+  while (di->nr_lru_lines > di->cache_capacity) {
+    sl = di->lru.lru_prev;
+    remove_line_from_lru(di, sl);
+    if (sl->state != 0)
+      continue;  /* learned or purged after read */
+
+    sl->prev->next = sl->next;
+    if (sl->next)
+      sl->next->prev = sl->prev;
+    remove_line_from_index(di, sl);
+    free_skk_line(sl);
+    di->cache_len--;
+  }
+}
+
 static void
 add_line_to_cache_head(dic_info *di, struct skk_line *sl)
 {
   sl->next = di->head.next;
+  sl->prev = &di->head;
+  if (sl->next)
+    sl->next->prev = sl;
   di->head.next = sl;
 
+  sl->stamp = ++di->stamp;
+
   di->cache_len++;
   di->cache_modified = 1;
+
+  if (di->cache_len > di->hash_size)
+    rebuild_hash_index(di);
+  else
+    insert_line_to_index(di, sl);
+  if (is_comp_line(sl))
+    insert_line_to_comp_index(di, sl);
+}
+
+static void
+move_line_to_cache_head(dic_info *di, struct skk_line *sl)
+{
+  if (di->head.next == sl)
+    return;
+
+  sl->prev->next = sl->next;
+  if (sl->next)
+    sl->next->prev = sl->prev;
+  sl->next = di->head.next;
+  sl->prev = &di->head;
+  sl->next->prev = sl;
+  di->head.next = sl;
+  sl->stamp = ++di->stamp;
+
+  di->cache_modified = 1;
 }
 
+/* link a line read from a dictionary file without indexing */
 static void
-move_line_to_cache_head(dic_info *di, struct skk_line *sl)
+push_line_to_cache(dic_info *di, struct skk_line *sl)
 {
-  struct skk_line *prev;
-
-  if (di->head.next == sl)
-    return;
-
-  prev = di->head.next;
-  while (prev->next != sl) {
-    prev = prev->next;
-  }
-  prev->next = sl->next;
   sl->next = di->head.next;
   di->head.next = sl;
 
+  di->cache_len++;
   di->cache_modified = 1;
 }
 
@@ -863,7 +1566,8 @@ search_line_from_server(dic_info *di, const char *s, char okuri_head)
 }
 
 static struct skk_line *
-search_line_from_file(dic_info *di, const char *s, char okuri_head)
+search_line_from_file(dic_info *di, struct dic_source *src,
+		      const char *s, char okuri_head)
 {
   int n;
   const char *p;
@@ -871,22 +1575,19 @@ search_line_from_file(dic_info *di, const char *s, char okuri_head)
   char *line, *idx;
   struct skk_line *sl;
 
-  if (!di->addr)
-    return NULL;
-
   uim_asprintf(&idx, "%s%c", s, okuri_head);
 
   if (okuri_head)
-    n = do_search_line(di, idx, di->first, di->border - 1, -1);
+    n = do_search_line(src, idx, 0, src->nr_okuri_ari, -1);
   else
-    n = do_search_line(di, idx, di->border, di->size - 1, 1);
+    n = do_search_line(src, idx, src->nr_okuri_ari, src->nr_lines, 1);
 
   free(idx);
 
   if (n == -1)
     return NULL;
 
-  p = find_line(di, n);
+  p = (const char *)src->addr + n;
   len = calc_line_len(p);
   line = uim_malloc(len + 1);
   /* strncat is used intentionally because *p is too long string */
@@ -897,6 +1598,57 @@ search_line_from_file(dic_info *di, const char *s, char okuri_head)
   return sl;
 }
 
+/* append candidates of src missing in dst, keeping the order */
+static void
+merge_line_to_line(struct skk_line *dst, struct skk_line *src)
+{
+  int i, j, k;
+
+  for (i = 0; i < src->nr_cand_array; i++) {
+    struct skk_cand_array *src_ca = &src->cands[i];
+    struct skk_cand_array *dst_ca;
+    int nr_cands;
+
+    dst_ca = find_candidate_array_from_line(dst, src_ca->okuri, 1);
+    nr_cands = dst_ca->nr_cands;
+    for (j = 0; j < src_ca->nr_cands; j++) {
+      for (k = 0; k < nr_cands; k++) {
+	if (!strcmp(src_ca->cands[j], dst_ca->cands[k]))
+	  break;
+      }
+      if (k == nr_cands)
+	push_back_candidate_to_array(dst_ca, src_ca->cands[j]);
+    }
+  }
+}
+
+/*
+ * Look up skkserv and every dictionary file, and merge the lines
+ * found into one. Candidates from a source of higher priority come
+ * first, and duplicated ones are dropped.
+ */
+static struct skk_line *
+search_line_from_dic(dic_info *di, const char *s, char okuri_head)
+{
+  struct skk_line *sl = NULL, *sl_src;
+  int i;
+
+  if (di->skkserv_state & SKK_SERV_USE)
+    sl = search_line_from_server(di, s, okuri_head);
+
+  for (i = 0; i < di->nr_sources; i++) {
+    sl_src = search_line_from_file(di, &di->sources[i], s, okuri_head);
+    if (!sl) {
+      sl = sl_src;
+    } else if (sl_src) {
+      merge_line_to_line(sl, sl_src);
+      free_skk_line(sl_src);
+    }
+  }
+
+  return sl;
+}
+
 static struct skk_line *
 search_line_from_cache(dic_info *di, const char *s, char okuri_head)
 {
@@ -905,9 +1657,13 @@ search_line_from_cache(dic_info *di, const char *s, char okuri_head)
   if (!di)
     return NULL;
 
+  if (!di->hash)
+    return NULL;
+
   /* search from cache */
-  for (sl = di->head.next; sl; sl = sl->next) {
-    if (!strcmp(sl->head, s) && sl->okuri_head == okuri_head)
+  sl = di->hash[hash_line_index(s, okuri_head) & (di->hash_size - 1)];
+  for (; sl; sl = sl->hash_next) {
+    if (sl->okuri_head == okuri_head && !strcmp(sl->head, s))
       return sl;
   }
   return NULL;
@@ -928,10 +1684,7 @@ find_cand_array(dic_info *di, const char *s,
 
   sl = search_line_from_cache(di, s, okuri_head);
   if (!sl) {
-    if (di->skkserv_state & SKK_SERV_USE)
-      sl = search_line_from_server(di, s, okuri_head);
-    else
-      sl = search_line_from_file(di, s, okuri_head);
+    sl = search_line_from_dic(di, s, okuri_head);
     if (!sl) {
       if (!create_if_not_found)
 	return NULL;
@@ -939,6 +1692,10 @@ find_cand_array(dic_info *di, const char *s,
     }
     from_file = 1;
     add_line_to_cache_head(di, sl);
+    add_line_to_lru(di, sl);
+    evict_lines(di);
+  } else {
+    touch_line(di, sl);
   }
 
   ca = find_candidate_array_from_line(sl, okuri, create_if_not_found);
@@ -947,12 +1704,10 @@ find_cand_array(dic_info *di, const char *s,
     merge_base_candidates_to_array(di, sl, ca);
     ca->is_used = 1;
     if (!from_file) {
-      if (di->skkserv_state & SKK_SERV_USE) {
-	sl_file = search_line_from_server(di, s, okuri_head);
-	if (!(di->skkserv_state & SKK_SERV_CONNECTED))
-	  ca->is_used = 0;
-      } else
-	sl_file = search_line_from_file(di, s, okuri_head);
+      sl_file = search_line_from_dic(di, s, okuri_head);
+      if ((di->skkserv_state & SKK_SERV_USE)
+	  && !(di->skkserv_state & SKK_SERV_CONNECTED))
+	ca->is_used = 0;
       merge_base_candidates_to_array(di, sl_file, ca);
       free_skk_line(sl_file);
     }
@@ -971,6 +1726,7 @@ find_cand_array_lisp(dic_info *skk_dic, uim_lisp head_, uim_lisp okuri_head_,
   const char *okuri = NULL;
   struct skk_cand_array *ca;
   char *rs = NULL;
+  long trace_start;
 
   hs = REFER_C_STR(head_);
 
@@ -987,12 +1743,14 @@ find_cand_array_lisp(dic_info *skk_dic, uim_lisp head_, uim_lisp okuri_head_,
     o = os[0];
   }
 
+  UIM_TRACE_BEGIN(skk_lookup, create_if_not_found, trace_start);
   if (!rs)
     ca = find_cand_array(skk_dic, hs, o, okuri, create_if_not_found);
   else {
     ca = find_cand_array(skk_dic, rs, o, okuri, create_if_not_found);
     free(rs);
   }
+  UIM_TRACE_END(skk_lookup, create_if_not_found, trace_start);
 
   return ca;
 }
@@ -1882,11 +2640,21 @@ skk_get_nr_candidates(uim_lisp skk_dic_, uim_lisp head_, uim_lisp okuri_head_, u
   return MAKE_INT(nr_cands);
 }
 
+static int
+compare_line_stamp(const void *a, const void *b)
+{
+  unsigned int p = (*(struct skk_line * const *)a)->stamp;
+  unsigned int q = (*(struct skk_line * const *)b)->stamp;
+
+  return (p < q) - (p > q);
+}
+
 static struct skk_comp_array *
 make_comp_array_from_cache(dic_info *di, const char *s, uim_lisp use_look_)
 {
-  struct skk_line *sl;
+  struct skk_line **lines;
   struct skk_comp_array *ca;
+  int i, lo, hi, nr_lines;
 
   if (!di)
     return NULL;
@@ -1898,18 +2666,25 @@ make_comp_array_from_cache(dic_info *di, const char *s, uim_lisp use_look_)
   ca->head = NULL;
   ca->next = NULL;
 
-  /* search from cache */
-  for (sl = di->head.next; sl; sl = sl->next) {
-    if (/* string 's' is part of sl->head */
-	!strncmp(sl->head, s, strlen(s)) && strcmp(sl->head, s) &&
-	/* and sl is okuri-nasi line */
-	sl->okuri_head == '\0' &&
-	/* exclude some entries */
-	sl->state & SKK_LINE_USE_FOR_COMPLETION) {
-      ca->nr_comps++;
-      ca->comps = uim_realloc(ca->comps, sizeof(char *) * ca->nr_comps);
-      ca->comps[ca->nr_comps - 1] = uim_strdup(sl->head);
-    }
+  /* search from cache. heads equal to s come first in the range */
+  find_comp_range(di, s, &lo, &hi);
+  while (lo < hi && !strcmp(di->comp_index[lo]->head, s))
+    lo++;
+
+  if (lo < hi) {
+    /* most recently used first as the order of cache */
+    nr_lines = hi - lo;
+    lines = uim_malloc(sizeof(struct skk_line *) * nr_lines);
+    memcpy(lines, &di->comp_index[lo], sizeof(struct skk_line *) * nr_lines);
+    qsort(lines, nr_lines, sizeof(struct skk_line *), compare_line_stamp);
+    if (nr_lines > SKK_COMP_MAX)
+      nr_lines = SKK_COMP_MAX;
+
+    ca->comps = uim_malloc(sizeof(char *) * nr_lines);
+    for (i = 0; i < nr_lines; i++)
+      ca->comps[i] = uim_strdup(lines[i]->head);
+    ca->nr_comps = nr_lines;
+    free(lines);
   }
 
   if (TRUEP(use_look_))
@@ -1926,6 +2701,23 @@ make_comp_array_from_cache(dic_info *di, const char *s, uim_lisp use_look_)
   return ca;
 }
 
+/* most recently used line completing s */
+static struct skk_line *
+find_latest_comp_line(dic_info *di, const char *s)
+{
+  struct skk_line *sl, *latest = NULL;
+  int lo, hi;
+
+  find_comp_range(di, s, &lo, &hi);
+  for (; lo < hi; lo++) {
+    sl = di->comp_index[lo];
+    if ((!latest || sl->stamp > latest->stamp) && strcmp(sl->head, s))
+      latest = sl;
+  }
+
+  return latest;
+}
+
 static struct skk_comp_array *
 append_comp_array_from_server(struct skk_comp_array *ca, dic_info *di, const char *s, uim_lisp use_look_)
 {
@@ -2287,25 +3079,17 @@ skk_get_dcomp_word(uim_lisp skk_dic_, uim_lisp head_, uim_lisp numeric_conv_, ui
   if (len != 0) {
     /* Search from cache using same way as in make_comp_array_from_cache(). */
     if (!rs) {
-      for (sl = skk_dic->head.next; sl; sl = sl->next) {
-	if (!strncmp(sl->head, hs, len) && strcmp(sl->head, hs) &&
-			sl->okuri_head == '\0' &&
-			sl->state & SKK_LINE_USE_FOR_COMPLETION)
-	  return MAKE_STR(sl->head);
-      }
+      if ((sl = find_latest_comp_line(skk_dic, hs)))
+	return MAKE_STR(sl->head);
       if (TRUEP(use_look_)) {
 	look_ = look_get_top_word(hs);
 	if (TRUEP(look_))
 	  return look_;
       }
     } else {
-      for (sl = skk_dic->head.next; sl; sl = sl->next) {
-	if (!strncmp(sl->head, rs, len) && strcmp(sl->head, rs) &&
-			sl->okuri_head == '\0' &&
-			sl->state & SKK_LINE_USE_FOR_COMPLETION) {
-	  free(rs);
-	  return restore_numeric(sl->head, numlst_);
-	}
+      if ((sl = find_latest_comp_line(skk_dic, rs))) {
+	free(rs);
+	return restore_numeric(sl->head, numlst_);
       }
       if (TRUEP(use_look_)) {
 	look_ = look_get_top_word(rs);
@@ -2712,7 +3496,8 @@ skk_commit_candidate(uim_lisp skk_dic_, uim_lisp head_and_okuri_head_,
     }
   }
 
-  ca->line->state = SKK_LINE_NEED_SAVE | SKK_LINE_USE_FOR_COMPLETION;
+  mark_line_learned(skk_dic, ca->line);
+  mark_line_modified(skk_dic, ca->line);
   move_line_to_cache_head(skk_dic, ca->line);
 
   return uim_scm_f();
@@ -2736,6 +3521,7 @@ static void purge_candidate(dic_info *skk_dic, struct skk_cand_array *ca, int nt
       push_purged_word(skk_dic, ca, i, 1, str);
       remove_candidate_from_array(skk_dic, ca, nth);
     }
+    mark_line_modified(skk_dic, ca->line);
 
 #if 0
     /* Disabled since we use okuri specific ignoing words */
@@ -2854,7 +3640,8 @@ learn_word_to_cand_array(dic_info *skk_dic, struct skk_cand_array *ca, const cha
     push_back_candidate_to_array(ca, word);
 
   reorder_candidate(skk_dic, ca, word);
-  ca->line->state = SKK_LINE_NEED_SAVE | SKK_LINE_USE_FOR_COMPLETION;
+  mark_line_learned(skk_dic, ca->line);
+  mark_line_modified(skk_dic, ca->line);
 }
 
 static char *
@@ -3003,8 +3790,8 @@ reverse_cache(dic_info *di)
   di->head.next = prev;
 }
 
-static void
-parse_dic_line(dic_info *di, char *line, int is_personal)
+static struct skk_line *
+compose_dic_line(dic_info *di, char *line, int is_personal)
 {
   char *buf, *sep;
   struct skk_line *sl;
@@ -3015,7 +3802,7 @@ parse_dic_line(dic_info *di, char *line, int is_personal)
 
   if (!sep || (sep == buf)) {
     free(buf);
-    return;
+    return NULL;
   }
 
   *sep = '\0';
@@ -3035,8 +3822,18 @@ parse_dic_line(dic_info *di, char *line, int is_personal)
   } else {
     sl->state = SKK_LINE_USE_FOR_COMPLETION;
   }
-  add_line_to_cache_head(di, sl);
   free(buf);
+  return sl;
+}
+
+static void
+parse_dic_line(dic_info *di, char *line, int is_personal)
+{
+  struct skk_line *sl;
+
+  sl = compose_dic_line(di, line, is_personal);
+  if (sl)
+    push_line_to_cache(di, sl);
 }
 
 static void
@@ -3116,18 +3913,20 @@ close_lock(int fd)
 }
 
 static int
-read_dictionary_file(dic_info *di, const char *fn, int is_personal)
+read_dictionary_file(dic_info *di, const char *fn, int is_personal,
+		     int need_lock)
 {
   struct stat st;
   FILE *fp;
   char buf[4096]; /* XXX */
   int err_flag = 0;
-  int lock_fd;
+  int lock_fd = -1;
 
   if (!di)
     return 0;
 
-  lock_fd = open_lock(fn, F_RDLCK);
+  if (need_lock)
+    lock_fd = open_lock(fn, F_RDLCK);
 
   if (stat(fn, &st) == -1) {
     close_lock(lock_fd);
@@ -3178,9 +3977,14 @@ skk_read_personal_dictionary(uim_lisp skk_dic_, uim_lisp fn_)
   fn = REFER_C_STR(fn_);
   ret = (stat(fn, &st) != -1) ? uim_scm_t() : uim_scm_f();
 
-  update_personal_dictionary_cache_with_file(skk_dic, fn, 1);
+  update_personal_dictionary_cache_with_file(skk_dic, fn, 1, 1);
+  if (skk_dic && skk_dic->use_journal) {
+    int lock_fd = open_lock(fn, F_RDLCK);
+    replay_journal(skk_dic, fn);
+    close_lock(lock_fd);
+  }
 #if USE_SKK_JISYO_S_BUF
-  update_personal_dictionary_cache_with_file(skk_dic, SKK_JISYO_S, 0);
+  update_personal_dictionary_cache_with_file(skk_dic, SKK_JISYO_S, 0, 1);
 #endif
 
   return ret;
@@ -3336,17 +4140,17 @@ lsort(struct skk_line *p)
 
 static void
 update_personal_dictionary_cache_with_file(dic_info *skk_dic, const char *fn,
-		                           int is_personal)
+		                           int is_personal, int need_lock)
 {
   dic_info *di;
   struct skk_line *sl, *tmp, *diff, **cache_array;
   int i, diff_len = 0;
 
   di = (dic_info *)uim_malloc(sizeof(dic_info));
-  di->cache_len = 0;
-  di->head.next = NULL;
+  init_cache(di);
 
-  if (!read_dictionary_file(di, fn, is_personal)) {
+  if (!read_dictionary_file(di, fn, is_personal, need_lock)) {
+    free_cache_index(di);
     free(di);
     return;
   }
@@ -3354,9 +4158,10 @@ update_personal_dictionary_cache_with_file(dic_info *skk_dic, const char *fn,
   /* If no cache is available, just use new one. */
   if (!skk_dic->head.next) {
     skk_dic->head.next = di->head.next;
-    skk_dic->cache_len = di->cache_len;
     skk_dic->cache_modified = di->cache_modified;
     skk_dic->personal_dic_timestamp = di->personal_dic_timestamp;
+    rebuild_cache_index(skk_dic);
+    free_cache_index(di);
     free(di);
     return;
   }
@@ -3409,6 +4214,7 @@ update_personal_dictionary_cache_with_file(dic_info *skk_dic, const char *fn,
   }
 
   skk_dic->cache_modified = 1;
+  rebuild_cache_index(skk_dic);
 
   sl = di->head.next;
   while (sl) {
@@ -3416,42 +4222,27 @@ update_personal_dictionary_cache_with_file(dic_info *skk_dic, const char *fn,
     sl = sl->next;
     free_skk_line(tmp);
   }
+  free_cache_index(di);
   free(di);
   free(cache_array);
 }
 
-static uim_lisp
-skk_save_personal_dictionary(uim_lisp skk_dic_, uim_lisp fn_)
+static int
+write_personal_dictionary(dic_info *skk_dic, const char *fn)
 {
   FILE *fp;
-  const char *fn = REFER_C_STR(fn_);
   char tmp_fn[MAXPATHLEN];
   struct skk_line *sl;
   struct stat st;
-  int lock_fd = -1;
   mode_t umask_val;
-  dic_info *skk_dic = NULL;
-
-  if (PTRP(skk_dic_))
-    skk_dic = C_PTR(skk_dic_);
-
-  if (!skk_dic || skk_dic->cache_modified == 0)
-    return uim_scm_f();
 
   if (fn) {
-    if (stat(fn, &st) != -1) {
-      if (st.st_mtime != skk_dic->personal_dic_timestamp)
-	update_personal_dictionary_cache_with_file(skk_dic, fn, 1);
-    }
-
-    lock_fd = open_lock(fn, F_WRLCK);
-
     snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", fn);
     umask_val = umask(S_IRGRP | S_IROTH | S_IWGRP | S_IWOTH);
     fp = fopen(tmp_fn, "w");
     umask(umask_val);
     if (!fp)
-      goto error;
+      return 0;
 
   } else {
     fp = stdout;
@@ -3463,27 +4254,323 @@ skk_save_personal_dictionary(uim_lisp skk_dic_, uim_lisp fn_)
   }
 
   if (fflush(fp) != 0)
-    goto error;
+    return 0;
 
   if (fsync(fileno(fp)) != 0)
-    goto error;
+    return 0;
 
   if (fclose(fp) != 0)
-    goto error;
+    return 0;
 
   if (rename(tmp_fn, fn) != 0)
-    goto error;
+    return 0;
 
   if (stat(fn, &st) != -1) {
     skk_dic->personal_dic_timestamp = st.st_mtime;
     skk_dic->cache_modified = 0;
   }
 
-error:
+  return 1;
+}
+
+/*
+ * Journal of personal dictionary
+ *
+ * Modified lines are appended to "<fn>.journal" in the dictionary
+ * format, following a header line with the generation of the journal.
+ * Each process replays the records from the offset it has replayed
+ * to, and the journal is folded into the dictionary file when it grows
+ * large.  The generation is bumped on the compaction so that the
+ * offsets of other processes turn out stale.  All of them are done
+ * with the lock of the dictionary held.
+ */
+static void
+set_journal_file(dic_info *di, const char *fn)
+{
+  char *journal_fn;
+
+  uim_asprintf(&journal_fn, "%s.journal", fn);
+  if (di->journal_fn && !strcmp(di->journal_fn, journal_fn)) {
+    free(journal_fn);
+    return;
+  }
+
+  free(di->journal_fn);
+  di->journal_fn = journal_fn;
+  di->journal_generation = 0;
+  di->journal_offset = 0;
+}
+
+static int
+read_journal_header(FILE *fp, unsigned long *generation)
+{
+  char buf[64];
+
+  return (fgets(buf, sizeof(buf), fp)
+	  && sscanf(buf, SKK_JOURNAL_HEADER " %lu", generation) == 1);
+}
+
+static void
+replay_journal_line(dic_info *di, char *line)
+{
+  struct skk_line *sl, *rec;
+  struct skk_cand_array *cands;
+  int i, nr_cand_array;
+
+  rec = compose_dic_line(di, line, 1);
+  if (!rec)
+    return;
+
+  sl = search_line_from_cache(di, rec->head, rec->okuri_head);
+  if (!sl) {
+    add_line_to_cache_head(di, rec);
+    return;
+  }
+
+  if (sl->state & SKK_LINE_NEED_JOURNAL) {
+    /* keep the modification not saved yet */
+    compare_and_merge_skk_line(di, sl, rec);
+  } else {
+    /* the record is the latest state of the line */
+    cands = sl->cands;
+    nr_cand_array = sl->nr_cand_array;
+    sl->cands = rec->cands;
+    sl->nr_cand_array = rec->nr_cand_array;
+    rec->cands = cands;
+    rec->nr_cand_array = nr_cand_array;
+    for (i = 0; i < sl->nr_cand_array; i++)
+      sl->cands[i].line = sl;
+  }
+  free_skk_line(rec);
+
+  mark_line_learned(di, sl);
+  move_line_to_cache_head(di, sl);
+}
+
+static void
+replay_journal(dic_info *di, const char *fn)
+{
+  FILE *fp;
+  struct stat st;
+  unsigned long generation;
+  char buf[4096]; /* XXX */
+  long offset;
+  int compacted, err_flag = 0;
+
+  set_journal_file(di, fn);
+
+  fp = fopen(di->journal_fn, "r");
+  if (!fp)
+    return;
+  if (fstat(fileno(fp), &st) == -1 || !read_journal_header(fp, &generation)) {
+    fclose(fp);
+    return;
+  }
+
+  /* records before the compaction are in the dictionary file */
+  compacted = (di->journal_offset
+	       && (generation != di->journal_generation
+		   || st.st_size < di->journal_offset));
+  if (compacted || (stat(fn, &st) != -1
+		    && st.st_mtime != di->personal_dic_timestamp))
+    update_personal_dictionary_cache_with_file(di, fn, 1, 0);
+  if (di->journal_offset && !compacted
+      && fseek(fp, di->journal_offset, SEEK_SET) == -1) {
+    fclose(fp);
+    return;
+  }
+  di->journal_generation = generation;
+
+  offset = ftell(fp);
+  while (fgets(buf, sizeof(buf), fp)) {
+    int len = strlen(buf);
+    if (buf[len - 1] == '\n') {
+      if (err_flag == 0) {
+	if (buf[0] != ';') {
+	  buf[len - 1] = '\0';
+	  replay_journal_line(di, buf);
+	}
+      } else {
+	/* erroneous line ends here */
+	err_flag = 0;
+      }
+      offset = ftell(fp);
+    } else {
+      err_flag = 1;
+    }
+  }
+  /* a record without newline is replayed after it is completed */
+  di->journal_offset = offset;
+  fclose(fp);
+}
+
+static int
+append_journal(dic_info *di)
+{
+  struct skk_line *sl, **lines;
+  struct stat st;
+  FILE *fp;
+  time_t now;
+  int i, fd, nr_lines = 0;
+
+  for (sl = di->head.next; sl; sl = sl->next) {
+    if (sl->state & SKK_LINE_NEED_JOURNAL)
+      nr_lines++;
+  }
+  if (!nr_lines) {
+    di->cache_modified = 0;
+    return 1;
+  }
+
+  fd = open(di->journal_fn, O_WRONLY | O_APPEND | O_CREAT, S_IRUSR | S_IWUSR);
+  if (fd == -1)
+    return 0;
+  if (fstat(fd, &st) == -1 || !(fp = fdopen(fd, "a"))) {
+    close(fd);
+    return 0;
+  }
+  if (st.st_size == 0)
+    fprintf(fp, "%s %lu\n", SKK_JOURNAL_HEADER, ++di->journal_generation);
+
+  lines = uim_malloc(sizeof(struct skk_line *) * nr_lines);
+  i = 0;
+  for (sl = di->head.next; sl; sl = sl->next) {
+    if (sl->state & SKK_LINE_NEED_JOURNAL)
+      lines[i++] = sl;
+  }
+  /* older first since replaying a record moves the line to the head */
+  qsort(lines, nr_lines, sizeof(struct skk_line *), compare_line_stamp);
+  for (i = nr_lines - 1; i >= 0; i--) {
+    if (lines[i]->state & SKK_LINE_NEED_SAVE)
+      write_out_line(fp, lines[i]);
+  }
+
+  if (fflush(fp) != 0 || fstat(fd, &st) == -1) {
+    fclose(fp);
+    free(lines);
+    return 0;
+  }
+
+  /* fsync is batched since records lost on crash are only recent ones */
+  now = time(NULL);
+  di->journal_unsynced += nr_lines;
+  if (di->journal_unsynced >= SKK_JOURNAL_SYNC_RECORDS
+      || now - di->journal_synced_at >= SKK_JOURNAL_SYNC_INTERVAL) {
+    if (fsync(fd) == 0) {
+      di->journal_unsynced = 0;
+      di->journal_synced_at = now;
+    }
+  }
+  fclose(fp);
+
+  for (i = 0; i < nr_lines; i++)
+    lines[i]->state &= ~SKK_LINE_NEED_JOURNAL;
+  free(lines);
+
+  di->journal_offset = st.st_size;
+  di->cache_modified = 0;
+
+  return 1;
+}
+
+static void
+compact_journal(dic_info *di, const char *fn)
+{
+  char tmp_fn[MAXPATHLEN];
+  struct stat st;
+  mode_t umask_val;
+  FILE *fp;
+  int ok;
+
+  if (stat(fn, &st) != -1
+      && (di->journal_offset < SKK_JOURNAL_COMPACT_SIZE
+	  || di->journal_offset < st.st_size / 4))
+    return;
+
+  if (!write_personal_dictionary(di, fn))
+    return;
+
+  snprintf(tmp_fn, sizeof(tmp_fn), "%s.tmp", di->journal_fn);
+  umask_val = umask(S_IRGRP | S_IROTH | S_IWGRP | S_IWOTH);
+  fp = fopen(tmp_fn, "w");
+  umask(umask_val);
+  if (!fp)
+    return;
+
+  fprintf(fp, "%s %lu\n", SKK_JOURNAL_HEADER, di->journal_generation + 1);
+  ok = (fflush(fp) == 0 && fsync(fileno(fp)) == 0);
+  ok = (fclose(fp) == 0) && ok;
+  ok = ok && (rename(tmp_fn, di->journal_fn) == 0);
+  if (!ok) {
+    /* records in the journal are replayed again, which is harmless */
+    unlink(tmp_fn);
+    return;
+  }
+
+  di->journal_generation++;
+  di->journal_offset = 0;
+  di->journal_unsynced = 0;
+  if ((fp = fopen(di->journal_fn, "r"))) {
+    unsigned long generation;
+    if (read_journal_header(fp, &generation))
+      di->journal_offset = ftell(fp);
+    fclose(fp);
+  }
+}
+
+static uim_lisp
+skk_save_personal_dictionary(uim_lisp skk_dic_, uim_lisp fn_)
+{
+  const char *fn = REFER_C_STR(fn_);
+  struct stat st;
+  int lock_fd = -1;
+  dic_info *skk_dic = NULL;
+
+  if (PTRP(skk_dic_))
+    skk_dic = C_PTR(skk_dic_);
+
+  if (!skk_dic || skk_dic->cache_modified == 0)
+    return uim_scm_f();
+
+  if (fn && skk_dic->use_journal) {
+    lock_fd = open_lock(fn, F_WRLCK);
+    replay_journal(skk_dic, fn);
+    if (append_journal(skk_dic))
+      compact_journal(skk_dic, fn);
+    close_lock(lock_fd);
+    return uim_scm_f();
+  }
+
+  if (fn) {
+    if (stat(fn, &st) != -1) {
+      if (st.st_mtime != skk_dic->personal_dic_timestamp)
+	update_personal_dictionary_cache_with_file(skk_dic, fn, 1, 1);
+    }
+
+    lock_fd = open_lock(fn, F_WRLCK);
+  }
+
+  write_personal_dictionary(skk_dic, fn);
+
   close_lock(lock_fd);
   return uim_scm_f();
 }
 
+static uim_lisp
+skk_set_personal_dic_journal(uim_lisp skk_dic_, uim_lisp use_journal_)
+{
+  dic_info *skk_dic = NULL;
+
+  if (PTRP(skk_dic_))
+    skk_dic = C_PTR(skk_dic_);
+  if (!skk_dic)
+    return uim_scm_f();
+
+  skk_dic->use_journal = C_BOOL(use_journal_);
+
+  return uim_scm_t();
+}
+
 static uim_lisp
 skk_get_annotation(uim_lisp str_)
 {
@@ -3759,8 +4846,11 @@ uim_plugin_instance_init(void)
 {
   uim_scm_init_proc5("skk-lib-dic-open", skk_dic_open);
   uim_scm_init_proc1("skk-lib-free-dic", skk_free_dic);
+  uim_scm_init_proc2("skk-lib-set-cache-capacity", skk_set_cache_capacity);
+  uim_scm_init_proc2("skk-lib-dic-add-source", skk_dic_add_source);
   uim_scm_init_proc2("skk-lib-read-personal-dictionary", skk_read_personal_dictionary);
   uim_scm_init_proc2("skk-lib-save-personal-dictionary", skk_save_personal_dictionary);
+  uim_scm_init_proc2("skk-lib-set-personal-dic-journal", skk_set_personal_dic_journal);
   uim_scm_init_proc5("skk-lib-get-entry", skk_get_entry);
   uim_scm_init_proc1("skk-lib-store-replaced-numstr", skk_store_replaced_numeric_str);
   uim_scm_init_proc2("skk-lib-merge-replaced-numstr", skk_merge_replaced_numeric_str);
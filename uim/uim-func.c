@@ -39,9 +39,11 @@
 #include <assert.h>
 
 #include "uim-internal.h"
+#include "uim-util.h"
 #include "uim-scm.h"
 #include "uim-scm-abbrev.h"
 #include "uim-im-switcher.h"
+#include "uim-trace.h"
 
 
 #define TEXT_EMPTYP(txt) (!(txt) || !(txt)[0])
@@ -88,6 +90,110 @@ im_convertiblep(uim_lisp uc_, uim_lisp im_encoding_)
   return MAKE_BOOL(convertiblep);
 }
 
+/*
+ * Preedit snapshot: while the snapshot callback is set, the segments
+ * passed by im-pushback-preedit are accumulated into a single buffer
+ * and delivered at once on im-update-preedit. Two buffers are swapped
+ * to compare the new preedit with the last delivered one, and the
+ * generation is advanced only when they differ. Segments pushed
+ * without clearing are appended to the last preedit as the legacy
+ * callbacks do.
+ */
+static void
+preedit_buf_reserve(struct uim_preedit_buf_ *buf, size_t len, int nr_segs)
+{
+  if (buf->len + len + sizeof("") > buf->size) {
+    buf->size = (buf->len + len + sizeof("")) * 2;
+    buf->str = uim_realloc(buf->str, buf->size);
+  }
+  if (buf->nr_segs + nr_segs > buf->segs_size) {
+    buf->segs_size = (buf->nr_segs + nr_segs) * 2;
+    buf->segs = uim_realloc(buf->segs, sizeof(*buf->segs) * buf->segs_size);
+  }
+}
+
+static void
+preedit_snapshot_clear(uim_context uc)
+{
+  struct uim_preedit_buf_ *buf;
+
+  buf = &uc->preedit[uc->preedit_building];
+  buf->len = 0;
+  buf->nr_segs = 0;
+  uc->preedit_inherit = UIM_FALSE;
+}
+
+static void
+preedit_snapshot_pushback(uim_context uc, int attr, const char *str)
+{
+  struct uim_preedit_buf_ *buf, *last;
+  struct uim_preedit_segment *seg;
+  size_t len;
+
+  buf = &uc->preedit[uc->preedit_building];
+  if (uc->preedit_inherit) {
+    last = &uc->preedit[!uc->preedit_building];
+    buf->len = buf->nr_segs = 0;
+    preedit_buf_reserve(buf, last->len, last->nr_segs);
+    if (last->len)
+      memcpy(buf->str, last->str, last->len);
+    if (last->nr_segs)
+      memcpy(buf->segs, last->segs, sizeof(*buf->segs) * last->nr_segs);
+    buf->len = last->len;
+    buf->nr_segs = last->nr_segs;
+    uc->preedit_inherit = UIM_FALSE;
+  }
+
+  len = strlen(str);
+  preedit_buf_reserve(buf, len, 1);
+  seg = &buf->segs[buf->nr_segs++];
+  seg->attr = attr;
+  seg->offset = buf->len;
+  seg->len = len;
+  memcpy(&buf->str[buf->len], str, len + sizeof(""));
+  buf->len += len;
+}
+
+static void
+preedit_snapshot_update(uim_context uc)
+{
+  struct uim_preedit_buf_ *built, *last;
+  struct uim_preedit_snapshot snapshot;
+  int i;
+
+  built = &uc->preedit[uc->preedit_building];
+  last = &uc->preedit[!uc->preedit_building];
+  if (!uc->preedit_generation
+      || (!uc->preedit_inherit
+	  && (built->len != last->len || built->nr_segs != last->nr_segs
+	      || (built->len && memcmp(built->str, last->str, built->len))
+	      || (built->nr_segs
+		  && memcmp(built->segs, last->segs,
+			    sizeof(*built->segs) * built->nr_segs)))))
+  {
+    if (!++uc->preedit_generation)
+      uc->preedit_generation = 1;
+    uc->preedit_building = !uc->preedit_building;
+    last = built;
+  }
+  uc->preedit_inherit = UIM_TRUE;
+
+  snapshot.generation = uc->preedit_generation;
+  snapshot.str = last->str ? last->str : "";
+  snapshot.len = last->len;
+  snapshot.segments = last->segs;
+  snapshot.nr_segments = last->nr_segs;
+  snapshot.cursor = -1;
+  for (i = 0; i < last->nr_segs; i++) {
+    if (last->segs[i].attr & UPreeditAttr_Cursor) {
+      snapshot.cursor = last->segs[i].offset;
+      break;
+    }
+  }
+
+  uc->preedit_snapshot_cb(uc->ptr, &snapshot);
+}
+
 static uim_lisp
 im_clear_preedit(uim_lisp uc_)
 {
@@ -96,6 +202,8 @@ im_clear_preedit(uim_lisp uc_)
   uc = retrieve_uim_context(uc_);
   if (uc->preedit_clear_cb)
     uc->preedit_clear_cb(uc->ptr);
+  if (uc->preedit_snapshot_cb)
+    preedit_snapshot_clear(uc);
 
   return uim_scm_f();
 }
@@ -112,22 +220,47 @@ im_pushback_preedit(uim_lisp uc_, uim_lisp attr_, uim_lisp str_)
   attr = C_INT(attr_);
   str = REFER_C_STR(str_);
 
+  if (UIM_CONV_IDENTITYP(uc, uc->outbound_conv)) {
+    if (uc->preedit_pushback_cb)
+      uc->preedit_pushback_cb(uc->ptr, attr, str);
+    if (uc->preedit_snapshot_cb)
+      preedit_snapshot_pushback(uc, attr, str);
+    return uim_scm_f();
+  }
+
   converted_str = uc->conv_if->convert(uc->outbound_conv, str);
   if (uc->preedit_pushback_cb)
     uc->preedit_pushback_cb(uc->ptr, attr, converted_str);
+  if (uc->preedit_snapshot_cb && converted_str)
+    preedit_snapshot_pushback(uc, attr, converted_str);
   free(converted_str);
 
   return uim_scm_f();
 }
 
+static void
+update_preedit(uim_context uc)
+{
+  long trace_start;
+
+  UIM_TRACE_BEGIN(preedit_update, 0, trace_start);
+  if (uc->preedit_update_cb)
+    uc->preedit_update_cb(uc->ptr);
+  if (uc->preedit_snapshot_cb)
+    preedit_snapshot_update(uc);
+  UIM_TRACE_END(preedit_update, 0, trace_start);
+}
+
 static uim_lisp
 im_update_preedit(uim_lisp uc_)
 {
   uim_context uc;
 
   uc = retrieve_uim_context(uc_);
-  if (uc->preedit_update_cb)
-    uc->preedit_update_cb(uc->ptr);
+  if (uc->batching)
+    uc->preedit_update_pending = UIM_TRUE;
+  else
+    update_preedit(uc);
 
   return uim_scm_f();
 }
@@ -138,14 +271,24 @@ im_commit(uim_lisp uc_, uim_lisp str_)
   uim_context uc;
   const char *str;
   char *converted_str;
+  long trace_start;
 
   uc = retrieve_uim_context(uc_);
   str = REFER_C_STR(str_);
 
+  UIM_TRACE_BEGIN(commit, 0, trace_start);
+  if (UIM_CONV_IDENTITYP(uc, uc->outbound_conv)) {
+    if (uc->commit_cb)
+      uc->commit_cb(uc->ptr, str);
+    UIM_TRACE_END(commit, 0, trace_start);
+    return uim_scm_f();
+  }
+
   converted_str = uc->conv_if->convert(uc->outbound_conv, str);
   if (uc->commit_cb)
     uc->commit_cb(uc->ptr, converted_str);
   free(converted_str);
+  UIM_TRACE_END(commit, 0, trace_start);
 
   return uim_scm_f();
 }
@@ -270,6 +413,34 @@ im_update_mode(uim_lisp uc_, uim_lisp mode_)
   return uim_scm_f();
 }
 
+/*
+ * While uim_press_keys() is processing key events, only the last
+ * candidate selection is delivered. It is flushed before the other
+ * candidate selector requests to keep their order, and dropped when
+ * the selector is activated or deactivated.
+ */
+static void
+flush_pending_select(uim_context uc)
+{
+  if (!uc->select_pending)
+    return;
+
+  uc->select_pending = UIM_FALSE;
+  if (uc->candidate_selector_select_cb)
+    uc->candidate_selector_select_cb(uc->ptr, uc->pending_select);
+}
+
+void
+uim_end_key_batch(uim_context uc)
+{
+  uc->batching = UIM_FALSE;
+  flush_pending_select(uc);
+  if (uc->preedit_update_pending) {
+    uc->preedit_update_pending = UIM_FALSE;
+    update_preedit(uc);
+  }
+}
+
 static uim_lisp
 im_activate_candidate_selector(uim_lisp uc_,
                                uim_lisp nr_, uim_lisp display_limit_)
@@ -281,8 +452,12 @@ im_activate_candidate_selector(uim_lisp uc_,
   nr = C_INT(nr_);
   display_limit = C_INT(display_limit_);
 
+  /* the previous candidates may be freed in the callback */
+  uim_retire_cand_arena(uc);
+  uc->select_pending = UIM_FALSE;
   if (uc->candidate_selector_activate_cb)
     uc->candidate_selector_activate_cb(uc->ptr, nr, display_limit);
+  uim_release_cand_arena(uc);
 
   return uim_scm_f();
 }
@@ -296,6 +471,7 @@ im_delay_activate_candidate_selector(uim_lisp uc_, uim_lisp delay_)
   uc = retrieve_uim_context(uc_);
   delay = C_INT(delay_);
 
+  flush_pending_select(uc);
   if (uc->candidate_selector_delay_activate_cb)
     uc->candidate_selector_delay_activate_cb(uc->ptr, delay);
 
@@ -311,8 +487,12 @@ im_select_candidate(uim_lisp uc_, uim_lisp idx_)
   uc = retrieve_uim_context(uc_);
   idx = C_INT(idx_);
 
-  if (uc->candidate_selector_select_cb)
+  if (uc->batching) {
+    uc->select_pending = UIM_TRUE;
+    uc->pending_select = idx;
+  } else if (uc->candidate_selector_select_cb) {
     uc->candidate_selector_select_cb(uc->ptr, idx);
+  }
 
   return uim_scm_f();
 }
@@ -328,6 +508,7 @@ im_shift_page_candidate(uim_lisp uc_, uim_lisp dir_)
   uc = retrieve_uim_context(uc_);
   dir = (C_BOOL(dir_)) ? 1 : 0;
     
+  flush_pending_select(uc);
   if (uc->candidate_selector_shift_page_cb)
     uc->candidate_selector_shift_page_cb(uc->ptr, dir);
 
@@ -341,8 +522,10 @@ im_deactivate_candidate_selector(uim_lisp uc_)
 
   uc = retrieve_uim_context(uc_);
 
+  uc->select_pending = UIM_FALSE;
   if (uc->candidate_selector_deactivate_cb)
     uc->candidate_selector_deactivate_cb(uc->ptr);
+  uim_reset_cand_arena(uc);
 
   return uim_scm_f();
 }
@@ -57,11 +57,12 @@
 
 
 #define RECV_BUFFER_SIZE 1024
+#define CLOSE_FLUSH_TIMEOUT 1000  /* msec */
 
 /*Common buffer for some functions's temporary buffer.
   Pay attention for use.*/
 static char uim_recv_buf[RECV_BUFFER_SIZE];
-static char *uim_read_buf;
+static struct uim_helper_buf uim_read_buf;
 
 static int uim_fd = -1;
 static void (*uim_disconnect_cb)(void);
@@ -102,6 +103,14 @@ int uim_helper_init_client_fd(void (*disconnect_cb)(void))
   }
   fcntl(fd, F_SETFD, fcntl(fd, F_GETFD, 0) | FD_CLOEXEC);
   
+#if !defined(MSG_NOSIGNAL) && defined(SO_NOSIGPIPE)
+  /* uim_helper_send_message() must not raise SIGPIPE */
+  {
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+  }
+#endif
+
 #ifdef LOCAL_CREDS /* for NetBSD */
   /* Set the socket to receive credentials on the next message */
   {
@@ -133,8 +142,6 @@ int uim_helper_init_client_fd(void (*disconnect_cb)(void))
   if (uim_helper_check_connection_fd(fd))
     goto error;
 
-  if (!uim_read_buf)
-    uim_read_buf = uim_strdup("");
   uim_disconnect_cb = disconnect_cb;
   uim_fd = fd;
 
@@ -156,8 +163,13 @@ error:
 void
 uim_helper_close_client_fd(int fd)
 {
-  if (fd != -1)
+  if (fd != -1) {
+    /* deliver the queued tail unless the server stalls. the rest is
+       discarded since the fd may be reused for another connection */
+    uim_helper_drain_messages(fd, CLOSE_FLUSH_TIMEOUT);
+    uim_helper_discard_messages(fd);
     close(fd);
+  }
 
   if (uim_disconnect_cb)
     uim_disconnect_cb();
@@ -185,18 +197,51 @@ uim_helper_client_get_prop_list(void)
   uim_helper_send_message(uim_fd, "prop_list_get\n");
 }
 
+void
+uim_helper_client_request_frames(void)
+{
+  uim_helper_send_message(uim_fd, "protocol_version\n"
+			  UIM_HELPER_FRAME_VERSION_STR "\n");
+}
+
+void
+uim_helper_client_subscribe(const int *types, int nr_types)
+{
+  struct uim_helper_buf msg;
+  const char *name;
+  int i;
+
+  if (UIM_CATCH_ERROR_BEGIN())
+    return;
+
+  uim_helper_buf_init(&msg);
+  uim_helper_buf_append(&msg, "subscribe\n", strlen("subscribe\n"));
+  for (i = 0; i < nr_types; i++) {
+    if ((name = uim_helper_msg_type_name(types[i]))) {
+      uim_helper_buf_append(&msg, name, strlen(name));
+      uim_helper_buf_append(&msg, "\n", 1);
+    }
+  }
+  uim_helper_send_message(uim_fd, msg.str);
+  uim_helper_buf_release(&msg);
+
+  UIM_CATCH_ERROR_END();
+}
+
 void
 uim_helper_read_proc(int fd)
 {
   int rc;
 
+  uim_helper_flush_messages(fd);
+
   while (uim_helper_fd_readable(fd) > 0) {
     rc = read(fd, uim_recv_buf, sizeof(uim_recv_buf));
     if (rc == 0 || (rc == -1 && errno != EAGAIN)) {
       uim_helper_close_client_fd(fd);
       return;
     } else if (rc > 0) {
-      uim_read_buf = uim_helper_buffer_append(uim_read_buf, uim_recv_buf, rc);
+      uim_helper_buf_append(&uim_read_buf, uim_recv_buf, rc);
     }
   }
 }
@@ -204,5 +249,11 @@ uim_helper_read_proc(int fd)
 char *
 uim_helper_get_message(void)
 {
-  return uim_helper_buffer_get_message(uim_read_buf);
+  return uim_helper_buf_get_message(&uim_read_buf);
+}
+
+int
+uim_helper_get_frame(struct uim_helper_frame *frame)
+{
+  return uim_helper_buf_get_frame(&uim_read_buf, frame);
 }
@@ -38,6 +38,7 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/param.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdlib.h>
@@ -51,32 +52,75 @@
 #ifdef HAVE_STRINGS_H
 #include <strings.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#elif defined(HAVE_POLL_H)
+#include <poll.h>
+#elif defined(HAVE_SYS_POLL_H)
+#include <sys/poll.h>
+#else
+#include "bsd-poll.h"
+#endif
 
 #include "uim.h"
 #include "uim-internal.h"
 #include "uim-helper.h"
 
 
+/*
+ * A message is read once into a refcounted block which is shared by
+ * the write queues of all the receivers, and the queued blocks are
+ * written with a single writev(2) per writable event.
+ */
+struct msg_block {
+  int refcount;
+  size_t len;
+  char data[1];
+};
+
 struct client {
   int fd;
-  char *rbuf;
-  char *wbuf;
+  struct uim_helper_buf rbuf;
+  /* ring of queued blocks; wq_offset bytes of the head are written */
+  struct msg_block **wq;
+  int wq_head;
+  int wq_len;
+  int wq_size;
+  size_t wq_offset;
+  uim_bool writing;      /* waiting for a writable event */
+  uim_bool framed;       /* receives frames instead of text messages */
+  unsigned int topics;   /* bit (1 << type) for each subscribed type */
+  struct client *prev, *next;
+  /* list of the subscribers of each message type */
+  struct client *topic_prev[UHelperMsg_Last];
+  struct client *topic_next[UHelperMsg_Last];
 };
 
-#define MAX_CLIENT 32
+#define ALL_TOPICS ((1U << UHelperMsg_Last) - 1)
+
 #define BUFFER_SIZE 1024
+#define MAX_IOV 64
+#define MAX_EVENTS 64
 
 #ifndef SUN_LEN
 #define SUN_LEN(su)							\
   (sizeof(*(su)) - sizeof((su)->sun_path) + strlen((su)->sun_path))
 #endif
 
-static fd_set s_fdset_read;
-static fd_set s_fdset_write;
-static int s_max_fd;
-static int nr_client_slots;
-static struct client *clients;
+static struct client *clients;    /* list of connected clients */
+static struct client *closed_clients;
+static struct client *subscribers[UHelperMsg_Last];
+static int nr_clients;
 static char read_buf[BUFFER_SIZE];
+static struct uim_helper_buf conv_buf;  /* for protocol translation */
+
+#ifdef HAVE_SYS_EPOLL_H
+static int epoll_fd;
+#else
+static struct pollfd *pollfds;
+static struct client **pollfd_clients;
+static int pollfds_size;
+#endif
 
 static int
 init_server_fd(char *path)
@@ -126,66 +170,304 @@ init_server_fd(char *path)
     return -1;
   }
 
-  FD_SET(fd, &s_fdset_read);
-  s_max_fd = fd;
-
   return fd;
 }
 
-static struct client *
-get_unused_client(void)
+/* The client of a server fd is NULL. */
+static int
+watch_fd(int fd, struct client *cl)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN;
+  ev.data.ptr = cl;
+
+  return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+#else
+  /* pollfds are rebuilt from the client list on each poll(2) */
+  return 0;
+#endif
+}
+
+static void
+watch_writable(struct client *cl, uim_bool writing)
+{
+#ifdef HAVE_SYS_EPOLL_H
+  struct epoll_event ev;
+#endif
+
+  if (cl->writing == writing)
+    return;
+  cl->writing = writing;
+
+#ifdef HAVE_SYS_EPOLL_H
+  memset(&ev, 0, sizeof(ev));
+  ev.events = (writing) ? (EPOLLIN | EPOLLOUT) : EPOLLIN;
+  ev.data.ptr = cl;
+  epoll_ctl(epoll_fd, EPOLL_CTL_MOD, cl->fd, &ev);
+#endif
+}
+
+static struct msg_block *
+msg_block_new(const char *msg, size_t len)
 {
-  int i;
+  struct msg_block *blk;
 
-  for (i = 0; i < nr_client_slots; i++) {
-    if (clients[i].fd == -1)
-      return &clients[i];
+  blk = uim_malloc(sizeof(*blk) + len);
+  blk->refcount = 0;
+  blk->len = len;
+  memcpy(blk->data, msg, len);
+
+  return blk;
+}
+
+static void
+msg_block_unref(struct msg_block *blk)
+{
+  if (--blk->refcount == 0)
+    free(blk);
+}
+
+static void
+enqueue_block(struct client *cl, struct msg_block *blk)
+{
+  struct msg_block **wq;
+  int i, size;
+
+  if (cl->wq_len == cl->wq_size) {
+    size = (cl->wq_size) ? cl->wq_size * 2 : 16;
+    wq = uim_malloc(sizeof(*wq) * size);
+    for (i = 0; i < cl->wq_len; i++)
+      wq[i] = cl->wq[(cl->wq_head + i) % cl->wq_size];
+    free(cl->wq);
+    cl->wq = wq;
+    cl->wq_head = 0;
+    cl->wq_size = size;
   }
+  cl->wq[(cl->wq_head + cl->wq_len) % cl->wq_size] = blk;
+  cl->wq_len++;
+  blk->refcount++;
+}
 
-  nr_client_slots++;
-  clients = uim_realloc(clients, sizeof(struct client) * nr_client_slots);
-  clients[nr_client_slots - 1].rbuf = uim_strdup("");
-  clients[nr_client_slots - 1].wbuf = uim_strdup("");
+static void
+dequeue_block(struct client *cl)
+{
+  msg_block_unref(cl->wq[cl->wq_head]);
+  cl->wq_head = (cl->wq_head + 1) % cl->wq_size;
+  cl->wq_len--;
+  cl->wq_offset = 0;
+}
 
-  return &clients[nr_client_slots - 1];
+/* Links the client to the subscriber lists of the topics and unlinks
+ * it from the others. */
+static void
+set_topics(struct client *cl, unsigned int topics)
+{
+  int type;
+  unsigned int bit;
+
+  for (type = 0; type < UHelperMsg_Last; type++) {
+    bit = 1U << type;
+    if ((cl->topics & bit) == (topics & bit))
+      continue;
+    if (topics & bit) {
+      cl->topic_prev[type] = NULL;
+      cl->topic_next[type] = subscribers[type];
+      if (subscribers[type])
+	subscribers[type]->topic_prev[type] = cl;
+      subscribers[type] = cl;
+    } else {
+      if (cl->topic_prev[type])
+	cl->topic_prev[type]->topic_next[type] = cl->topic_next[type];
+      else
+	subscribers[type] = cl->topic_next[type];
+      if (cl->topic_next[type])
+	cl->topic_next[type]->topic_prev[type] = cl->topic_prev[type];
+    }
+  }
+  cl->topics = topics;
 }
 
+static struct client *
+new_client(int fd)
+{
+  struct client *cl;
+
+  cl = uim_malloc(sizeof(*cl));
+  memset(cl, 0, sizeof(*cl));
+  cl->fd = fd;
+
+  cl->prev = NULL;
+  cl->next = clients;
+  if (clients)
+    clients->prev = cl;
+  clients = cl;
+  nr_clients++;
+  set_topics(cl, ALL_TOPICS);
+
+  return cl;
+}
+
+/* The client is freed after the events at hand are dispatched since
+ * they may still refer to it. */
 static void
 close_client(struct client *cl)
 {
+  if (cl->fd == -1)
+    return;
+
   close(cl->fd);
-  if (cl->rbuf) {
-    free(cl->rbuf);
-    cl->rbuf = uim_strdup("");
-  }
-  if (cl->wbuf) {
-    free(cl->wbuf);
-    cl->wbuf = uim_strdup("");
-  }
   cl->fd = -1;
+  while (cl->wq_len)
+    dequeue_block(cl);
+
+  if (cl->prev)
+    cl->prev->next = cl->next;
+  else
+    clients = cl->next;
+  if (cl->next)
+    cl->next->prev = cl->prev;
+  nr_clients--;
+  set_topics(cl, 0);
+
+  cl->next = closed_clients;
+  closed_clients = cl;
 }
 
 static void
-distribute_message(char *msg, struct client *cl)
+free_closed_clients(void)
 {
-  int i;
-  size_t msg_len;
+  struct client *cl, *next;
 
-  msg_len = strlen(msg);
+  for (cl = closed_clients; cl; cl = next) {
+    next = cl->next;
+    uim_helper_buf_release(&cl->rbuf);
+    free(cl->wq);
+    free(cl);
+  }
+  closed_clients = NULL;
+}
 
-  for (i = 0; i < nr_client_slots; i++) {
-    if (clients[i].fd != -1 && clients[i].fd != cl->fd) {
-      clients[i].wbuf = uim_helper_buffer_append(clients[i].wbuf, msg, msg_len);
-      FD_SET(clients[i].fd, &s_fdset_write);
+static int
+message_type(const char *msg, size_t len)
+{
+  const char *nl;
+  int type;
+
+  if (uim_helper_is_frame(msg)) {
+    type = (unsigned char)msg[2] << 8 | (unsigned char)msg[3];
+    return (type < UHelperMsg_Last) ? type : UHelperMsg_Unknown;
+  }
+
+  nl = memchr(msg, '\n', len);  /* always found */
+  return uim_helper_msg_type(msg, nl - msg);
+}
+
+/* Sends the message to the subscribers of its type. The message is
+ * translated for the destination only once however many clients of
+ * each protocol there are. */
+static void
+distribute_message(const char *msg, size_t len, int type, struct client *cl)
+{
+  struct msg_block *text_blk, *frame_blk, *blk;
+  struct client *dest;
+  int is_frame;
+
+  is_frame = uim_helper_is_frame(msg);
+  text_blk = frame_blk = NULL;
+  for (dest = subscribers[type]; dest; dest = dest->topic_next[type]) {
+    if (dest == cl)
+      continue;
+    if (dest->framed) {
+      if (!frame_blk) {
+	if (is_frame) {
+	  frame_blk = msg_block_new(msg, len);
+	} else {
+	  uim_helper_frame_encode(&conv_buf, msg, len);
+	  frame_blk = msg_block_new(conv_buf.str, conv_buf.len);
+	}
+      }
+      blk = frame_blk;
+    } else {
+      if (!text_blk) {
+	if (is_frame) {
+	  uim_helper_frame_to_text(&conv_buf, msg, len);
+	  text_blk = msg_block_new(conv_buf.str, conv_buf.len);
+	} else {
+	  text_blk = msg_block_new(msg, len);
+	}
+      }
+      blk = text_blk;
     }
+    enqueue_block(dest, blk);
+    watch_writable(dest, UIM_TRUE);
+  }
+}
+
+#define FRAMED_PROTOCOL_MSG \
+  "protocol_version\n" UIM_HELPER_FRAME_VERSION_STR "\n\n"
+#define TEXT_PROTOCOL_MSG "protocol_version\n0\n\n"
+
+/* The protocol_version request is answered by the server itself with
+ * the version it will use for the client. */
+static void
+negotiate_protocol(struct client *cl, const char *msg, size_t len)
+{
+  struct msg_block *blk;
+
+  if (uim_helper_is_frame(msg)) {
+    uim_helper_frame_to_text(&conv_buf, msg, len);
+    msg = conv_buf.str;
+    len = conv_buf.len;
+  }
+
+  cl->framed = (len == strlen(FRAMED_PROTOCOL_MSG)
+		&& !memcmp(msg, FRAMED_PROTOCOL_MSG, len));
+  if (cl->framed) {
+    uim_helper_frame_encode(&conv_buf, FRAMED_PROTOCOL_MSG,
+			    strlen(FRAMED_PROTOCOL_MSG));
+    blk = msg_block_new(conv_buf.str, conv_buf.len);
+  } else {
+    blk = msg_block_new(TEXT_PROTOCOL_MSG, strlen(TEXT_PROTOCOL_MSG));
   }
+  enqueue_block(cl, blk);
+  watch_writable(cl, UIM_TRUE);
+}
+
+/* Each line after the command names a message type to be received.
+ * Messages of unknown types are sent only to the clients that have not
+ * subscribed. */
+static void
+subscribe(struct client *cl, const char *msg, size_t len)
+{
+  const char *line, *nl, *end;
+  unsigned int topics;
+
+  if (uim_helper_is_frame(msg)) {
+    uim_helper_frame_to_text(&conv_buf, msg, len);
+    msg = conv_buf.str;
+    len = conv_buf.len;
+  }
+
+  topics = 0;
+  end = msg + len;
+  line = (const char *)memchr(msg, '\n', len) + 1;
+  for (; line < end && *line != '\n'; line = nl + 1) {
+    nl = memchr(line, '\n', end - line);
+    topics |= 1U << uim_helper_msg_type(line, nl - line);
+  }
+  set_topics(cl, topics & ~(1U << UHelperMsg_Unknown));
 }
 
 static int
 reflect_message_fragment(struct client *cl)
 {
   ssize_t rc;
-  char *msg;
+  const char *msg;
+  size_t len;
+  int type;
 
   /* do read */
   rc = read(cl->fd, read_buf, sizeof(read_buf));
@@ -196,11 +478,16 @@ reflect_message_fragment(struct client *cl)
   } else if (rc == 0)
     return -1;
 
-  cl->rbuf = uim_helper_buffer_append(cl->rbuf, read_buf, rc);
+  uim_helper_buf_append(&cl->rbuf, read_buf, rc);
 
-  while ((msg = uim_helper_buffer_get_message(cl->rbuf))) {
-    distribute_message(msg, cl);
-    free(msg);
+  while ((msg = uim_helper_buf_next_message(&cl->rbuf, &len))) {
+    type = message_type(msg, len);
+    if (type == UHelperMsg_ProtocolVersion)
+      negotiate_protocol(cl, msg, len);
+    else if (type == UHelperMsg_Subscribe)
+      subscribe(cl, msg, len);
+    else
+      distribute_message(msg, len, type, cl);
   }
 
   return 1;
@@ -210,14 +497,19 @@ static uim_bool
 check_session_alive(void)
 {
   /* If there's no connection, we can assume user logged out. */
-  int i;
+  return (nr_clients > 0) ? UIM_TRUE : UIM_FALSE;
+}
 
-  for (i = 0; i < nr_client_slots; i++) {
-    if (clients[i].fd != -1)
-      return UIM_TRUE;
-  }
+/* Returns UIM_FALSE if the last client has gone. */
+static uim_bool
+finish_events(void)
+{
+  uim_bool closed;
 
-  return UIM_FALSE; /* User already logged out */
+  closed = (closed_clients != NULL);
+  free_closed_clients();
+
+  return (!closed || check_session_alive());
 }
 
 
@@ -248,21 +540,17 @@ accept_new_connection(int server_fd)
     return UIM_FALSE;
   }
 
-  cl = get_unused_client();
-  if (!cl) {
-    close(new_fd);
-    return UIM_FALSE;
-  }
-  cl->fd = new_fd;
+  cl = new_client(new_fd);
 #ifdef LOCAL_CREDS	/* for NetBSD */
   {
     char buf[1] = { '\0' };
     write(cl->fd, buf, 1);
   }
 #endif
-  FD_SET(cl->fd, &s_fdset_read);
-  if (cl->fd > s_max_fd)
-    s_max_fd = cl->fd;
+  if (watch_fd(cl->fd, cl) < 0) {
+    close_client(cl);
+    return UIM_FALSE;
+  }
 
   return UIM_TRUE;
 }
@@ -270,41 +558,49 @@ accept_new_connection(int server_fd)
 static void
 write_message(struct client *cl)
 {
-  int ret, message_len, out_len;
-  char *out;
-  
-  out = cl->wbuf;
-  message_len = out_len = strlen(cl->wbuf);
-  while (out_len > 0) {
-    if ((ret = write(cl->fd, out, out_len)) < 0) {
-      if (errno == EAGAIN) {
-#if 0
-	fprintf(stderr, "EAGAIN: fd = %d\n", cl->fd);
-#endif
-      } else {
-	perror("uim-helper_server write(2) failed");
-	if (errno == EPIPE) {
-	  fprintf(stderr, "fd = %d\n", cl->fd);
-	  FD_CLR(cl->fd, &s_fdset_read);
-	  FD_CLR(cl->fd, &s_fdset_write);
-	  if (cl->fd == s_max_fd)
-	    s_max_fd--;
-	  close_client(cl);
-	}
+  struct iovec iov[MAX_IOV];
+  struct msg_block *blk;
+  ssize_t ret;
+  size_t written;
+  int i, n;
+
+  while (cl->wq_len > 0) {
+    n = (cl->wq_len < MAX_IOV) ? cl->wq_len : MAX_IOV;
+    for (i = 0; i < n; i++) {
+      blk = cl->wq[(cl->wq_head + i) % cl->wq_size];
+      iov[i].iov_base = blk->data;
+      iov[i].iov_len = blk->len;
+    }
+    iov[0].iov_base = (char *)iov[0].iov_base + cl->wq_offset;
+    iov[0].iov_len -= cl->wq_offset;
+
+    ret = writev(cl->fd, iov, n);
+    if (ret < 0) {
+      if (errno == EINTR)
+	continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+	return;
+      perror("uim-helper_server writev(2) failed");
+      if (errno == EPIPE) {
+	fprintf(stderr, "fd = %d\n", cl->fd);
+	close_client(cl);
       }
-      break;
-    } else {
-      out += ret;
-      out_len -= ret;
+      return;
+    }
+
+    written = ret;
+    while (written > 0) {
+      blk = cl->wq[cl->wq_head];
+      if (written < blk->len - cl->wq_offset) {
+	cl->wq_offset += written;
+	break;
+      }
+      written -= blk->len - cl->wq_offset;
+      dequeue_block(cl);
     }
   }
-  if (out_len == 0) {
-    free(cl->wbuf);
-    cl->wbuf = uim_strdup("");
-    FD_CLR(cl->fd, &s_fdset_write);    
-  } else {
-    uim_helper_buffer_shift(cl->wbuf, message_len - out_len);
-  }
+
+  watch_writable(cl, UIM_FALSE);
 }
 
 
@@ -315,57 +611,101 @@ read_message(struct client *cl)
 
   result = reflect_message_fragment(cl);
   
-  if (result < 0) {
-    FD_CLR(cl->fd, &s_fdset_read);
-    FD_CLR(cl->fd, &s_fdset_write);
-    if (cl->fd == s_max_fd)
-      s_max_fd--;
+  if (result < 0)
     close_client(cl);
-  }
 }
 
+static void
+process_client_event(struct client *cl, uim_bool readable, uim_bool writable)
+{
+  if (cl->fd != -1 && writable)
+    write_message(cl);
+
+  if (cl->fd != -1 && readable)
+    read_message(cl);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
 static void
 uim_helper_server_process_connection(int server_fd)
 {
-  int i;
-  fd_set readfds, writefds;
+  struct epoll_event events[MAX_EVENTS];
+  struct client *cl;
+  int i, n;
 
   while (1) {
-    /* Copy readfds from s_fdset_read/s_fdset_write because select removes
-       readble/writable fd from readfds/writefds */
-    memcpy(&readfds, &s_fdset_read, sizeof(fd_set));
-    memcpy(&writefds, &s_fdset_write, sizeof(fd_set));
-
-    /* call select(), waiting until a file descriptor became readable */
-    if (select(s_max_fd + 1, &readfds, &writefds, NULL, NULL) <= 0) {
-      perror("uim-helper_server select(2) failed");
+    n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+      if (errno == EINTR)
+	continue;
+      perror("uim-helper_server epoll_wait(2) failed");
       sleep(3);
       continue;
     }
 
-    /* for accept new connection */
-    if (FD_ISSET(server_fd, &readfds)) {
-      uim_bool accepted;
-      accepted = accept_new_connection(server_fd);
-      if (accepted == UIM_FALSE) {
-	/* acception failed, go next loop without message processing. */
+    for (i = 0; i < n; i++) {
+      cl = events[i].data.ptr;
+      if (!cl) {
+	/* for accept new connection */
+	accept_new_connection(server_fd);
 	continue;
       }
-    } else {
-      /* check data to write and from clients reached */
-      for (i = 0; i < nr_client_slots; i++) {
-	if (clients[i].fd != -1 && FD_ISSET(clients[i].fd, &writefds))
-	  write_message(&clients[i]);
+      /* errors are detected by read(2) and writev(2) */
+      process_client_event(cl,
+			   (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)),
+			   (events[i].events & EPOLLOUT));
+    }
 
-	if (clients[i].fd != -1 && FD_ISSET(clients[i].fd, &readfds))
-	  read_message(&clients[i]);
-      }
+    if (!finish_events())
+      return;
+  }
+}
+#else
+static void
+uim_helper_server_process_connection(int server_fd)
+{
+  struct client *cl;
+  int i, nfds;
+
+  while (1) {
+    if (nr_clients + 1 > pollfds_size) {
+      pollfds_size = (nr_clients + 1) * 2;
+      pollfds = uim_realloc(pollfds, sizeof(*pollfds) * pollfds_size);
+      pollfd_clients = uim_realloc(pollfd_clients,
+				   sizeof(*pollfd_clients) * pollfds_size);
+    }
+
+    pollfds[0].fd = server_fd;
+    pollfds[0].events = POLLIN;
+    pollfd_clients[0] = NULL;
+    for (nfds = 1, cl = clients; cl; cl = cl->next, nfds++) {
+      pollfds[nfds].fd = cl->fd;
+      pollfds[nfds].events = (cl->writing) ? (POLLIN | POLLOUT) : POLLIN;
+      pollfd_clients[nfds] = cl;
+    }
+
+    if (poll(pollfds, nfds, -1) <= 0) {
+      if (errno == EINTR)
+	continue;
+      perror("uim-helper_server poll(2) failed");
+      sleep(3);
+      continue;
     }
 
-    if (!check_session_alive())
+    if (pollfds[0].revents & POLLIN)
+      accept_new_connection(server_fd);
+
+    for (i = 1; i < nfds; i++) {
+      process_client_event(pollfd_clients[i],
+			   (pollfds[i].revents & (POLLIN | POLLHUP | POLLERR)),
+			   (pollfds[i].revents & POLLOUT));
+    }
+
+    if (!finish_events())
       return;
   }
 }
+#endif
 
 
 int
@@ -382,11 +722,8 @@ main(int argc, char **argv)
   unlink(path);
 
   clients = NULL;
-  nr_client_slots = 0;
+  nr_clients = 0;
 
-  FD_ZERO(&s_fdset_read);
-  FD_ZERO(&s_fdset_write);
-  s_max_fd = 0;
   server_fd = init_server_fd(path);
 
   printf("waiting\n\n");
@@ -398,6 +735,14 @@ main(int argc, char **argv)
   if (server_fd < 0)
     return 0;
 
+#ifdef HAVE_SYS_EPOLL_H
+  epoll_fd = epoll_create(MAX_EVENTS);
+  if (epoll_fd < 0 || watch_fd(server_fd, NULL) < 0) {
+    perror("failed in epoll_create()");
+    return 0;
+  }
+#endif
+
   /*  fprintf(stderr,"Waiting for connection at %s\n", path);*/
 
   signal(SIGPIPE, SIG_IGN);
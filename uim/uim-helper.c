@@ -39,6 +39,7 @@
 #include <sys/time.h>
 #include <sys/param.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <stdlib.h>
@@ -66,9 +67,11 @@
 #include "uim-notify.h"
 #endif
 
+#if !defined(MSG_NOSIGNAL) && !defined(SO_NOSIGPIPE)
 #ifndef HAVE_SIG_T
 typedef void (*sig_t)(int);
 #endif
+#endif
 
 enum RorW
   {
@@ -101,16 +104,91 @@ uim_helper_fd(int fd, enum RorW rw)
     return FD_ISSET(fd, &fds) ? 1 : 0;
 }
 
-void
-uim_helper_send_message(int fd, const char *message)
+/*
+ * Messages are sent without blocking. What the socket doesn't accept is
+ * kept in the send queue of the connection and flushed on the next send
+ * or by uim_helper_flush_messages() from the event loop. The event loop
+ * should watch the fd for writability while
+ * uim_helper_pending_messages() is true. Neither the queue nor the send
+ * path allocates memory once the queue has grown to its working size.
+ */
+#define SEND_QUEUE_MAX (64 * 1024)
+#define NR_SEND_QUEUES 4  /* a process has a few helper connections */
+
+#ifdef MSG_NOSIGNAL
+#define SEND_FLAGS (MSG_DONTWAIT | MSG_NOSIGNAL)
+#else
+/* SO_NOSIGPIPE is set by uim_helper_init_client_fd() if available */
+#define SEND_FLAGS MSG_DONTWAIT
+#endif
+
+struct send_queue {
+  int fd;
+  struct uim_helper_buf buf;  /* unsent data starts at buf.head */
+};
+
+static struct send_queue send_queues[NR_SEND_QUEUES] = {
+  { -1 }, { -1 }, { -1 }, { -1 }
+};
+
+static struct send_queue *
+find_send_queue(int fd)
 {
-  int res;
-  int out_len;
+  int i;
+
+  for (i = 0; i < NR_SEND_QUEUES; i++) {
+    if (send_queues[i].fd == fd)
+      return &send_queues[i];
+  }
+
+  return NULL;
+}
+
+/* Returns the number of bytes sent, or -1 on error. */
+static ssize_t
+send_nonblocking(int fd, struct iovec *iov, int iovcnt)
+{
+  struct msghdr mh;
+  ssize_t rc;
+#if !defined(MSG_NOSIGNAL) && !defined(SO_NOSIGPIPE)
   sig_t old_sigpipe;
-  char *buf, *bufp;
 
-  if (UIM_CATCH_ERROR_BEGIN())
-    return;
+  old_sigpipe = signal(SIGPIPE, SIG_IGN);
+#endif
+
+  memset(&mh, 0, sizeof(mh));
+  mh.msg_iov = iov;
+  mh.msg_iovlen = iovcnt;
+  do {
+    rc = sendmsg(fd, &mh, SEND_FLAGS);
+  } while (rc < 0 && errno == EINTR);
+  if (rc < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    rc = 0;
+
+#if !defined(MSG_NOSIGNAL) && !defined(SO_NOSIGPIPE)
+  signal(SIGPIPE, old_sigpipe);
+#endif
+
+  return rc;
+}
+
+/* q is the queue of fd or a free one */
+static void
+enqueue_message(struct send_queue *q, int fd, const char *msg, size_t len,
+		size_t sent)
+{
+  q->fd = fd;
+  uim_helper_buf_append(&q->buf, msg + sent, len - sent);
+  uim_helper_buf_append(&q->buf, "\n", 1);
+}
+
+void
+uim_helper_send_message(int fd, const char *message)
+{
+  struct send_queue *q;
+  struct iovec iov[2];
+  size_t len;
+  ssize_t rc;
 
 #if 0
   if (fd < 0)
@@ -123,29 +201,118 @@ uim_helper_send_message(int fd, const char *message)
     return;
 #endif
 
-  uim_asprintf(&buf, "%s\n", message);
-
-  old_sigpipe = signal(SIGPIPE, SIG_IGN);
+  if (UIM_CATCH_ERROR_BEGIN())
+    return;
 
-  out_len = strlen(buf);
-  bufp = buf;
-  while (out_len > 0) {
-    if ((res = write(fd, bufp, out_len)) < 0) {
-      if (errno == EAGAIN || errno == EINTR)
-	continue;
+  len = strlen(message);
+
+  /* keep the order of the messages */
+  if (uim_helper_flush_messages(fd) > 0) {
+    q = find_send_queue(fd);
+    if (q->buf.len - q->buf.head + len + 1 <= SEND_QUEUE_MAX)
+      enqueue_message(q, fd, message, len, 0);
+    else
+      fprintf(stderr, "uim_helper_send_message(): queue is full\n");
+  } else if (!(q = find_send_queue(-1))) {
+    /* don't send a part of the message which can't be queued */
+    fprintf(stderr, "uim_helper_send_message(): too many connections\n");
+  } else {
+    iov[0].iov_base = (char *)message;
+    iov[0].iov_len = len;
+    iov[1].iov_base = (char *)"\n";
+    iov[1].iov_len = 1;
+    rc = send_nonblocking(fd, iov, 2);
+    if (rc < 0)
       perror("uim_helper_send_message(): unhandled error");
+    else if ((size_t)rc < len + 1)
+      enqueue_message(q, fd, message, len, rc);
+  }
+
+  UIM_CATCH_ERROR_END();
+}
+
+/* Returns 1 if data is still queued, 0 if the queue is empty, or -1
+ * on error. */
+int
+uim_helper_flush_messages(int fd)
+{
+  struct send_queue *q;
+  struct iovec iov;
+  ssize_t rc;
+
+  if (fd < 0 || !(q = find_send_queue(fd)))
+    return 0;
+
+  iov.iov_base = &q->buf.str[q->buf.head];
+  iov.iov_len = q->buf.len - q->buf.head;
+  rc = send_nonblocking(fd, &iov, 1);
+  if (rc < 0) {
+    uim_helper_discard_messages(fd);
+    return -1;
+  }
+  q->buf.head += rc;
+  if (q->buf.head < q->buf.len)
+    return 1;
+
+  q->fd = -1;
+  q->buf.head = q->buf.len = q->buf.scanned = 0;
+
+  return 0;
+}
+
+/* Returns 1 if data for fd is waiting in the send queue. */
+int
+uim_helper_pending_messages(int fd)
+{
+  return (fd >= 0 && find_send_queue(fd)) ? 1 : 0;
+}
+
+/* Flushes the queue waiting for at most timeout_msec milliseconds.
+ * Returns as uim_helper_flush_messages(). */
+int
+uim_helper_drain_messages(int fd, int timeout_msec)
+{
+  struct timeval deadline, now, tv;
+  fd_set fds;
+  long remaining;
+  int rc;
+
+  gettimeofday(&deadline, NULL);
+  deadline.tv_sec += timeout_msec / 1000;
+  deadline.tv_usec += (timeout_msec % 1000) * 1000;
+  if (deadline.tv_usec >= 1000000) {
+    deadline.tv_sec++;
+    deadline.tv_usec -= 1000000;
+  }
+
+  while ((rc = uim_helper_flush_messages(fd)) > 0) {
+    gettimeofday(&now, NULL);
+    remaining = (long)(deadline.tv_sec - now.tv_sec) * 1000000
+		+ (deadline.tv_usec - now.tv_usec);
+    if (remaining <= 0)
       break;
-    }
 
-    bufp += res;
-    out_len -= res;
+    FD_ZERO(&fds);
+    FD_SET(fd, &fds);
+    tv.tv_sec = remaining / 1000000;
+    tv.tv_usec = remaining % 1000000;
+    if (select(fd + 1, NULL, &fds, NULL, &tv) < 0 && errno != EINTR)
+      break;
   }
-  free(buf);
-  signal(SIGPIPE, old_sigpipe);
 
-  UIM_CATCH_ERROR_END();
+  return rc;
+}
 
-  return;
+void
+uim_helper_discard_messages(int fd)
+{
+  struct send_queue *q;
+
+  if (fd < 0 || !(q = find_send_queue(fd)))
+    return;
+
+  q->fd = -1;
+  q->buf.head = q->buf.len = q->buf.scanned = 0;
 }
 
 static uim_bool
@@ -279,6 +446,363 @@ int uim_helper_str_terminated(const char *str)
   return 0;
 }
 
+/*
+ * A uim_helper_buf keeps the length and the read position of the
+ * received data, and the position where the search for the "\n\n"
+ * delimiter has stopped. Each byte is therefore copied and scanned once
+ * regardless of how the messages are fragmented. Consumed messages are
+ * dropped from the front only when the buffer has to grow.
+ */
+void
+uim_helper_buf_init(struct uim_helper_buf *buf)
+{
+  memset(buf, 0, sizeof(*buf));
+}
+
+void
+uim_helper_buf_release(struct uim_helper_buf *buf)
+{
+  free(buf->str);
+  uim_helper_buf_init(buf);
+}
+
+void
+uim_helper_buf_append(struct uim_helper_buf *buf,
+		      const char *fragment, size_t fragment_size)
+{
+  size_t rest;
+
+  if (buf->head == buf->len) {
+    buf->head = buf->len = buf->scanned = 0;
+  } else if (buf->len + fragment_size + 1 > buf->size && buf->head > 0) {
+    rest = buf->len - buf->head;
+    memmove(buf->str, &buf->str[buf->head], rest);
+    buf->scanned -= buf->head;
+    buf->head = 0;
+    buf->len = rest;
+  }
+
+  if (buf->len + fragment_size + 1 > buf->size) {
+    buf->size = (buf->size) ? buf->size * 2 : 1024;
+    if (buf->size < buf->len + fragment_size + 1)
+      buf->size = buf->len + fragment_size + 1;
+    buf->str = uim_realloc(buf->str, buf->size);
+  }
+
+  memcpy(&buf->str[buf->len], fragment, fragment_size);
+  buf->len += fragment_size;
+  buf->str[buf->len] = '\0';
+}
+
+static size_t
+get_u32(const char *p)
+{
+  const unsigned char *u = (const unsigned char *)p;
+
+  return ((size_t)u[0] << 24) | ((size_t)u[1] << 16) |
+    ((size_t)u[2] << 8) | (size_t)u[3];
+}
+
+static void
+put_u32(char *p, size_t v)
+{
+  p[0] = (char)((v >> 24) & 0xff);
+  p[1] = (char)((v >> 16) & 0xff);
+  p[2] = (char)((v >> 8) & 0xff);
+  p[3] = (char)(v & 0xff);
+}
+
+/* Returns the next message without copying it, or NULL if no message
+ * is complete. A text message includes its delimiter, and a frame
+ * includes its header. The message is valid until the next call of
+ * uim_helper_buf_append(). */
+const char *
+uim_helper_buf_next_message(struct uim_helper_buf *buf, size_t *len)
+{
+  const char *msg, *p, *end;
+  size_t payload;
+
+  if (!buf->str)
+    return NULL;
+
+  /* the '\0' sent by the server for LOCAL_CREDS */
+  while (buf->head < buf->len && buf->str[buf->head] == '\0')
+    buf->head++;
+
+  if (buf->head < buf->len && uim_helper_is_frame(&buf->str[buf->head])) {
+    if (buf->len - buf->head < UIM_HELPER_FRAME_HEADER_SIZE)
+      return NULL;
+    msg = &buf->str[buf->head];
+    payload = get_u32(&msg[4]);
+    if (msg[1] != UIM_HELPER_FRAME_VERSION
+	|| payload > UIM_HELPER_FRAME_MAX_PAYLOAD) {
+      /* the stream can't be resynchronized */
+      buf->head = buf->scanned = buf->len;
+      return NULL;
+    }
+    if (buf->len - buf->head < UIM_HELPER_FRAME_HEADER_SIZE + payload)
+      return NULL;
+    *len = UIM_HELPER_FRAME_HEADER_SIZE + payload;
+    buf->head = buf->scanned = buf->head + *len;
+    return msg;
+  }
+
+  if (buf->scanned < buf->head)
+    buf->scanned = buf->head;
+
+  end = &buf->str[buf->len];
+  for (p = &buf->str[buf->scanned];
+       p < end && (p = memchr(p, '\n', end - p));
+       p++)
+  {
+    if (p + 1 == end)
+      break;
+    if (p[1] == '\n') {
+      msg = &buf->str[buf->head];
+      *len = p + 2 - msg;
+      buf->head = buf->scanned = p + 2 - buf->str;
+      return msg;
+    }
+  }
+
+  /* a trailing '\n' may be the first half of the delimiter */
+  buf->scanned = (buf->len > buf->head) ? buf->len - 1 : buf->head;
+
+  return NULL;
+}
+
+char *
+uim_helper_buf_get_message(struct uim_helper_buf *buf)
+{
+  const char *msg;
+  char *ret;
+  size_t len;
+
+  if (UIM_CATCH_ERROR_BEGIN())
+    return NULL;
+
+  msg = uim_helper_buf_next_message(buf, &len);
+  if (msg && uim_helper_is_frame(msg)) {
+    struct uim_helper_buf text;
+
+    uim_helper_buf_init(&text);
+    uim_helper_frame_to_text(&text, msg, len);
+    ret = text.str;
+  } else if (msg) {
+    ret = uim_malloc(len + 1);
+    memcpy(ret, msg, len);
+    ret[len] = '\0';
+  } else {
+    ret = NULL;
+  }
+
+  UIM_CATCH_ERROR_END();
+
+  return ret;
+}
+
+static const char *const msg_type_names[] = {
+  NULL,
+  "focus_in",
+  "focus_out",
+  "prop_activate",
+  "prop_list_get",
+  "prop_list_update",
+  "im_list",
+  "im_list_get",
+  "im_change_this_text_area_only",
+  "im_change_whole_desktop",
+  "im_change_this_application_only",
+  "prop_update_custom",
+  "custom_reload_notify",
+  "commit_string",
+  "im_switcher_start",
+  "im_switcher_quit",
+  "protocol_version",
+  "subscribe"
+};
+
+int
+uim_helper_msg_type(const char *command, size_t len)
+{
+  int i;
+
+  for (i = UHelperMsg_Unknown + 1; i < UHelperMsg_Last; i++) {
+    if (strlen(msg_type_names[i]) == len
+	&& memcmp(msg_type_names[i], command, len) == 0)
+      return i;
+  }
+
+  return UHelperMsg_Unknown;
+}
+
+const char *
+uim_helper_msg_type_name(int type)
+{
+  if (type <= UHelperMsg_Unknown || type >= UHelperMsg_Last)
+    return NULL;
+
+  return msg_type_names[type];
+}
+
+/* 0xff is not used in UTF-8 nor in EUC-JP, so a text message never
+ * starts with it. '\0' is not used for the mark since the server sends
+ * it on connection for LOCAL_CREDS. */
+int
+uim_helper_is_frame(const char *msg)
+{
+  return ((unsigned char)msg[0] == UIM_HELPER_FRAME_MARK);
+}
+
+/* Reads a string of a frame payload at *p and advances *p over it. */
+static int
+frame_next_string(const char **p, const char *end, const char **str,
+		  size_t *len)
+{
+  if (end - *p < 4)
+    return 0;
+  *len = get_u32(*p);
+  if ((size_t)(end - *p) - 4 < *len + 1 || (*p)[4 + *len] != '\0')
+    return 0;
+  *str = *p + 4;
+  *p += 4 + *len + 1;
+
+  return 1;
+}
+
+static void
+frame_append_string(struct uim_helper_buf *out, const char *str, size_t len)
+{
+  char prefix[4];
+
+  put_u32(prefix, len);
+  uim_helper_buf_append(out, prefix, sizeof(prefix));
+  uim_helper_buf_append(out, str, len);
+  uim_helper_buf_append(out, "", 1);
+}
+
+/* Each line of a text message up to the delimiter becomes a string of
+ * the frame. out is cleared first. */
+void
+uim_helper_frame_encode(struct uim_helper_buf *out,
+			const char *msg, size_t len)
+{
+  const char *line, *nl, *end;
+  char header[UIM_HELPER_FRAME_HEADER_SIZE];
+  int type;
+
+  out->head = out->len = out->scanned = 0;
+  memset(header, 0, sizeof(header));
+  uim_helper_buf_append(out, header, sizeof(header));
+
+  type = UHelperMsg_Unknown;
+  end = msg + len;
+  for (line = msg; line < end; line = nl + 1) {
+    if (!(nl = memchr(line, '\n', end - line)))
+      nl = end;
+    if (line == msg)
+      type = uim_helper_msg_type(line, nl - line);
+    else if (nl == line)
+      break;
+    frame_append_string(out, line, nl - line);
+  }
+
+  out->str[0] = (char)UIM_HELPER_FRAME_MARK;
+  out->str[1] = UIM_HELPER_FRAME_VERSION;
+  out->str[2] = (char)((type >> 8) & 0xff);
+  out->str[3] = (char)(type & 0xff);
+  put_u32(&out->str[4], out->len - UIM_HELPER_FRAME_HEADER_SIZE);
+}
+
+/* out is cleared first. */
+void
+uim_helper_frame_to_text(struct uim_helper_buf *out,
+			 const char *frame, size_t len)
+{
+  const char *p, *end, *str;
+  size_t str_len;
+
+  out->head = out->len = out->scanned = 0;
+
+  p = frame + UIM_HELPER_FRAME_HEADER_SIZE;
+  end = frame + len;
+  while (frame_next_string(&p, end, &str, &str_len)) {
+    uim_helper_buf_append(out, str, str_len);
+    uim_helper_buf_append(out, "\n", 1);
+  }
+  uim_helper_buf_append(out, "\n", 1);
+}
+
+static void
+frame_add_field(struct uim_helper_frame *frame, const char *field)
+{
+  if (frame->nr_fields == frame->fields_size) {
+    frame->fields_size = (frame->fields_size) ? frame->fields_size * 2 : 16;
+    frame->fields = uim_realloc(frame->fields,
+				sizeof(*frame->fields) * frame->fields_size);
+  }
+  frame->fields[frame->nr_fields++] = field;
+}
+
+/* Text messages are split into the fields in place since they have
+ * already been consumed. */
+int
+uim_helper_buf_get_frame(struct uim_helper_buf *buf,
+			 struct uim_helper_frame *frame)
+{
+  const char *msg, *p, *end, *str;
+  char *line, *nl;
+  size_t len, str_len;
+  int ret;
+
+  if (UIM_CATCH_ERROR_BEGIN())
+    return 0;
+
+  ret = 0;
+  msg = uim_helper_buf_next_message(buf, &len);
+  if (msg) {
+    frame->command = "";
+    frame->nr_fields = 0;
+    if (uim_helper_is_frame(msg)) {
+      frame->type = ((unsigned char)msg[2] << 8) | (unsigned char)msg[3];
+      if (frame->type >= UHelperMsg_Last)
+	frame->type = UHelperMsg_Unknown;
+      p = msg + UIM_HELPER_FRAME_HEADER_SIZE;
+      end = msg + len;
+      if (frame_next_string(&p, end, &str, &str_len))
+	frame->command = str;
+      while (frame_next_string(&p, end, &str, &str_len))
+	frame_add_field(frame, str);
+    } else {
+      /* bounded by the length since a relayed message may contain
+	 '\0'. the "\n\n" at the end terminates the loop */
+      line = &buf->str[msg - buf->str];
+      end = msg + len;
+      nl = memchr(line, '\n', end - line);
+      *nl = '\0';
+      frame->type = uim_helper_msg_type(line, nl - line);
+      frame->command = line;
+      for (line = nl + 1; *line != '\n'; line = nl + 1) {
+	nl = memchr(line, '\n', end - line);
+	*nl = '\0';
+	frame_add_field(frame, line);
+      }
+    }
+    ret = 1;
+  }
+
+  UIM_CATCH_ERROR_END();
+
+  return ret;
+}
+
+void
+uim_helper_frame_release(struct uim_helper_frame *frame)
+{
+  free(frame->fields);
+  memset(frame, 0, sizeof(*frame));
+}
+
 char *
 uim_helper_buffer_append(char *buf, const char *fragment, size_t fragment_size)
 {
@@ -306,7 +830,7 @@ uim_helper_buffer_shift(char *buf, int count)
 char *
 uim_helper_buffer_get_message(char *buf)
 {
-  size_t msg_size;
+  size_t msg_size, len;
   char *msg, *msg_term;
 
   if (UIM_CATCH_ERROR_BEGIN())
@@ -321,7 +845,9 @@ uim_helper_buffer_get_message(char *buf)
     msg = uim_malloc(msg_size + 1);
     memcpy(msg, buf, msg_size);
     msg[msg_size] = '\0';
-    uim_helper_buffer_shift(buf, msg_size);
+    /* the rest is measured from msg_term since strstr() stopped there */
+    len = msg_size + strlen(msg_term + 2);
+    memmove(buf, &buf[msg_size], len - msg_size + 1);
   } else {
     msg = NULL;
   }
@@ -47,6 +47,64 @@ void uim_helper_client_get_prop_list(void);
 void uim_helper_read_proc(int fd);
 char *uim_helper_get_message(void);
 void uim_helper_send_message(int fd, const char *message);
+int uim_helper_flush_messages(int fd);
+int uim_helper_pending_messages(int fd);
+
+/*
+ * Framed protocol. See doc/HELPER-PROTOCOL for the wire format.
+ *
+ * uim_helper_get_frame() returns the next message as pre-parsed fields
+ * regardless of whether it has been received as a frame or as a text
+ * message. Call uim_helper_client_request_frames() after connecting to
+ * make the server send frames to this process.
+ *
+ * uim_helper_client_subscribe() makes the server deliver only the
+ * messages of the given types to this process. Without it, all
+ * messages are delivered.
+ */
+enum UHelperMsgType {
+  UHelperMsg_Unknown = 0,
+  UHelperMsg_FocusIn,
+  UHelperMsg_FocusOut,
+  UHelperMsg_PropActivate,
+  UHelperMsg_PropListGet,
+  UHelperMsg_PropListUpdate,
+  UHelperMsg_ImList,
+  UHelperMsg_ImListGet,
+  UHelperMsg_ImChangeThisTextAreaOnly,
+  UHelperMsg_ImChangeWholeDesktop,
+  UHelperMsg_ImChangeThisApplicationOnly,
+  UHelperMsg_PropUpdateCustom,
+  UHelperMsg_CustomReloadNotify,
+  UHelperMsg_CommitString,
+  UHelperMsg_ImSwitcherStart,
+  UHelperMsg_ImSwitcherQuit,
+  UHelperMsg_ProtocolVersion,
+  UHelperMsg_Subscribe,
+
+  UHelperMsg_Last  /* must be the last */
+};
+
+#define UIM_HELPER_FRAME_MARK    0xff
+#define UIM_HELPER_FRAME_VERSION 1
+#define UIM_HELPER_FRAME_VERSION_STR "1"
+#define UIM_HELPER_FRAME_HEADER_SIZE 8
+#define UIM_HELPER_FRAME_MAX_PAYLOAD (16 * 1024 * 1024)
+
+/* A zero-filled one is empty. The strings point into the receive
+ * buffer and are valid until the next read. */
+struct uim_helper_frame {
+  int type;              /* enum UHelperMsgType */
+  const char *command;   /* the first line of the text message */
+  int nr_fields;
+  const char **fields;   /* the following lines without the "\n" */
+  int fields_size;       /* allocated size of fields */
+};
+
+void uim_helper_client_request_frames(void);
+void uim_helper_client_subscribe(const int *types, int nr_types);
+int uim_helper_get_frame(struct uim_helper_frame *frame);
+void uim_helper_frame_release(struct uim_helper_frame *frame);
 
 /* functions for libuim server/client's implementation */
 uim_bool uim_helper_get_pathname(char *, int);
@@ -54,6 +112,37 @@ int uim_helper_str_terminated(const char *str);
 int uim_helper_check_connection_fd(int fd);
 int uim_helper_fd_readable(int fd);
 int uim_helper_fd_writable(int fd);
+int uim_helper_drain_messages(int fd, int timeout_msec);
+void uim_helper_discard_messages(int fd);
+
+/* Buffer of received helper messages. A zero-filled one is empty. */
+struct uim_helper_buf {
+  char *str;
+  size_t len;      /* bytes held in str */
+  size_t size;     /* allocated size of str */
+  size_t head;     /* start of the first unread message */
+  size_t scanned;  /* no delimiter starts in [head, scanned) */
+};
+
+void uim_helper_buf_init(struct uim_helper_buf *buf);
+void uim_helper_buf_release(struct uim_helper_buf *buf);
+void uim_helper_buf_append(struct uim_helper_buf *buf,
+			   const char *fragment, size_t fragment_size);
+const char *uim_helper_buf_next_message(struct uim_helper_buf *buf,
+					size_t *len);
+char *uim_helper_buf_get_message(struct uim_helper_buf *buf);
+int uim_helper_buf_get_frame(struct uim_helper_buf *buf,
+			     struct uim_helper_frame *frame);
+
+int uim_helper_msg_type(const char *command, size_t len);
+const char *uim_helper_msg_type_name(int type);
+int uim_helper_is_frame(const char *msg);
+void uim_helper_frame_encode(struct uim_helper_buf *out,
+			     const char *msg, size_t len);
+void uim_helper_frame_to_text(struct uim_helper_buf *out,
+			      const char *frame, size_t len);
+
+/* compatibility API for NUL-terminated buffers */
 char *uim_helper_buffer_append(char *buf,
 			       const char *fragment, size_t fragment_size);
 void uim_helper_buffer_shift(char *buf, int count);
@@ -41,6 +41,7 @@ extern "C" {
 #endif
 
 void uim_init_iconv_subrs(void);
+void uim_quit_iconv(void);
 
 #ifdef __cplusplus
 }
@@ -67,6 +67,8 @@ struct uim_candidate_ {
   char *str;         /* candidate */
   char *heading_label;
   char *annotation;
+  /* next in the bucket of malloc'ed candidates, see uim.c */
+  struct uim_candidate_ *heap_next;
   /* uim_pos part_of_speech; */
   /* int freq; */
   /* int freshness; */
@@ -74,10 +76,25 @@ struct uim_candidate_ {
   /* char *src_dict; */
 };
 
+/* preedit being built or delivered as a snapshot */
+struct uim_preedit_buf_ {
+  char *str;
+  size_t len;
+  size_t size;
+  struct uim_preedit_segment *segs;
+  int nr_segs;
+  int segs_size;
+};
+
 struct uim_context_ {
   uim_lisp sc;  /* Scheme-side context */
   void *ptr;    /* 1st callback argument */
 
+  /* lazy instantiation of the Scheme-side context */
+  uim_bool materialized;
+  char *lang;
+  char *engine;
+
   /* encoding handlings */
   char *client_encoding;
   struct uim_code_converter *conv_if;
@@ -103,12 +120,28 @@ struct uim_context_ {
   void (*preedit_clear_cb)(void *ptr);
   void (*preedit_pushback_cb)(void *ptr, int attr, const char *str);
   void (*preedit_update_cb)(void *ptr);
+  void (*preedit_snapshot_cb)(void *ptr,
+                              const struct uim_preedit_snapshot *snapshot);
+  struct uim_preedit_buf_ preedit[2];  /* building one and the last one */
+  int preedit_building;
+  uim_bool preedit_inherit;  /* building one continues the last one */
+  unsigned int preedit_generation;
+  /* key events are being processed by uim_press_keys() */
+  uim_bool batching;
+  uim_bool preedit_update_pending;
+  uim_bool select_pending;
+  int pending_select;
   /* candidate selector */
   void (*candidate_selector_activate_cb)(void *ptr, int nr, int index);
   void (*candidate_selector_select_cb)(void *ptr, int index);
   void (*candidate_selector_shift_page_cb)(void *ptr, int direction);
   void (*candidate_selector_deactivate_cb)(void *ptr);
   void (*candidate_selector_delay_activate_cb)(void *ptr, int delay);
+  /* storage of candidates given to the candidate selector */
+  struct uim_cand_chunk_ *cand_arena;
+  size_t cand_arena_size;
+  struct uim_cand_chunk_ *cand_arena_retired;  /* of the previous list */
+  struct uim_cand_chunk_ *cand_arena_spare;
   /* text acquisition */
   int (*acquire_text_cb)(void *ptr,
                          enum UTextArea text_id, enum UTextOrigin origin,
@@ -131,6 +164,9 @@ struct uim_context_ {
   void (*switch_system_global_im_cb)(void *ptr, const char *name);
 };
 
+/* whether strings need no conversion by conv of the context */
+#define UIM_CONV_IDENTITYP(uc, conv) (!(conv) && (uc)->conv_if == uim_iconv)
+
 void uim_init_error(void);
 #if UIM_USE_ERROR_GUARD
 /* internal functions: don't call directly */
@@ -163,6 +199,13 @@ void uim_init_util_subrs(void);
 void uim_init_notify_subrs(void);
 
 void uim_init_rk_subrs(void);
+void uim_quit_rk(void);
+void uim_add_sigusr2_func(void (*func)(void));
+void uim_remove_sigusr2_func(void (*func)(void));
+void uim_init_load_profile(void);
+void uim_quit_load_profile(void);
+int  uim_load_profile_enter(const char *kind, const char *name);
+void uim_load_profile_leave(int depth);
 void uim_init_intl_subrs(void);
 
 #if UIM_USE_NOTIFY_PLUGINS
@@ -173,6 +216,11 @@ uim_bool uim_notify_fatal(const char *msg_fmt, ...);
 #endif
 
 void uim_set_encoding(uim_context uc, const char *enc);
+void uim_retire_cand_arena(uim_context uc);
+void uim_release_cand_arena(uim_context uc);
+void uim_reset_cand_arena(uim_context uc);
+void uim_end_key_batch(uim_context uc);
+void uim_materialize_context(uim_context uc);
 #if HAVE_ISSETUGID
 #define uim_issetugid() issetugid()
 #else
@@ -31,6 +31,8 @@
 
 */
 
+#include <config.h>
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -40,6 +42,7 @@
 #include "uim-scm.h"
 #include "uim-scm-abbrev.h"
 #include "uim-internal.h"
+#include "uim-trace.h"
 
 
 /* Future version of uim should have uim_filter_key() that returns 'filtered'
@@ -277,13 +280,42 @@ static struct key_entry key_tab[] = {
   {0, 0}
 };
 
+/*
+ * Direct index from key codes to pre-interned symbols. The table is
+ * split into pages of KEY_SYM_PAGE_SIZE codes indexed by the upper bits
+ * of the key, and only the few pages containing special keys are
+ * allocated. A page entry holds an index into key_sym_vals plus one, or
+ * 0 for keys without a symbol.
+ */
+#define KEY_SYM_PAGE_BITS 8
+#define KEY_SYM_PAGE_SIZE (1 << KEY_SYM_PAGE_BITS)
+#define KEY_SYM_NR_PAGES  (UKey_Other >> KEY_SYM_PAGE_BITS)
+
+static unsigned short *key_sym_pages[KEY_SYM_NR_PAGES];
+static uim_lisp *key_sym_vals;
+static uim_lisp key_syms;  /* keeps the symbols of key_sym_vals alive */
+
 static uim_lisp protected;
+static uim_lisp key_press_handler, key_release_handler;
+
+/* translator flags of a key matcher entry */
+#define KEY_TRANSLATOR_IGNORE_CASE          1
+#define KEY_TRANSLATOR_IGNORE_SHIFT         2
+#define KEY_TRANSLATOR_IGNORE_REGULAR_SHIFT 4
 
+static void init_key_syms(void);
 static void define_valid_key_symbols(void);
-static const char *get_sym(int key);
+static uim_bool get_key_sym(int key, uim_lisp *sym);
 static uim_bool filter_key(uim_context uc,
                            int key, int state, uim_bool is_press);
 static int emergency_key_p(int key, int state);
+struct uim_press_keys_args {
+  uim_context uc;
+  struct uim_key_event *events;
+  int nr_events;
+  int done;
+};
+static void *uim_press_keys_internal(struct uim_press_keys_args *args);
 
 #if 0
 int uim_key_sym_to_int(uim_lisp sym);
@@ -305,31 +337,59 @@ uim_key_sym_to_int(uim_lisp sym_)
 #endif
 
 static void
-define_valid_key_symbols(void)
+init_key_syms(void)
 {
-  int i;
-  uim_lisp valid_key_symbols;
+  int i, nr;
+  unsigned short **page;
+  uim_lisp sym;
 
-  valid_key_symbols = uim_scm_null();
-  for (i = 0; key_tab[i].key; i++) {
-    valid_key_symbols = CONS(MAKE_SYM(key_tab[i].str), valid_key_symbols);
+  for (i = 0; i < KEY_SYM_NR_PAGES; i++) {
+    free(key_sym_pages[i]);
+    key_sym_pages[i] = NULL;
+  }
+  free(key_sym_vals);
+
+  for (nr = 0; key_tab[nr].key; nr++)
+    ;
+  key_sym_vals = uim_malloc(sizeof(uim_lisp) * nr);
+
+  key_syms = uim_scm_null();
+  for (i = 0; i < nr; i++) {
+    sym = MAKE_SYM(key_tab[i].str);
+    key_syms = CONS(sym, key_syms);
+    key_sym_vals[i] = sym;
+
+    page = &key_sym_pages[key_tab[i].key >> KEY_SYM_PAGE_BITS];
+    if (!*page)
+      *page = uim_calloc(KEY_SYM_PAGE_SIZE, sizeof(unsigned short));
+    /* the first entry of a duplicated key wins as get_sym() did */
+    if (!(*page)[key_tab[i].key & (KEY_SYM_PAGE_SIZE - 1)])
+      (*page)[key_tab[i].key & (KEY_SYM_PAGE_SIZE - 1)] = i + 1;
   }
+}
+
+static void
+define_valid_key_symbols(void)
+{
   uim_scm_eval(LIST3(MAKE_SYM("define"),
 		     MAKE_SYM("valid-key-symbols"),
-		     QUOTE(valid_key_symbols)));
+		     QUOTE(key_syms)));
 }
 
-static const char *
-get_sym(int key)
+static uim_bool
+get_key_sym(int key, uim_lisp *sym)
 {
-  int i;
+  const unsigned short *page;
+  unsigned short i;
 
-  for (i = 0; key_tab[i].key; i++) {
-    if (key_tab[i].key == key)
-      return key_tab[i].str;
-  }
+  if (key < 0 || key >= UKey_Other)
+    return UIM_FALSE;
+  page = key_sym_pages[key >> KEY_SYM_PAGE_BITS];
+  if (!page || !(i = page[key & (KEY_SYM_PAGE_SIZE - 1)]))
+    return UIM_FALSE;
 
-  return NULL;
+  *sym = key_sym_vals[i - 1];
+  return UIM_TRUE;
 }
 
 /* FIXME: Replace 'protected' variable with stack protection */
@@ -337,7 +397,7 @@ static uim_bool
 filter_key(uim_context uc, int key, int state, uim_bool is_press)
 {
   uim_lisp key_, filtered;
-  const char *sym, *handler;
+  long trace_start;
 
   if (!uc)
     return UIM_FALSE;
@@ -352,11 +412,13 @@ filter_key(uim_context uc, int key, int state, uim_bool is_press)
   if (!uc->is_enabled)
     return UIM_FALSE;
 
+  uim_materialize_context(uc);
+
   if (ISASCII(key)) {
     protected = key_ = MAKE_INT(key);
   }
-  else if (sym = get_sym(key)) {
-    protected = key_ = MAKE_SYM(get_sym(key));
+  else if (get_key_sym(key, &key_)) {
+    protected = key_;
   }
   else if (ISLATIN1(key)) {
     protected = key_ = MAKE_INT(key);
@@ -364,11 +426,80 @@ filter_key(uim_context uc, int key, int state, uim_bool is_press)
   else
     return UIM_FALSE;
 
-  handler = (is_press) ? "key-press-handler" : "key-release-handler";
-  filtered = uim_scm_callf(handler, "poi", uc, key_, state);
+  UIM_TRACE_BEGIN(key_handler, key, trace_start);
+  filtered = uim_scm_call_poi((is_press) ? key_press_handler
+			      : key_release_handler, uc, key_, state);
+  UIM_TRACE_END(key_handler, key, trace_start);
   return C_BOOL(filtered);
 }
 
+/*
+ * A key matcher is a vector of compiled key strings
+ *
+ *   #(key0 state0 translators0 key1 state1 translators1 ...)
+ *
+ * built by make-key-predicate in key.scm. key is a character code or a
+ * key symbol and state is the modifier mask, both after applying the
+ * translators. The incoming key is translated in the same way before
+ * comparison, so the result is equal to the predicates composed in
+ * Scheme.
+ */
+static uim_lisp
+key_matcher_matchp(uim_lisp matcher_, uim_lisp key_, uim_lisp state_)
+{
+  long i, len, code, state, target_state;
+  long translated_code, translated_state;
+  int translators;
+  uim_bool symp;
+  uim_lisp target_key;
+
+  if (INTP(key_)) {
+    code = C_INT(key_);
+    symp = UIM_FALSE;
+  } else if (SYMP(key_)) {
+    code = 0;
+    symp = UIM_TRUE;
+  } else {
+    return uim_scm_f();
+  }
+  if (!INTP(state_))
+    return uim_scm_f();
+  state = C_INT(state_);
+
+  len = uim_scm_vector_length(matcher_);
+  for (i = 0; i + 2 < len; i += 3) {
+    target_key = VECTOR_REF(matcher_, i);
+    target_state = C_INT(VECTOR_REF(matcher_, i + 1));
+    translators = C_INT(VECTOR_REF(matcher_, i + 2));
+
+    translated_code = code;
+    translated_state = state;
+    if (!symp) {
+      /* ichar-downcase and ichar-graphic? */
+      if ((translators & KEY_TRANSLATOR_IGNORE_CASE)
+	  && 'A' <= code && code <= 'Z')
+	translated_code = code + ('a' - 'A');
+      if ((translators & KEY_TRANSLATOR_IGNORE_REGULAR_SHIFT)
+	  && '!' <= code && code <= '~')
+	translated_state &= ~UMod_Shift;
+    }
+    if (translators & KEY_TRANSLATOR_IGNORE_SHIFT)
+      translated_state &= ~UMod_Shift;
+
+    if (translated_state != target_state)
+      continue;
+    if (symp) {
+      if (EQ(target_key, key_))
+	return uim_scm_t();
+    } else {
+      if (INTP(target_key) && C_INT(target_key) == translated_code)
+	return uim_scm_t();
+    }
+  }
+
+  return uim_scm_f();
+}
+
 static int
 emergency_key_p(int key, int state)
 {
@@ -383,6 +514,7 @@ int
 uim_press_key(uim_context uc, int key, int state)
 {
   uim_bool filtered;
+  long trace_start;
 
   if (UIM_CATCH_ERROR_BEGIN())
     return PASSTHROUGH;
@@ -392,7 +524,9 @@ uim_press_key(uim_context uc, int key, int state)
   assert(key >= 0);
   assert(state >= 0);
 
+  UIM_TRACE_BEGIN(key_press, key, trace_start);
   filtered = filter_key(uc, key, state, UIM_TRUE);
+  UIM_TRACE_END(key_press, key, trace_start);
 
   UIM_CATCH_ERROR_END();
 
@@ -403,6 +537,7 @@ int
 uim_release_key(uim_context uc, int key, int state)
 {
   uim_bool filtered;
+  long trace_start;
 
   if (UIM_CATCH_ERROR_BEGIN())
     return PASSTHROUGH;
@@ -412,18 +547,85 @@ uim_release_key(uim_context uc, int key, int state)
   assert(key >= 0);
   assert(state >= 0);
 
+  UIM_TRACE_BEGIN(key_release, key, trace_start);
   filtered = filter_key(uc, key, state, UIM_FALSE);
+  UIM_TRACE_END(key_release, key, trace_start);
 
   UIM_CATCH_ERROR_END();
 
   return (filtered) ? FILTERED : PASSTHROUGH;
 }
 
+int
+uim_press_keys(uim_context uc, struct uim_key_event *events, int nr_events)
+{
+  struct uim_press_keys_args args;
+
+  if (UIM_CATCH_ERROR_BEGIN()) {
+    uim_end_key_batch(uc);
+    return 0;
+  }
+
+  assert(uim_scm_gc_any_contextp());
+  assert(uc);
+  assert(events || !nr_events);
+  assert(nr_events >= 0);
+
+  args.uc = uc;
+  args.events = events;
+  args.nr_events = nr_events;
+  args.done = 0;
+
+  uc->batching = UIM_TRUE;
+  uim_scm_call_with_gc_ready_stack((uim_gc_gate_func_ptr)uim_press_keys_internal, &args);
+  uim_end_key_batch(uc);
+
+  UIM_CATCH_ERROR_END();
+
+  return args.done;
+}
+
+static void *
+uim_press_keys_internal(struct uim_press_keys_args *args)
+{
+  struct uim_key_event *ev;
+  uim_bool filtered;
+  long trace_start;
+
+  while (args->done < args->nr_events) {
+    ev = &args->events[args->done++];
+    assert(ev->key >= 0);
+    assert(ev->state >= 0);
+
+    if (ev->release) {
+      UIM_TRACE_BEGIN(key_release, ev->key, trace_start);
+      filtered = filter_key(args->uc, ev->key, ev->state, UIM_FALSE);
+      UIM_TRACE_END(key_release, ev->key, trace_start);
+    } else {
+      UIM_TRACE_BEGIN(key_press, ev->key, trace_start);
+      filtered = filter_key(args->uc, ev->key, ev->state, UIM_TRUE);
+      UIM_TRACE_END(key_press, ev->key, trace_start);
+    }
+    ev->result = (filtered) ? FILTERED : PASSTHROUGH;
+    if (!ev->release && !filtered)
+      break;
+  }
+
+  return NULL;
+}
+
 void
 uim_init_key_subrs(void)
 {
   protected = uim_scm_f();
   uim_scm_gc_protect(&protected);
+  key_syms = uim_scm_null();
+  uim_scm_gc_protect(&key_syms);
+  uim_scm_init_proc(&key_press_handler, "key-press-handler");
+  uim_scm_init_proc(&key_release_handler, "key-release-handler");
 
+  init_key_syms();
   define_valid_key_symbols();
+
+  uim_scm_init_proc3("key-matcher-match?", key_matcher_matchp);
 }
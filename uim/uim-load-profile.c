@@ -0,0 +1,380 @@
+/*
+
+  Copyright (c) 2003-2013 uim Project https://github.com/uim/uim
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+  3. Neither the name of authors nor the names of its contributors
+     may be used to endorse or promote products derived from this software
+     without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * Load profiler
+ *
+ * When LIBUIM_PROFILE_LOAD is set, each `require', `load',
+ * `require-module' and `module-load' is recorded as a frame with its
+ * wall time and the growth of the maximum resident set size, nested
+ * as the loads are. Frames are reported in the folded stack format of
+ * flamegraph.pl, one line per frame with its self cost:
+ *
+ *   require:init.scm;require-module:anthy;require:anthy.scm 12345
+ *
+ * The wall time (usec) is written to the file named by
+ * LIBUIM_PROFILE_LOAD and the growth (kB on Linux) to the same name
+ * with ".rss" appended. Reports are appended so that the results of
+ * several processes can be merged. Any value other than an absolute
+ * path writes both to stderr. The frames completed so far are reported
+ * on SIGUSR2 and at uim_quit().
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "uim.h"
+#include "uim-internal.h"
+#include "uim-scm.h"
+#include "uim-scm-abbrev.h"
+#include "uim-util.h"
+
+
+struct load_frame {
+  char *label;
+  long start;        /* usec */
+  long children;
+  long start_rss;
+  long children_rss;
+};
+
+struct load_report {
+  int fd;
+  char *str;
+  size_t len;
+  size_t size;
+  size_t flushed;
+};
+
+static uim_bool profile_enabled;
+static struct load_frame *frames;
+static int nr_frames, frames_size;
+static struct load_report time_report, rss_report;
+static volatile sig_atomic_t report_busy, report_pending;
+
+static uim_lisp profile_load(uim_lisp file_);
+static uim_lisp profile_require(uim_lisp file_);
+static uim_lisp profile_enter(uim_lisp kind_, uim_lisp name_);
+static uim_lisp profile_leave(uim_lisp depth_);
+
+
+static long
+now_usec(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static long
+max_rss(void)
+{
+  struct rusage ru;
+
+  if (getrusage(RUSAGE_SELF, &ru) < 0)
+    return 0;
+
+  return ru.ru_maxrss;
+}
+
+/* Only write(2) is used here since this is also run from the signal
+ * handler. report_busy keeps the handler away from the buffers while
+ * they are being modified. */
+static void
+report_flush(struct load_report *report)
+{
+  ssize_t n;
+
+  while (report->flushed < report->len) {
+    n = write(report->fd, &report->str[report->flushed],
+	      report->len - report->flushed);
+    if (n <= 0)
+      break;
+    report->flushed += n;
+  }
+}
+
+static void
+flush_reports(void)
+{
+  report_flush(&time_report);
+  report_flush(&rss_report);
+}
+
+static void
+request_flush(void)
+{
+  if (report_busy)
+    report_pending = 1;
+  else
+    flush_reports();
+}
+
+static void
+report_begin(void)
+{
+  report_busy = 1;
+}
+
+static void
+report_end(void)
+{
+  report_busy = 0;
+  if (report_pending) {
+    report_busy = 1;
+    report_pending = 0;
+    flush_reports();
+    report_busy = 0;
+  }
+}
+
+static void
+report_append(struct load_report *report, const char *str, size_t len)
+{
+  if (report->len + len > report->size) {
+    while (report->len + len > report->size)
+      report->size = (report->size) ? report->size * 2 : 4096;
+    report->str = uim_realloc(report->str, report->size);
+  }
+  memcpy(&report->str[report->len], str, len);
+  report->len += len;
+}
+
+static void
+report_frame(struct load_report *report, long value)
+{
+  char buf[32];
+  int i;
+
+  for (i = 0; i < nr_frames; i++) {
+    if (i)
+      report_append(report, ";", 1);
+    report_append(report, frames[i].label, strlen(frames[i].label));
+  }
+  snprintf(buf, sizeof(buf), " %ld\n", value);
+  report_append(report, buf, strlen(buf));
+}
+
+static int
+open_report(const char *path)
+{
+  if (path[0] != '/')
+    return STDERR_FILENO;
+
+  return open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+}
+
+void
+uim_init_load_profile(void)
+{
+  const char *path;
+  char *rss_path;
+
+  uim_scm_init_proc2("load-profile-enter", profile_enter);
+  uim_scm_init_proc1("load-profile-leave", profile_leave);
+
+  path = (uim_issetugid()) ? NULL : getenv("LIBUIM_PROFILE_LOAD");
+  if (!path || profile_enabled)
+    return;
+
+  time_report.fd = open_report(path);
+  uim_asprintf(&rss_path, "%s.rss", path);
+  rss_report.fd = open_report(rss_path);
+  free(rss_path);
+  if (time_report.fd < 0 || rss_report.fd < 0) {
+    if (time_report.fd > STDERR_FILENO)
+      close(time_report.fd);
+    if (rss_report.fd > STDERR_FILENO)
+      close(rss_report.fd);
+    return;
+  }
+  profile_enabled = UIM_TRUE;
+
+  uim_scm_eval_c_string("(define %load-unprofiled load)");
+  uim_scm_init_proc1("load", profile_load);
+  uim_scm_eval_c_string("(define %require-unprofiled require)");
+  uim_scm_init_proc1("require", profile_require);
+
+  uim_add_sigusr2_func(request_flush);
+}
+
+void
+uim_quit_load_profile(void)
+{
+  int i;
+
+  if (!profile_enabled)
+    return;
+
+  uim_load_profile_leave(0);
+
+  uim_remove_sigusr2_func(request_flush);
+
+  report_begin();
+  flush_reports();
+  if (time_report.fd > STDERR_FILENO)
+    close(time_report.fd);
+  if (rss_report.fd > STDERR_FILENO)
+    close(rss_report.fd);
+  free(time_report.str);
+  free(rss_report.str);
+  memset(&time_report, 0, sizeof(time_report));
+  memset(&rss_report, 0, sizeof(rss_report));
+  report_busy = report_pending = 0;
+
+  for (i = 0; i < nr_frames; i++)
+    free(frames[i].label);
+  free(frames);
+  frames = NULL;
+  nr_frames = frames_size = 0;
+  profile_enabled = UIM_FALSE;
+}
+
+/* Returns the depth to be passed to uim_load_profile_leave(), or -1 if
+ * the profiler is disabled. */
+int
+uim_load_profile_enter(const char *kind, const char *name)
+{
+  struct load_frame *frame;
+  char *p;
+
+  if (!profile_enabled)
+    return -1;
+
+  if (nr_frames == frames_size) {
+    frames_size = (frames_size) ? frames_size * 2 : 16;
+    frames = uim_realloc(frames, sizeof(*frames) * frames_size);
+  }
+  frame = &frames[nr_frames];
+  uim_asprintf(&frame->label, "%s:%s", kind, name);
+  /* ';' and ' ' are the separators of the folded format */
+  for (p = frame->label; *p; p++) {
+    if (*p == ';' || *p == ' ')
+      *p = '_';
+  }
+  frame->children = frame->children_rss = 0;
+  frame->start_rss = max_rss();
+  frame->start = now_usec();
+
+  return nr_frames++;
+}
+
+/* Leaves the frame at DEPTH. Frames left open above it by a non-local
+ * exit from a load are closed together. */
+void
+uim_load_profile_leave(int depth)
+{
+  struct load_frame *frame;
+  long now, rss, total, total_rss;
+
+  if (!profile_enabled || depth < 0)
+    return;
+
+  now = now_usec();
+  rss = max_rss();
+  report_begin();
+  while (nr_frames > depth) {
+    frame = &frames[nr_frames - 1];
+    total = now - frame->start;
+    total_rss = rss - frame->start_rss;
+    report_frame(&time_report, total - frame->children);
+    if (total_rss > frame->children_rss)
+      report_frame(&rss_report, total_rss - frame->children_rss);
+    free(frame->label);
+    nr_frames--;
+    if (nr_frames) {
+      frames[nr_frames - 1].children += total;
+      frames[nr_frames - 1].children_rss += total_rss;
+    }
+  }
+  report_end();
+}
+
+static uim_lisp
+profile_load(uim_lisp file_)
+{
+  uim_lisp ret;
+  int depth;
+
+  depth = uim_load_profile_enter("load", REFER_C_STR(file_));
+  ret = uim_scm_callf("%load-unprofiled", "o", file_);
+  uim_load_profile_leave(depth);
+
+  return ret;
+}
+
+static uim_lisp
+profile_require(uim_lisp file_)
+{
+  uim_lisp ret;
+  int depth;
+
+  depth = uim_load_profile_enter("require", REFER_C_STR(file_));
+  ret = uim_scm_callf("%require-unprofiled", "o", file_);
+  uim_load_profile_leave(depth);
+
+  return ret;
+}
+
+static uim_lisp
+profile_enter(uim_lisp kind_, uim_lisp name_)
+{
+  int depth;
+
+  if (!profile_enabled)
+    return uim_scm_f();
+
+  depth = uim_load_profile_enter(REFER_C_STR(kind_), REFER_C_STR(name_));
+
+  return MAKE_INT(depth);
+}
+
+static uim_lisp
+profile_leave(uim_lisp depth_)
+{
+  if (INTP(depth_))
+    uim_load_profile_leave(C_INT(depth_));
+
+  return uim_scm_t();
+}
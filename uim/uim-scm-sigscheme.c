@@ -84,6 +84,21 @@ struct callf_args {
 };
 static void *uim_scm_callf_internal(struct callf_args *args);
 
+enum call_proc_type {
+  CALL_P,
+  CALL_PI,
+  CALL_PII,
+  CALL_POI
+};
+struct call_proc_args {
+  enum call_proc_type type;
+  uim_lisp handle;
+  void *ptr;
+  uim_lisp obj;
+  long i, j;
+};
+static void *uim_scm_call_proc_internal(struct call_proc_args *args);
+
 static void *uim_scm_c_int_internal(void *uim_lisp_integer);
 static void *uim_scm_make_int_internal(void *integer);
 static void *uim_scm_c_char_internal(void *uim_lisp_ch);
@@ -1086,6 +1101,112 @@ uim_scm_callf_internal(struct callf_args *args)
     return (void *)(uim_lisp)scm_call(proc, scm_args);
 }
 
+void
+uim_scm_init_proc(uim_lisp *handle, const char *proc)
+{
+  assert(uim_scm_gc_any_contextp());
+  assert(handle);
+  assert(proc);
+
+  *handle = uim_scm_make_symbol(proc);
+  uim_scm_gc_protect(handle);
+}
+
+/* The procedure is looked up through the symbol on each call, so
+ * redefinitions of it take effect as with uim_scm_callf(). */
+static void *
+uim_scm_call_proc_internal(struct call_proc_args *args)
+{
+  ScmObj proc, ptr, scm_args;
+
+  proc = scm_symbol_value((ScmObj)args->handle, SCM_INTERACTION_ENV);
+  ptr = SCM_MAKE_C_POINTER(args->ptr);
+  switch (args->type) {
+  case CALL_P:
+    scm_args = SCM_LIST_1(ptr);
+    break;
+
+  case CALL_PI:
+    scm_args = SCM_LIST_2(ptr, SCM_MAKE_INT(args->i));
+    break;
+
+  case CALL_PII:
+    scm_args = SCM_LIST_3(ptr, SCM_MAKE_INT(args->i), SCM_MAKE_INT(args->j));
+    break;
+
+  case CALL_POI:
+    scm_args = SCM_LIST_3(ptr, (ScmObj)args->obj, SCM_MAKE_INT(args->i));
+    break;
+
+  default:
+    SCM_NOTREACHED;
+  }
+
+  return (void *)(uim_lisp)scm_call(proc, scm_args);
+}
+
+uim_lisp
+uim_scm_call_p(uim_lisp handle, void *ptr)
+{
+  struct call_proc_args args;
+
+  assert(uim_scm_gc_any_contextp());
+  assert(uim_scm_gc_protectedp(handle));
+
+  args.type = CALL_P;
+  args.handle = handle;
+  args.ptr = ptr;
+  return (uim_lisp)uim_scm_call_with_gc_ready_stack((uim_gc_gate_func_ptr)uim_scm_call_proc_internal, &args);
+}
+
+uim_lisp
+uim_scm_call_pi(uim_lisp handle, void *ptr, long i)
+{
+  struct call_proc_args args;
+
+  assert(uim_scm_gc_any_contextp());
+  assert(uim_scm_gc_protectedp(handle));
+
+  args.type = CALL_PI;
+  args.handle = handle;
+  args.ptr = ptr;
+  args.i = i;
+  return (uim_lisp)uim_scm_call_with_gc_ready_stack((uim_gc_gate_func_ptr)uim_scm_call_proc_internal, &args);
+}
+
+uim_lisp
+uim_scm_call_pii(uim_lisp handle, void *ptr, long i, long j)
+{
+  struct call_proc_args args;
+
+  assert(uim_scm_gc_any_contextp());
+  assert(uim_scm_gc_protectedp(handle));
+
+  args.type = CALL_PII;
+  args.handle = handle;
+  args.ptr = ptr;
+  args.i = i;
+  args.j = j;
+  return (uim_lisp)uim_scm_call_with_gc_ready_stack((uim_gc_gate_func_ptr)uim_scm_call_proc_internal, &args);
+}
+
+uim_lisp
+uim_scm_call_poi(uim_lisp handle, void *ptr, uim_lisp obj, long i)
+{
+  struct call_proc_args args;
+
+  assert(uim_scm_gc_any_contextp());
+  assert(uim_scm_gc_protectedp(handle));
+  assert(uim_scm_gc_protectedp(obj));
+
+  args.type = CALL_POI;
+  args.handle = handle;
+  args.ptr = ptr;
+  args.obj = obj;
+  args.i = i;
+  return (uim_lisp)uim_scm_call_with_gc_ready_stack((uim_gc_gate_func_ptr)uim_scm_call_proc_internal, &args);
+}
+
 uim_lisp
 uim_scm_callf_with_guard(uim_lisp failed,
                          const char *proc, const char *args_fmt, ...)
@@ -137,6 +137,16 @@ uim_lisp uim_scm_callf(const char *proc, const char *args_fmt, ...);
 uim_lisp uim_scm_callf_with_guard(uim_lisp failed,
                                   const char *proc, const char *args_fmt, ...);
 
+/* procedure handles: a handle names a procedure by a pre-interned symbol
+ * and the typed calls pass their arguments without a format string.
+ * The letters of the suffix mean the same as the ones of args_fmt of
+ * uim_scm_callf(). */
+void uim_scm_init_proc(uim_lisp *handle, const char *proc);
+uim_lisp uim_scm_call_p(uim_lisp handle, void *ptr);
+uim_lisp uim_scm_call_pi(uim_lisp handle, void *ptr, long i);
+uim_lisp uim_scm_call_pii(uim_lisp handle, void *ptr, long i, long j);
+uim_lisp uim_scm_call_poi(uim_lisp handle, void *ptr, uim_lisp obj, long i);
+
 uim_bool uim_scm_load_file(const char *fn);
 uim_bool uim_scm_require_file(const char *fn);
 
@@ -0,0 +1,244 @@
+/*
+
+  Copyright (c) 2003-2013 uim Project https://github.com/uim/uim
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+  3. Neither the name of authors nor the names of its contributors
+     may be used to endorse or promote products derived from this software
+     without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * Trace ring buffer
+ *
+ * While LIBUIM_TRACE is set, the stages bracketed by UIM_TRACE_BEGIN()
+ * and UIM_TRACE_END() are recorded into a ring buffer keeping the last
+ * TRACE_RING_SIZE of them. The buffer is written as Chrome trace event
+ * JSON, loadable by chrome://tracing or Perfetto, to the file named by
+ * LIBUIM_TRACE with ".<pid>.json" appended. It is written at
+ * uim_quit() and, unless the application handles SIGUSR2 itself, at
+ * the first stage completed after a SIGUSR2.
+ *
+ * SIGUSR2 is shared with the load profiler (see uim-load-profile.c):
+ * one handler is installed for both and calls each of the registered
+ * functions.
+ *
+ * Stage names are not copied, so they must be string literals of
+ * libuim or of a plugin which is still loaded at the time of writing.
+ */
+
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/time.h>
+
+#include "uim.h"
+#include "uim-internal.h"
+#include "uim-trace.h"
+
+
+#define TRACE_RING_SIZE 65536
+#define MAX_SIGUSR2_FUNCS 4
+
+struct trace_event {
+  const char *name;
+  long start;
+  long dur;
+  long arg;
+};
+
+int uim_trace_enabled;
+
+static struct trace_event *ring;
+static unsigned long nr_events;
+static char *trace_path;
+static volatile sig_atomic_t dump_requested;
+static void (*volatile sigusr2_funcs[MAX_SIGUSR2_FUNCS])(void);
+static int sigusr2_installed;
+
+static void trace_dump(void);
+
+
+long
+uim_trace_now(void)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+
+  return (long)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+void
+uim_trace_record(const char *name, long start, long arg)
+{
+  struct trace_event *ev;
+
+  ev = &ring[nr_events++ % TRACE_RING_SIZE];
+  ev->name = name;
+  ev->start = start;
+  ev->dur = uim_trace_now() - start;
+  ev->arg = arg;
+
+  /* the handler cannot write it out by itself */
+  if (dump_requested) {
+    dump_requested = 0;
+    trace_dump();
+  }
+}
+
+static void
+sigusr2_handler(int sig)
+{
+  void (*func)(void);
+  int i;
+
+  for (i = 0; i < MAX_SIGUSR2_FUNCS; i++) {
+    func = sigusr2_funcs[i];
+    if (func)
+      func();
+  }
+}
+
+/* FUNC is called from the signal handler, so it must be async-signal-safe */
+void
+uim_add_sigusr2_func(void (*func)(void))
+{
+  struct sigaction act, oact;
+  int i;
+
+  for (i = 0; i < MAX_SIGUSR2_FUNCS; i++) {
+    if (!sigusr2_funcs[i]) {
+      sigusr2_funcs[i] = func;
+      break;
+    }
+  }
+
+  /* don't take SIGUSR2 from the application */
+  if (!sigusr2_installed
+      && sigaction(SIGUSR2, NULL, &oact) == 0 && oact.sa_handler == SIG_DFL) {
+    memset(&act, 0, sizeof(act));
+    act.sa_handler = sigusr2_handler;
+    sigemptyset(&act.sa_mask);
+    act.sa_flags = SA_RESTART;
+    if (sigaction(SIGUSR2, &act, NULL) == 0)
+      sigusr2_installed = 1;
+  }
+}
+
+void
+uim_remove_sigusr2_func(void (*func)(void))
+{
+  struct sigaction oact;
+  int i, used = 0;
+
+  for (i = 0; i < MAX_SIGUSR2_FUNCS; i++) {
+    if (sigusr2_funcs[i] == func)
+      sigusr2_funcs[i] = NULL;
+    else if (sigusr2_funcs[i])
+      used = 1;
+  }
+
+  if (!used && sigusr2_installed) {
+    if (sigaction(SIGUSR2, NULL, &oact) == 0
+	&& oact.sa_handler == sigusr2_handler)
+      signal(SIGUSR2, SIG_DFL);
+    sigusr2_installed = 0;
+  }
+}
+
+static void
+request_dump(void)
+{
+  dump_requested = 1;
+}
+
+void
+uim_init_trace(void)
+{
+  const char *path;
+
+  path = (uim_issetugid()) ? NULL : getenv("LIBUIM_TRACE");
+  if (!path || uim_trace_enabled)
+    return;
+
+  uim_asprintf(&trace_path, "%s.%ld.json", path, (long)getpid());
+  ring = uim_malloc(sizeof(*ring) * TRACE_RING_SIZE);
+  nr_events = 0;
+  uim_trace_enabled = 1;
+
+  uim_add_sigusr2_func(request_dump);
+}
+
+/* Must be called before plugins are unloaded since the names of their
+ * stages are referred from the ring. */
+void
+uim_quit_trace(void)
+{
+  if (!uim_trace_enabled)
+    return;
+
+  uim_remove_sigusr2_func(request_dump);
+
+  trace_dump();
+  uim_trace_enabled = 0;
+  free(ring);
+  ring = NULL;
+  free(trace_path);
+  trace_path = NULL;
+}
+
+static void
+trace_dump(void)
+{
+  const struct trace_event *ev;
+  unsigned long i, first;
+  long pid;
+  FILE *fp;
+
+  fp = fopen(trace_path, "w");
+  if (!fp)
+    return;
+
+  pid = (long)getpid();
+  first = (nr_events > TRACE_RING_SIZE) ? nr_events - TRACE_RING_SIZE : 0;
+  fputs("{\"traceEvents\":[", fp);
+  for (i = first; i < nr_events; i++) {
+    ev = &ring[i % TRACE_RING_SIZE];
+    fprintf(fp, "%s\n{\"name\":\"%s\",\"cat\":\"uim\",\"ph\":\"X\","
+	    "\"ts\":%ld,\"dur\":%ld,\"pid\":%ld,\"tid\":0,"
+	    "\"args\":{\"arg\":%ld}}",
+	    (i == first) ? "" : ",", ev->name, ev->start, ev->dur, pid,
+	    ev->arg);
+  }
+  fputs("\n],\"displayTimeUnit\":\"ms\"}\n", fp);
+  fclose(fp);
+}
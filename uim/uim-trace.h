@@ -0,0 +1,97 @@
+/*
+
+  Copyright (c) 2008-2013 uim Project https://github.com/uim/uim
+
+  All rights reserved.
+
+  Redistribution and use in source and binary forms, with or without
+  modification, are permitted provided that the following conditions
+  are met:
+
+  1. Redistributions of source code must retain the above copyright
+     notice, this list of conditions and the following disclaimer.
+  2. Redistributions in binary form must reproduce the above copyright
+     notice, this list of conditions and the following disclaimer in the
+     documentation and/or other materials provided with the distribution.
+  3. Neither the name of authors nor the names of its contributors
+     may be used to endorse or promote products derived from this software
+     without specific prior written permission.
+
+  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS ``AS IS'' AND
+  ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+  ARE DISCLAIMED.  IN NO EVENT SHALL THE COPYRIGHT HOLDERS OR CONTRIBUTORS BE LIABLE
+  FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+  DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+  OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+  HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+  LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+  OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+  SUCH DAMAGE.
+
+*/
+
+/*
+ * Latency tracepoints
+ *
+ * A traced stage is bracketed by UIM_TRACE_BEGIN() and UIM_TRACE_END()
+ * with a `long' local to hold the start time:
+ *
+ *   long t;
+ *
+ *   UIM_TRACE_BEGIN(key_press, key, t);
+ *   ...
+ *   UIM_TRACE_END(key_press, key, t);
+ *
+ * Each of them fires the USDT probe uim:<name>__begin or
+ * uim:<name>__end with ARG when <sys/sdt.h> is available, for use with
+ * perf or bpftrace. In addition, while LIBUIM_TRACE is set the stage
+ * is recorded into an in-process ring buffer which is written in the
+ * Chrome trace event format (see uim-trace.c).
+ *
+ * A stage left by an error is not recorded in the ring buffer.
+ */
+
+#ifndef UIM_TRACE_H
+#define UIM_TRACE_H
+
+#if HAVE_SYS_SDT_H
+#include <sys/sdt.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if HAVE_SYS_SDT_H
+#define UIM_TRACE_PROBE(name, arg) DTRACE_PROBE1(uim, name, arg)
+#else
+#define UIM_TRACE_PROBE(name, arg)
+#endif
+
+#define UIM_TRACE_BEGIN(name, arg, start)				\
+  do {									\
+    UIM_TRACE_PROBE(name##__begin, (long)(arg));			\
+    (start) = (uim_trace_enabled) ? uim_trace_now() : 0;		\
+  } while (0)
+
+#define UIM_TRACE_END(name, arg, start)					\
+  do {									\
+    UIM_TRACE_PROBE(name##__end, (long)(arg));				\
+    if (uim_trace_enabled && (start))					\
+      uim_trace_record(#name, (start), (long)(arg));			\
+  } while (0)
+
+extern int uim_trace_enabled;
+
+long uim_trace_now(void);
+void uim_trace_record(const char *name, long start, long arg);
+
+void uim_init_trace(void);
+void uim_quit_trace(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -33,6 +33,7 @@
 
 #include <config.h>
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
@@ -48,6 +49,7 @@
 #include "uim-im-switcher.h"
 #include "uim-scm.h"
 #include "uim-scm-abbrev.h"
+#include "uim-trace.h"
 #if UIM_USE_NOTIFY_PLUGINS
 #include "uim-notify.h"
 #else
@@ -69,6 +71,17 @@ struct uim_get_candidate_args {
   int enum_hint;
 };
 static void *uim_get_candidate_internal(struct uim_get_candidate_args *args);
+struct uim_get_candidates_args {
+  uim_context uc;
+  int start;
+  int count;
+  uim_candidate *out;
+};
+static void *uim_get_candidates_internal(struct uim_get_candidates_args *args);
+static uim_candidate alloc_candidate(uim_context uc, const char *str,
+				     const char *head, const char *ann);
+static void free_cand_arena(uim_context uc);
+static void create_scheme_context(uim_context uc);
 struct uim_delay_activating_args {
   uim_context uc;
   int nr;
@@ -76,7 +89,10 @@ struct uim_delay_activating_args {
   int selected_index;
 };
 static void *uim_delay_activating_internal(struct uim_delay_activating_args *);
-static uim_lisp get_nth_im(uim_context uc, int nth);
+static const struct uim_im_info *get_nth_im(uim_context uc, int nth);
+static const struct uim_im_info *get_im_list(uim_context uc, int *nr);
+static void *build_im_list_internal(uim_context uc);
+static void free_im_list(void);
 #ifdef ENABLE_ANTHY_STATIC
 void uim_anthy_plugin_instance_init(void);
 void uim_anthy_plugin_instance_quit(void);
@@ -88,6 +104,23 @@ void uim_anthy_utf8_plugin_instance_quit(void);
 
 static uim_bool uim_initialized;
 static uim_lisp protected0, protected1;
+/* procedures called on hot paths */
+static uim_lisp reset_handler, focus_in_handler, focus_out_handler;
+static uim_lisp place_handler, displace_handler;
+static uim_lisp get_candidate_proc, get_candidates_proc;
+static uim_lisp set_candidate_index_proc;
+/* lazy context instantiation */
+static uim_bool lazy_context;
+static unsigned long nr_lazy_contexts, nr_materialized_contexts;
+static unsigned long nr_unmaterialized_releases;
+/* cached snapshot of IMs returned by uim_get_im_list() */
+static struct {
+  struct uim_im_info *ims;
+  int nr;
+  long generation;
+  struct uim_code_converter *conv_if;
+  char *client_encoding;
+} im_list;
 
 unsigned int uim_init_count;
 
@@ -129,17 +162,26 @@ uim_init(void)
 static void *
 uim_init_internal(void *dummy)
 {
-  char *scm_files;
+  char *scm_files, *lazy;
 
   protected0 = uim_scm_f();
   protected1 = uim_scm_f();
   uim_scm_gc_protect(&protected0);
   uim_scm_gc_protect(&protected1);
+  uim_scm_init_proc(&reset_handler, "reset-handler");
+  uim_scm_init_proc(&focus_in_handler, "focus-in-handler");
+  uim_scm_init_proc(&focus_out_handler, "focus-out-handler");
+  uim_scm_init_proc(&place_handler, "place-handler");
+  uim_scm_init_proc(&displace_handler, "displace-handler");
+  uim_scm_init_proc(&get_candidate_proc, "get-candidate");
+  uim_scm_init_proc(&get_candidates_proc, "get-candidates");
+  uim_scm_init_proc(&set_candidate_index_proc, "set-candidate-index");
 
   /* To allow (cond-expand (uim ...)) in early initialization stages,
    * provision of the "uim" should be performed as early as possible. */
   uim_scm_callf("provide", "s", "uim");
 
+  uim_init_trace();
   uim_init_im_subrs();
   uim_init_intl_subrs();
   uim_init_iconv_subrs();
@@ -166,6 +208,10 @@ uim_init_internal(void *dummy)
     scm_files = (scm_files) ? scm_files : SCM_FILES;
   }
   uim_scm_set_lib_path(scm_files);
+  uim_init_load_profile();
+
+  lazy = getenv("LIBUIM_LAZY_CONTEXT");
+  lazy_context = (lazy && *lazy && strcmp(lazy, "0"));
 
   uim_scm_require_file("init.scm");
 
@@ -194,9 +240,14 @@ uim_quit(void)
 #if UIM_USE_NOTIFY_PLUGINS
   uim_notify_quit();
 #endif
+  uim_quit_trace();
+  free_im_list();
   uim_scm_callf("annotation-unload", "");
   uim_scm_callf("dynlib-unload-all", "");
   uim_quit_dynlib();
+  uim_quit_rk();
+  uim_quit_iconv();
+  uim_quit_load_profile();
   uim_scm_quit();
   uim_initialized = UIM_FALSE;
 }
@@ -210,7 +261,6 @@ uim_create_context(void *ptr,
 		   void (*commit_cb)(void *ptr, const char *str))
 {
   uim_context uc;
-  uim_lisp lang_, engine_;
 
   if (UIM_CATCH_ERROR_BEGIN())
     return NULL;
@@ -238,18 +288,73 @@ uim_create_context(void *ptr,
   /* foreign context objects */
   uc->ptr = ptr;
 
-  protected0 = lang_ = (lang) ? MAKE_SYM(lang) : uim_scm_f();
-  protected1 = engine_ = (engine) ? MAKE_SYM(engine) : uim_scm_f();
+  uc->lang = (lang) ? uim_strdup(lang) : NULL;
+  uc->engine = (engine) ? uim_strdup(engine) : NULL;
   uc->sc = uim_scm_f(); /* failsafe */
-  uc->sc = uim_scm_callf("create-context", "poo", uc, lang_, engine_);
   uim_scm_gc_protect(&uc->sc);
-  uim_scm_callf("setup-context", "o", uc->sc);
+
+  /* In the lazy mode, the Scheme-side context is created on the first
+   * focus-in or key event. Most contexts of browsers and IDEs are
+   * never focused. */
+  if (lazy_context)
+    nr_lazy_contexts++;
+  else
+    create_scheme_context(uc);
 
   UIM_CATCH_ERROR_END();
 
   return uc;
 }
 
+static void
+create_scheme_context(uim_context uc)
+{
+  uim_lisp lang_, engine_;
+
+  uc->materialized = UIM_TRUE;
+
+  protected0 = lang_ = (uc->lang) ? MAKE_SYM(uc->lang) : uim_scm_f();
+  protected1 = engine_ = (uc->engine) ? MAKE_SYM(uc->engine) : uim_scm_f();
+  free(uc->lang);
+  free(uc->engine);
+  uc->lang = uc->engine = NULL;
+
+  uc->sc = uim_scm_callf("create-context", "poo", uc, lang_, engine_);
+  uim_scm_callf("setup-context", "o", uc->sc);
+}
+
+void
+uim_materialize_context(uim_context uc)
+{
+  assert(uim_scm_gc_any_contextp());
+  assert(uc);
+
+  if (uc->materialized)
+    return;
+
+  nr_materialized_contexts++;
+  create_scheme_context(uc);
+}
+
+void
+uim_set_lazy_context(uim_bool lazy)
+{
+  lazy_context = lazy;
+}
+
+void
+uim_get_lazy_context_stats(unsigned long *nr_created,
+			   unsigned long *nr_materialized,
+			   unsigned long *nr_released_unmaterialized)
+{
+  if (nr_created)
+    *nr_created = nr_lazy_contexts;
+  if (nr_materialized)
+    *nr_materialized = nr_materialized_contexts;
+  if (nr_released_unmaterialized)
+    *nr_released_unmaterialized = nr_unmaterialized_releases;
+}
+
 void
 uim_release_context(uim_context uc)
 {
@@ -261,8 +366,13 @@ uim_release_context(uim_context uc)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
-  uim_scm_callf("release-context", "p", uc);
+  if (uc->materialized)
+    uim_scm_callf("release-context", "p", uc);
+  else
+    nr_unmaterialized_releases++;
   uim_scm_gc_unprotect(&uc->sc);
+  free(uc->lang);
+  free(uc->engine);
   if (uc->outbound_conv)
     uc->conv_if->release(uc->outbound_conv);
   if (uc->inbound_conv)
@@ -274,6 +384,11 @@ uim_release_context(uim_context uc)
   free(uc->propstr);
   free(uc->modes);
   free(uc->client_encoding);
+  free_cand_arena(uc);
+  for (i = 0; i < 2; i++) {
+    free(uc->preedit[i].str);
+    free(uc->preedit[i].segs);
+  }
 #ifdef DEBUG
   /* prevents operating on invalidated uim_context */
   memset(uc, 0, sizeof(*uc));
@@ -292,7 +407,8 @@ uim_reset_context(uim_context uc)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
-  uim_scm_callf("reset-handler", "p", uc);
+  if (uc->materialized)
+    uim_scm_call_p(reset_handler, uc);
 
   UIM_CATCH_ERROR_END();
 }
@@ -306,7 +422,8 @@ uim_focus_in_context(uim_context uc)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
-  uim_scm_callf("focus-in-handler", "p", uc);
+  uim_materialize_context(uc);
+  uim_scm_call_p(focus_in_handler, uc);
 
   UIM_CATCH_ERROR_END();
 }
@@ -320,7 +437,8 @@ uim_focus_out_context(uim_context uc)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
-  uim_scm_callf("focus-out-handler", "p", uc);
+  if (uc->materialized)
+    uim_scm_call_p(focus_out_handler, uc);
 
   UIM_CATCH_ERROR_END();
 }
@@ -334,7 +452,8 @@ uim_place_context(uim_context uc)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
-  uim_scm_callf("place-handler", "p", uc);
+  uim_materialize_context(uc);
+  uim_scm_call_p(place_handler, uc);
 
   UIM_CATCH_ERROR_END();
 }
@@ -348,7 +467,8 @@ uim_displace_context(uim_context uc)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
-  uim_scm_callf("displace-handler", "p", uc);
+  if (uc->materialized)
+    uim_scm_call_p(displace_handler, uc);
 
   UIM_CATCH_ERROR_END();
 }
@@ -372,6 +492,22 @@ uim_set_preedit_cb(uim_context uc,
   UIM_CATCH_ERROR_END();
 }
 
+void
+uim_set_preedit_snapshot_cb(uim_context uc,
+			    void (*snapshot_cb)(void *ptr,
+						const struct uim_preedit_snapshot *snapshot))
+{
+  if (UIM_CATCH_ERROR_BEGIN())
+    return;
+
+  assert(uim_scm_gc_any_contextp());
+  assert(uc);
+
+  uc->preedit_snapshot_cb = snapshot_cb;
+
+  UIM_CATCH_ERROR_END();
+}
+
 void
 uim_set_candidate_selector_cb(uim_context uc,
                               void (*activate_cb)(void *ptr,
@@ -408,6 +544,7 @@ uim_get_candidate(uim_context uc, int index, int accel_enumeration_hint)
   assert(index >= 0);
   assert(accel_enumeration_hint >= 0);
 
+  uim_materialize_context(uc);
   args.uc = uc;
   args.index = index;
   args.enum_hint = accel_enumeration_hint;
@@ -426,25 +563,263 @@ uim_get_candidate_internal(struct uim_get_candidate_args *args)
   uim_candidate cand;
   uim_lisp triple;
   const char *str, *head, *ann;
+  long trace_start;
 
   uc = args->uc;
-  triple = uim_scm_callf("get-candidate", "pii",
-			 uc, args->index, args->enum_hint);
+  UIM_TRACE_BEGIN(get_candidate, args->index, trace_start);
+  triple = uim_scm_call_pii(get_candidate_proc,
+			    uc, args->index, args->enum_hint);
   ENSURE((uim_scm_length(triple) == 3), "invalid candidate triple");
 
-  cand = uim_malloc(sizeof(*cand));
-  memset(cand, 0, sizeof(*cand));
-
   str  = REFER_C_STR(CAR(triple));
   head = REFER_C_STR(CAR(CDR(triple)));
   ann  = REFER_C_STR(CAR(CDR(CDR((triple)))));
-  cand->str           = uc->conv_if->convert(uc->outbound_conv, str);
-  cand->heading_label = uc->conv_if->convert(uc->outbound_conv, head);
-  cand->annotation    = uc->conv_if->convert(uc->outbound_conv, ann);
+
+  cand = alloc_candidate(uc, str, head, ann);
+  UIM_TRACE_END(get_candidate, args->index, trace_start);
 
   return (void *)cand;
 }
 
+int
+uim_get_candidates(uim_context uc, int start, int count, uim_candidate *out)
+{
+  struct uim_get_candidates_args args;
+
+  if (UIM_CATCH_ERROR_BEGIN())
+    return -1;
+
+  assert(uim_scm_gc_any_contextp());
+  assert(uc);
+  assert(start >= 0);
+  assert(count >= 0);
+  assert(out);
+
+  if (count) {
+    uim_materialize_context(uc);
+    args.uc = uc;
+    args.start = start;
+    args.count = count;
+    args.out = out;
+
+    uim_scm_call_with_gc_ready_stack((uim_gc_gate_func_ptr)uim_get_candidates_internal, &args);
+  }
+
+  UIM_CATCH_ERROR_END();
+
+  return count;
+}
+
+/* All candidates of a page are fetched by one get-candidates call. */
+static void *
+uim_get_candidates_internal(struct uim_get_candidates_args *args)
+{
+  uim_context uc;
+  uim_lisp triples, triple;
+  const char *str, *head, *ann;
+  int i;
+  long trace_start;
+
+  uc = args->uc;
+  UIM_TRACE_BEGIN(get_candidates, args->start, trace_start);
+  triples = uim_scm_call_pii(get_candidates_proc,
+			     uc, args->start, args->count);
+  ENSURE((uim_scm_length(triples) == args->count),
+	 "invalid candidate list");
+
+  for (i = 0; i < args->count; i++, triples = CDR(triples)) {
+    triple = CAR(triples);
+    ENSURE((uim_scm_length(triple) == 3), "invalid candidate triple");
+
+    str  = REFER_C_STR(CAR(triple));
+    head = REFER_C_STR(CAR(CDR(triple)));
+    ann  = REFER_C_STR(CAR(CDR(CDR((triple)))));
+
+    args->out[i] = alloc_candidate(uc, str, head, ann);
+  }
+  UIM_TRACE_END(get_candidates, args->start, trace_start);
+
+  return NULL;
+}
+
+/*
+ * Candidates and their strings are allocated from a per-context arena
+ * of chunks instead of being malloc'ed one by one, and
+ * uim_candidate_free() has nothing to do for them.
+ *
+ * Frontends free the previous candidates in the activate callback of
+ * the selector, and fetch the new ones there. On activation the arena
+ * is therefore retired before the callback, so that the new list is
+ * allocated from fresh chunks, and the retired chunks are released
+ * after the callback has returned. On deactivation the arena is reset
+ * after the callback. A released chunk is kept as a spare to be reused
+ * by the next list.
+ *
+ * Frontends fetch candidates again on every selection move or page
+ * flip while the selector stays active, so the arena is capped at
+ * CAND_ARENA_MAX and candidates are malloc'ed beyond it. Those are
+ * released by uim_candidate_free() as before the arena. They are
+ * registered in a hash table so that uim_candidate_free() tells them
+ * from arena candidates without touching the candidate, whose chunk
+ * may have been released already.
+ */
+#define CAND_CHUNK_SIZE 4096
+#define CAND_ARENA_MAX (64 * 1024)
+#define HEAP_CAND_BUCKETS 64
+#define HEAP_CAND_HASH(cand)						\
+  (((unsigned long)(cand) / sizeof(void *)) % HEAP_CAND_BUCKETS)
+#define CAND_ALIGN(size)						\
+  (((size) + sizeof(void *) - 1) & ~(sizeof(void *) - 1))
+
+struct uim_cand_chunk_ {
+  struct uim_cand_chunk_ *next;
+  size_t size;
+  size_t used;
+  union {
+    void *p;
+    long l;
+    double d;
+  } data[1];
+};
+
+static void *
+cand_arena_alloc(uim_context uc, size_t size)
+{
+  struct uim_cand_chunk_ *chunk;
+  size_t chunk_size;
+  void *p;
+
+  size = CAND_ALIGN(size);
+  chunk = uc->cand_arena;
+  if (!chunk || chunk->size - chunk->used < size) {
+    chunk_size = (size > CAND_CHUNK_SIZE) ? size : CAND_CHUNK_SIZE;
+    if (uc->cand_arena_spare && uc->cand_arena_spare->size >= chunk_size) {
+      chunk = uc->cand_arena_spare;
+      uc->cand_arena_spare = NULL;
+    } else {
+      chunk = uim_malloc(offsetof(struct uim_cand_chunk_, data)
+			 + chunk_size);
+      chunk->size = chunk_size;
+    }
+    chunk->next = uc->cand_arena;
+    chunk->used = 0;
+    uc->cand_arena = chunk;
+    uc->cand_arena_size += chunk->size;
+  }
+  p = (char *)chunk->data + chunk->used;
+  chunk->used += size;
+
+  return p;
+}
+
+static char *
+cand_arena_convert(uim_context uc, const char *str)
+{
+  char *converted, *p;
+  size_t len;
+
+  if (UIM_CONV_IDENTITYP(uc, uc->outbound_conv)) {
+    len = strlen(str);
+    p = cand_arena_alloc(uc, len + sizeof(""));
+    memcpy(p, str, len + sizeof(""));
+    return p;
+  }
+
+  converted = uc->conv_if->convert(uc->outbound_conv, str);
+  if (!converted)
+    return NULL;
+  len = strlen(converted);
+  p = cand_arena_alloc(uc, len + sizeof(""));
+  memcpy(p, converted, len + sizeof(""));
+  free(converted);
+
+  return p;
+}
+
+static char *
+heap_convert(uim_context uc, const char *str)
+{
+  if (UIM_CONV_IDENTITYP(uc, uc->outbound_conv))
+    return uim_strdup(str);
+
+  return uc->conv_if->convert(uc->outbound_conv, str);
+}
+
+static uim_candidate heap_cands[HEAP_CAND_BUCKETS];
+
+static uim_candidate
+alloc_candidate(uim_context uc, const char *str, const char *head,
+		const char *ann)
+{
+  uim_candidate cand;
+
+  if (uc->cand_arena_size < CAND_ARENA_MAX) {
+    cand = cand_arena_alloc(uc, sizeof(*cand));
+    cand->str           = cand_arena_convert(uc, str);
+    cand->heading_label = cand_arena_convert(uc, head);
+    cand->annotation    = cand_arena_convert(uc, ann);
+    cand->heap_next = NULL;
+  } else {
+    cand = uim_malloc(sizeof(*cand));
+    cand->str           = heap_convert(uc, str);
+    cand->heading_label = heap_convert(uc, head);
+    cand->annotation    = heap_convert(uc, ann);
+    cand->heap_next = heap_cands[HEAP_CAND_HASH(cand)];
+    heap_cands[HEAP_CAND_HASH(cand)] = cand;
+  }
+
+  return cand;
+}
+
+/* the candidates allocated so far stay valid until
+ * uim_release_cand_arena() */
+void
+uim_retire_cand_arena(uim_context uc)
+{
+  struct uim_cand_chunk_ *chunk;
+
+  if (!uc->cand_arena)
+    return;
+
+  for (chunk = uc->cand_arena; chunk->next; chunk = chunk->next)
+    ;
+  chunk->next = uc->cand_arena_retired;
+  uc->cand_arena_retired = uc->cand_arena;
+  uc->cand_arena = NULL;
+  uc->cand_arena_size = 0;
+}
+
+void
+uim_release_cand_arena(uim_context uc)
+{
+  struct uim_cand_chunk_ *chunk, *next;
+
+  for (chunk = uc->cand_arena_retired; chunk; chunk = next) {
+    next = chunk->next;
+    /* keep a chunk of the ordinary size */
+    if (!uc->cand_arena_spare && chunk->size == CAND_CHUNK_SIZE)
+      uc->cand_arena_spare = chunk;
+    else
+      free(chunk);
+  }
+  uc->cand_arena_retired = NULL;
+}
+
+void
+uim_reset_cand_arena(uim_context uc)
+{
+  uim_retire_cand_arena(uc);
+  uim_release_cand_arena(uc);
+}
+
+static void
+free_cand_arena(uim_context uc)
+{
+  uim_reset_cand_arena(uc);
+  free(uc->cand_arena_spare);
+  uc->cand_arena_spare = NULL;
+}
+
 /* Accepts NULL candidates that produced by an error on uim_get_candidate(). */
 const char *
 uim_candidate_get_cand_str(uim_candidate cand)
@@ -491,22 +866,36 @@ uim_candidate_get_annotation_str(uim_candidate cand)
   return cand->annotation;
 }
 
+/* Candidates in the arena are released with the arena. */
 void
 uim_candidate_free(uim_candidate cand)
 {
-  if (UIM_CATCH_ERROR_BEGIN())
-    return;
+  uim_candidate *p;
 
-  assert(uim_scm_gc_any_contextp());
   if (!cand)
-    uim_fatal_error("null candidate");
+    return;
+
+  /* the candidate is not dereferenced unless it is malloc'ed */
+  for (p = &heap_cands[HEAP_CAND_HASH(cand)]; *p != cand;
+       p = &(*p)->heap_next) {
+    if (!*p)
+      return;
+  }
+  *p = cand->heap_next;
 
   free(cand->str);
   free(cand->heading_label);
   free(cand->annotation);
   free(cand);
+}
 
-  UIM_CATCH_ERROR_END();
+void
+uim_candidates_free(uim_candidate *cands, int count)
+{
+  int i;
+
+  for (i = 0; i < count; i++)
+    uim_candidate_free(cands[i]);
 }
 
 int
@@ -533,7 +922,8 @@ uim_set_candidate_index(uim_context uc, int nth)
   assert(uc);
   assert(nth >= 0);
 
-  uim_scm_callf("set-candidate-index", "pi", uc, nth);
+  uim_materialize_context(uc);
+  uim_scm_call_pi(set_candidate_index_proc, uc, nth);
 
   UIM_CATCH_ERROR_END();
 }
@@ -575,8 +965,12 @@ uim_input_string(uim_context uc, const char *str)
   assert(uc);
   assert(str);
 
-  conv = uc->conv_if->convert(uc->inbound_conv, str);
-  if (conv) {
+  uim_materialize_context(uc);
+  if (UIM_CONV_IDENTITYP(uc, uc->inbound_conv)) {
+    protected0 =
+      consumed = uim_scm_callf("input-string-handler", "ps", uc, str);
+    ret = C_BOOL(consumed);
+  } else if ((conv = uc->conv_if->convert(uc->inbound_conv, str))) {
     protected0 =
       consumed = uim_scm_callf("input-string-handler", "ps", uc, conv);
     free(conv);
@@ -609,8 +1003,11 @@ uim_set_client_encoding(uim_context uc, const char *encoding)
   free(uc->client_encoding);
   uc->client_encoding = uim_strdup(encoding);
 
-  protected0 = im_enc = uim_scm_callf("uim-context-encoding", "p", uc);
-  uim_set_encoding(uc, REFER_C_STR(im_enc));
+  /* create-context sets up the converters of a lazy context */
+  if (uc->materialized) {
+    protected0 = im_enc = uim_scm_callf("uim-context-encoding", "p", uc);
+    uim_set_encoding(uc, REFER_C_STR(im_enc));
+  }
 
   UIM_CATCH_ERROR_END();
 }
@@ -668,7 +1065,14 @@ uim_switch_im(uim_context uc, const char *engine)
   assert(uc);
   assert(engine);
 
-  uim_scm_callf("uim-switch-im", "py", uc, engine);
+  if (!uc->materialized) {
+    free(uc->lang);
+    free(uc->engine);
+    uc->lang = NULL;
+    uc->engine = uim_strdup(engine);
+  } else {
+    uim_scm_callf("uim-switch-im", "py", uc, engine);
+  }
 
   UIM_CATCH_ERROR_END();
 }
@@ -685,6 +1089,7 @@ uim_get_current_im_name(uim_context uc)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
+  uim_materialize_context(uc);
   protected0 = im = uim_scm_callf("uim-context-im", "p", uc);
   protected1 = ret = uim_scm_callf("im-name", "o", im);
   name = REFER_C_STR(ret);
@@ -824,6 +1229,11 @@ uim_delay_activating(uim_context uc, int *nr, int *display_limit, int *selected_
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
+  /* released on the next activation or deactivation since the
+   * frontend replaces the candidates after this */
+  uim_retire_cand_arena(uc);
+
+  uim_materialize_context(uc);
   args.uc = uc;
   args.nr = *nr;
   args.display_limit = *display_limit;
@@ -865,6 +1275,8 @@ uim_get_nr_modes(uim_context uc)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
+  uim_materialize_context(uc);
+
   UIM_CATCH_ERROR_END();
 
   return uc->nr_modes;
@@ -879,6 +1291,8 @@ uim_get_mode_name(uim_context uc, int nth)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
   assert(nth >= 0);
+
+  uim_materialize_context(uc);
   assert(nth < uc->nr_modes);
 
   UIM_CATCH_ERROR_END();
@@ -895,6 +1309,8 @@ uim_get_current_mode(uim_context uc)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
+  uim_materialize_context(uc);
+
   UIM_CATCH_ERROR_END();
 
   return uc->mode;
@@ -910,6 +1326,7 @@ uim_set_mode(uim_context uc, int mode)
   assert(uc);
   assert(mode >= 0);
 
+  uim_materialize_context(uc);
   uc->mode = mode;
   uim_scm_callf("mode-handler", "pi", uc, mode);
 
@@ -1014,6 +1431,7 @@ uim_prop_activate(uim_context uc, const char *str)
   assert(uc);
   assert(str);
       
+  uim_materialize_context(uc);
   uim_scm_callf("prop-activate-handler", "ps", uc, str);
 
   UIM_CATCH_ERROR_END();
@@ -1046,6 +1464,7 @@ uim_prop_update_custom(uim_context uc, const char *custom, const char *val)
   assert(custom);
   assert(val);
 
+  uim_materialize_context(uc);
   uim_scm_callf("custom-set-handler", "pys", uc, custom, val);
 
   UIM_CATCH_ERROR_END();
@@ -1073,8 +1492,7 @@ uim_prop_reload_configs(void)
 int
 uim_get_nr_im(uim_context uc)
 {
-  uim_lisp n_;
-  int n;
+  int nr;
 
   if (UIM_CATCH_ERROR_BEGIN())
     return 0;
@@ -1082,92 +1500,179 @@ uim_get_nr_im(uim_context uc)
   assert(uim_scm_gc_any_contextp());
   assert(uc);
 
-  protected0 = n_ = uim_scm_callf("uim-n-convertible-ims", "p", uc);
-  n = C_INT(n_);
+  get_im_list(uc, &nr);
 
   UIM_CATCH_ERROR_END();
 
-  return n;
+  return nr;
 }
 
-static uim_lisp
+static const struct uim_im_info *
 get_nth_im(uim_context uc, int nth)
 {
+  const struct uim_im_info *ims;
+  int nr;
+
   assert(uim_scm_gc_any_contextp());
   assert(uc);
   assert(nth >= 0);
 
-  return uim_scm_callf("uim-nth-convertible-im", "pi", uc, nth);
+  ims = get_im_list(uc, &nr);
+
+  return (nth < nr) ? &ims[nth] : NULL;
 }
 
 const char *
 uim_get_im_name(uim_context uc, int nth)
 {
-  uim_lisp im, str_;
-  const char *str;
+  const struct uim_im_info *im;
 
   if (UIM_CATCH_ERROR_BEGIN())
     return NULL;
 
-  protected0 = im = get_nth_im(uc, nth);
-  protected1 = str_ = uim_scm_callf("im-name", "o", im);
-  str = REFER_C_STR(str_);
+  im = get_nth_im(uc, nth);
 
   UIM_CATCH_ERROR_END();
 
-  return str;
+  return (im) ? im->name : NULL;
 }
 
 const char *
 uim_get_im_language(uim_context uc, int nth)
 {
-  uim_lisp im, str_;
-  const char *str;
+  const struct uim_im_info *im;
 
   if (UIM_CATCH_ERROR_BEGIN())
     return NULL;
 
-  protected0 = im = get_nth_im(uc, nth);
-  protected1 = str_ = uim_scm_callf("im-lang", "o", im);
-  str = REFER_C_STR(str_);
+  im = get_nth_im(uc, nth);
 
   UIM_CATCH_ERROR_END();
 
-  return str;
+  return (im) ? im->lang : NULL;
 }
 
 const char *
 uim_get_im_encoding(uim_context uc, int nth)
 {
-  uim_lisp im, str_;
-  const char *str;
+  const struct uim_im_info *im;
 
   if (UIM_CATCH_ERROR_BEGIN())
     return NULL;
 
-  protected0 = im = get_nth_im(uc, nth);
-  protected1 = str_ = uim_scm_callf("im-encoding", "o", im);
-  str = REFER_C_STR(str_);
+  im = get_nth_im(uc, nth);
 
   UIM_CATCH_ERROR_END();
 
-  return str;
+  return (im) ? im->encoding : NULL;
 }
 
 const char *
 uim_get_im_short_desc(uim_context uc, int nth)
 {
-  uim_lisp im, short_desc;
-  const char *str;
+  const struct uim_im_info *im;
+
+  if (UIM_CATCH_ERROR_BEGIN())
+    return NULL;
+
+  im = get_nth_im(uc, nth);
+
+  UIM_CATCH_ERROR_END();
+
+  return (im) ? im->short_desc : NULL;
+}
+
+/****************************************************************
+ * IM list snapshot                                             *
+ ****************************************************************/
+const struct uim_im_info *
+uim_get_im_list(uim_context uc, int *nr)
+{
+  const struct uim_im_info *ims;
+
+  assert(nr);
 
+  *nr = 0;
   if (UIM_CATCH_ERROR_BEGIN())
     return NULL;
 
-  protected0 = im = get_nth_im(uc, nth);
-  protected1 = short_desc = uim_scm_callf("im-short-desc", "o", im);
-  str = (FALSEP(short_desc)) ? "-" : REFER_C_STR(short_desc);
+  assert(uim_scm_gc_any_contextp());
+  assert(uc);
+
+  ims = get_im_list(uc, nr);
 
   UIM_CATCH_ERROR_END();
 
-  return str;
+  return ims;
+}
+
+/*
+ * The snapshot depends on the client encoding and the converter of the
+ * context since only IMs convertible to the client encoding are
+ * listed. im-list-generation is incremented by Scheme whenever im-list
+ * is modified.
+ */
+static const struct uim_im_info *
+get_im_list(uim_context uc, int *nr)
+{
+  long generation;
+
+  generation = uim_scm_symbol_value_int("im-list-generation");
+  if (!im_list.client_encoding
+      || im_list.generation != generation
+      || im_list.conv_if != uc->conv_if
+      || strcmp(im_list.client_encoding, uc->client_encoding))
+  {
+    free_im_list();
+    uim_scm_call_with_gc_ready_stack((uim_gc_gate_func_ptr)build_im_list_internal, uc);
+    im_list.generation = generation;
+    im_list.conv_if = uc->conv_if;
+    im_list.client_encoding = uim_strdup(uc->client_encoding);
+  }
+
+  *nr = im_list.nr;
+  return im_list.ims;
+}
+
+static void *
+build_im_list_internal(uim_context uc)
+{
+  struct uim_im_info *im;
+  uim_lisp descs, desc, short_desc;
+
+  protected0 = descs = uim_scm_callf("uim-convertible-im-descs", "p", uc);
+  im_list.ims = uim_malloc(sizeof(*im_list.ims) * (uim_scm_length(descs) + 1));
+  for (; !NULLP(descs); descs = CDR(descs)) {
+    desc = CAR(descs);
+    ENSURE((uim_scm_length(desc) == 4), "invalid IM descriptor");
+
+    im = &im_list.ims[im_list.nr++];
+    im->name     = uim_strdup(REFER_C_STR(CAR(desc)));
+    desc = CDR(desc);
+    im->lang     = uim_strdup(REFER_C_STR(CAR(desc)));
+    desc = CDR(desc);
+    im->encoding = uim_strdup(REFER_C_STR(CAR(desc)));
+    desc = CDR(desc);
+    short_desc = CAR(desc);
+    im->short_desc = uim_strdup((FALSEP(short_desc)) ? "-"
+				: REFER_C_STR(short_desc));
+  }
+
+  return NULL;
+}
+
+static void
+free_im_list(void)
+{
+  int i;
+
+  for (i = 0; i < im_list.nr; i++) {
+    free((char *)im_list.ims[i].name);
+    free((char *)im_list.ims[i].lang);
+    free((char *)im_list.ims[i].encoding);
+    free((char *)im_list.ims[i].short_desc);
+  }
+  free(im_list.ims);
+  free(im_list.client_encoding);
+  memset(&im_list, 0, sizeof(im_list));
 }
@@ -444,6 +444,23 @@ enum UPreeditAttr {
   UPreeditAttr_Separator = 8
 };
 
+/* a segment of struct uim_preedit_snapshot */
+struct uim_preedit_segment {
+  int attr;         /* bitwise OR of enum UPreeditAttr */
+  int offset;       /* byte offset in str of the snapshot */
+  int len;          /* length in bytes */
+};
+
+/* whole preedit passed by the callback of uim_set_preedit_snapshot_cb() */
+struct uim_preedit_snapshot {
+  unsigned int generation;  /* changes only if the content changes. never 0 */
+  const char *str;          /* all segments concatenated, in client encoding */
+  int len;                  /* length of str in bytes */
+  const struct uim_preedit_segment *segments;
+  int nr_segments;
+  int cursor;               /* byte offset of the cursor in str, or -1 */
+};
+
 /* Cursor of clipboard text is always positioned at end. */
 enum UTextArea {
   UTextArea_Unspecified = 0,
@@ -571,6 +588,35 @@ uim_create_context(void *ptr,
 void
 uim_release_context(uim_context uc);
 
+/**
+ * Enable or disable the lazy context mode. In the lazy mode,
+ * uim_create_context() only records its arguments, and the input
+ * method is set up on the first focus-in or key event of the context
+ * (or on any other call that needs the input method). This mode is
+ * also enabled by setting the environment variable LIBUIM_LAZY_CONTEXT
+ * to a non-zero value. Call this after uim_init().
+ *
+ * @param lazy UIM_TRUE to create contexts lazily
+ */
+void
+uim_set_lazy_context(uim_bool lazy);
+
+/**
+ * Get the counters of the lazy context mode.
+ *
+ * @param nr_created [out] number of contexts created in the lazy mode
+ * @param nr_materialized [out] number of them whose input method has
+ *        been set up
+ * @param nr_released_unmaterialized [out] number of them released
+ *        without setting up the input method
+ *
+ * Any of the pointers may be NULL.
+ */
+void
+uim_get_lazy_context_stats(unsigned long *nr_created,
+			   unsigned long *nr_materialized,
+			   unsigned long *nr_released_unmaterialized);
+
 /**
  * Reset input context to neutral state.
  *
@@ -654,6 +700,28 @@ uim_set_preedit_cb(uim_context uc,
 		   /* page change cb .. etc will be here */
 		   void (*update_cb)(void *ptr));
 
+/**
+ * Set callback function to be called with the whole preedit when the
+ * preedit string changes. This can be used instead of or together with
+ * the callbacks of uim_set_preedit_cb. The snapshot is made when the
+ * update of the preedit is requested, and its generation is not
+ * changed if the content is same as the previous snapshot, so the
+ * application can skip redrawing by comparing it with the generation
+ * of the last drawn snapshot. 0 is never used as a generation.
+ *
+ * @param uc input context
+ * @param snapshot_cb called when the changes of preedit string should be
+ * updated graphically. 1st argument is "ptr" and 2nd argument is the
+ * snapshot, which is valid only while the callback is called. NULL
+ * disables the snapshot.
+ *
+ * @see uim_set_preedit_cb
+ */
+void
+uim_set_preedit_snapshot_cb(uim_context uc,
+			    void (*snapshot_cb)(void *ptr,
+						const struct uim_preedit_snapshot *snapshot));
+
 /* dealing pressing key */
 /**
  * Send key press event to uim context
@@ -678,6 +746,32 @@ uim_press_key(uim_context uc, int key, int state);
 int
 uim_release_key(uim_context uc, int key, int state);
 
+/* a key event passed to uim_press_keys() */
+struct uim_key_event {
+  int key;
+  int state;
+  int release;  /* nonzero for a key release */
+  int result;   /* [out] same as the return value of uim_press_key() */
+};
+/**
+ * Send key events to uim context at once. The events are processed in
+ * one GC-ready stack frame, and the preedit update and the candidate
+ * selection requested by the IM are delivered to the callbacks only
+ * once with the final state after the last processed event.
+ *
+ * Processing stops after a key press that the IM has not handled, so
+ * that the caller can handle it before the following events. Pass the
+ * remaining events again in that case.
+ *
+ * @param uc input context which events go to
+ * @param events key events. The result of each processed event is set.
+ * @param nr_events number of events
+ *
+ * @return number of processed events
+ */
+int
+uim_press_keys(uim_context uc, struct uim_key_event *events, int nr_events);
+
 /**
  * Change client encoding of an input context.
  *
@@ -743,6 +837,29 @@ const char *uim_get_im_short_desc(uim_context uc, int nth);
  */
 const char *uim_get_im_encoding(uim_context uc, int nth);
 
+/* a descriptor of input method returned by uim_get_im_list() */
+struct uim_im_info {
+  const char *name;
+  const char *lang;        /* ISO 639-1 language code such as "ja" */
+  const char *encoding;
+  const char *short_desc;  /* "-" if not provided */
+};
+
+/**
+ * Get the descriptors of all input methods listed by uim_get_nr_im()
+ * at once. The array is cached and rebuilt only when the list of
+ * input methods or the client encoding changes.
+ *
+ * @warning you must neither modify nor free the result.
+ *
+ * @param uc input context
+ * @param nr [out] number of input methods
+ *
+ * @return array of nr descriptors, NULL on error. only valid until
+ *         next call of this function or the uim_get_im_*() functions.
+ */
+const struct uim_im_info *uim_get_im_list(uim_context uc, int *nr);
+
 
 /**
  * Get the default input method engine name.
@@ -821,19 +938,49 @@ void uim_delay_activating(uim_context uc, int *nr, int *display_limit, int *sele
  * @param accel_enumeration_hint index of the first candidate displayed in
  * the candidate selector
  *
- * @warning You must free the result by uim_candidate_free
- *
- * @see uim_candidate_free
+ * @warning The result is valid until it is freed by uim_candidate_free
+ * or the candidate selector is activated or deactivated next time and
+ * the callback has returned, whichever comes first. Copy the strings if
+ * you need them longer.
  *
  * @return data of candidate
  */
 uim_candidate uim_get_candidate(uim_context uc, int index, int accel_enumeration_hint);
 /**
- * Free the result of uim_get_candidate.
+ * Free the result of uim_get_candidate. Most candidates are owned by
+ * uim_context and this does nothing for them, but call it for every
+ * candidate since the rest are allocated separately.
  *
  * @param cand the data you want to free
  */
 void uim_candidate_free(uim_candidate cand);
+/**
+ * Get data of consecutive candidates at once, typically a page of the
+ * candidate selector. This is equivalent to calling
+ * uim_get_candidate(uc, start + i, i) for each i but enters the IM
+ * only once.
+ *
+ * @param uc input context
+ * @param start index of the first candidate you want to get
+ * @param count number of candidates
+ * @param out [out] array of at least count elements to store the
+ * candidates
+ *
+ * @warning The results are valid for the same period as the result of
+ * uim_get_candidate.
+ *
+ * @see uim_get_candidate
+ *
+ * @return count on success, -1 on error
+ */
+int uim_get_candidates(uim_context uc, int start, int count, uim_candidate *out);
+/**
+ * Free the result of uim_get_candidates as uim_candidate_free does.
+ *
+ * @param cands the array filled by uim_get_candidates
+ * @param count number of candidates in cands
+ */
+void uim_candidates_free(uim_candidate *cands, int count);
 
 int   uim_get_candidate_index(uim_context uc);
 /**
@@ -847,7 +994,7 @@ void  uim_set_candidate_index(uim_context uc, int index);
 /**
  * Get the string of candidate.
  *
- * @warning You must not free the result. All datas are freed by calling uim_candidate_free.
+ * @warning You must not free the result. All data are owned by uim_context.
  *
  * @param cand the data you got by calling uim_get_candidate
  *
@@ -859,7 +1006,7 @@ const char *uim_candidate_get_cand_str(uim_candidate cand);
 /**
  * Get the string of candidate's heading label.
  *
- * @warning You must not free the result. All datas are freed by calling uim_candidate_free.
+ * @warning You must not free the result. All data are owned by uim_context.
  *
  * @param cand the data you got by uim_get_candidate
  *
@@ -872,7 +1019,7 @@ const char *uim_candidate_get_heading_label(uim_candidate cand);
 /**
  * Get the string of candidate's annotation.
  *
- * @warning You must not free the result. All datas are freed by calling uim_candidate_free.
+ * @warning You must not free the result. All data are owned by uim_context.
  * @warning If no data is available, return string is "" (empty string).
  *
  * @param cand the data you got by uim_get_candidate
@@ -260,9 +260,16 @@ helper_str_parse(char *str)
     }
 }
 
+static int helper_watch_mask;
+
 static void
-helper_read_cb(int fd, int /* ev */)
+helper_read_cb(int fd, int ev)
 {
+    if (ev == WRITE_OK) {
+	uim_helper_flush_messages(fd);
+	return;
+    }
+
     uim_helper_read_proc(fd);
     char *tmp;
     while ((tmp = uim_helper_get_message())) {
@@ -277,6 +284,7 @@ helper_disconnect_cb(void)
     remove_current_fd_watch(lib_uim_fd);
     close(lib_uim_fd);
     lib_uim_fd = -1;
+    helper_watch_mask = 0;
 }
 
 void
@@ -284,8 +292,29 @@ check_helper_connection(void)
 {
     if (lib_uim_fd < 0) {
 	lib_uim_fd = uim_helper_init_client_fd(helper_disconnect_cb);
-	if (lib_uim_fd >= 0)
+	if (lib_uim_fd >= 0) {
 	    add_fd_watch(lib_uim_fd, READ_OK, helper_read_cb);
+	    helper_watch_mask = READ_OK;
+	}
+    }
+}
+
+// Watch the connection for writability while messages which the
+// socket hasn't accepted yet are queued.
+void
+update_helper_fd_watch(void)
+{
+    int mask;
+
+    if (lib_uim_fd < 0)
+	return;
+
+    mask = READ_OK;
+    if (uim_helper_pending_messages(lib_uim_fd))
+	mask |= WRITE_OK;
+    if (mask != helper_watch_mask) {
+	add_fd_watch(lib_uim_fd, mask, helper_read_cb);
+	helper_watch_mask = mask;
     }
 }
 
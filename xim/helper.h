@@ -37,6 +37,7 @@
 void check_helper_connection();
 void helper_disconnect_cb();
 void send_im_list();
+void update_helper_fd_watch();
 
 #endif
 /*
@@ -158,6 +158,8 @@ static void main_loop()
 #endif
 	tv.tv_usec = 0;
 
+	update_helper_fd_watch();
+
 	std::map<int, fd_watch_struct>::iterator it;
 	int  fd_max = 0;
 	for (it = fd_watch_stat.begin(); it != fd_watch_stat.end(); ++it) {
@@ -182,16 +184,15 @@ static void main_loop()
 	    int fd = it->first;
 	    if (FD_ISSET(fd, &rfds))
 		it->second.fn(fd, READ_OK);
-	    if (FD_ISSET(fd, &wfds))
+	    // the watch may have been removed by the read callback
+	    it = fd_watch_stat.find(fd);
+	    if (it != fd_watch_stat.end() && FD_ISSET(fd, &wfds))
 		it->second.fn(fd, WRITE_OK);
 	    // fd_watch_stat may be modified by above functions at
 	    // this point.  Since the behavior with incrementing
 	    // invalidated iterator is compiler dependent, use safer
-	    // way.
-	    it = fd_watch_stat.find(fd);
-	    if (it == fd_watch_stat.end())	// shouldn't happen
-		break;
-	    ++it;
+	    // way.  The watch of fd itself may be gone.
+	    it = fd_watch_stat.upper_bound(fd);
 	}
 #if UIM_XIM_USE_DELAY
 	timer_check();
@@ -961,6 +961,7 @@ void InputContext::prepare_page_candidates(int page)
     const char *annotation_str;
     char *str;
     CandList candidates;
+    std::vector<uim_candidate> cands;
 
     if (page < 0)
 	return;
@@ -974,14 +975,21 @@ void InputContext::prepare_page_candidates(int page)
     else
 	page_nr = mNumCandidates - start;
 
+    if (page_nr > 0) {
+	cands.resize(page_nr);
+	if (uim_get_candidates(mUc, start, page_nr, &cands[0]) != page_nr)
+	    cands.assign(page_nr, (uim_candidate)NULL);
+    }
+
     for (i = 0; i < page_nr; i++) {
-	uim_candidate cand;
-	cand = uim_get_candidate(mUc, (i + start),
-			mDisplayLimit ? (i + start) % mDisplayLimit :
-					(i + start));
-	cand_str = uim_candidate_get_cand_str(cand);
-	heading_label = uim_candidate_get_heading_label(cand);
-	annotation_str = uim_candidate_get_annotation_str(cand);
+	uim_candidate cand = cands[i];
+	if (cand) {
+	    cand_str = uim_candidate_get_cand_str(cand);
+	    heading_label = uim_candidate_get_heading_label(cand);
+	    annotation_str = uim_candidate_get_annotation_str(cand);
+	} else {
+	    cand_str = heading_label = annotation_str = NULL;
+	}
 	if (cand_str && heading_label && annotation_str) {
 	    str = (char *)malloc(strlen(cand_str) + strlen(heading_label) + strlen(annotation_str) + 3);
 	    sprintf(str, "%s\a%s\a%s", heading_label, cand_str, annotation_str);
@@ -991,7 +999,8 @@ void InputContext::prepare_page_candidates(int page)
 	    fprintf(stderr, "Warning: cand_str at %d is NULL\n", i);
 	    candidates.push_back((const char *)strdup("\a\a"));
 	}
-	uim_candidate_free(cand);
+	if (cand)
+	    uim_candidate_free(cand);
     }
 
     mCandidateSlot[page] = candidates;